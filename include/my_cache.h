@@ -0,0 +1,57 @@
+/**
+ * @file my_cache.h
+ * @author Kai Dewey
+ * @brief Cache of the contents of files the server sends often
+ */
+
+#ifndef MY_CACHE_H
+#define MY_CACHE_H
+
+#include "common.h"
+
+#include <sys/stat.h>
+
+#define FILE_CACHE_DEFAULT_CAPACITY (64LL * 1024 * 1024) // bytes of file contents kept by default
+
+/// @brief Contents of a file as it was when it was read, shared by the sends of the file
+typedef struct file_cache_entry_t file_cache_entry_t;
+
+/// @brief Set how many bytes of file contents the cache keeps, FILE_CACHE_DEFAULT_CAPACITY by
+/// default. The least recently used files are dropped first, and files larger than a quarter of
+/// the capacity are never kept, so one large file can't push out every small one. 0 turns the
+/// cache off. The cache is shared by all threads.
+/// @param capacity bytes
+void set_file_cache(long long capacity);
+
+/// @brief Get the contents of a file. A file is only found if its device, inode, size and
+/// modification time still match the ones of st. Otherwise, if the file fits and it was asked
+/// for before within a minute, it is read into the cache by a thread of the cache, so the later
+/// lookups find it. The caller never waits on that read.
+/// @param path
+/// @param st stat of the file, a regular file
+/// @return the entry, release it with file_cache_release once its data is no longer used.
+/// NULL if the file isn't cached, the caller reads it itself.
+file_cache_entry_t* file_cache_get(const char* path, const struct stat* st);
+
+/// @brief Get the contents of an entry. They stay valid until the entry is released,
+/// even if the file changes or the entry is dropped from the cache.
+/// @param entry
+/// @param size set to the bytes of the file
+/// @return data
+const char* file_cache_data(const file_cache_entry_t* entry, long long* size);
+
+/// @brief Release an entry of file_cache_get
+/// @param entry NULL for none
+void file_cache_release(file_cache_entry_t* entry);
+
+/// @brief Drop a file from the cache, once it is written or removed
+/// @param path
+void file_cache_invalidate(const char* path);
+
+/// @brief Get the counters of the cache
+/// @param hits set to the lookups that found the file
+/// @param misses set to the lookups that had to read it
+/// @param bytes set to the bytes of the files kept
+void file_cache_get_stats(long long* hits, long long* misses, long long* bytes);
+
+#endif // MY_CACHE_H
@@ -0,0 +1,119 @@
+/**
+ * @file my_cc.h
+ * @author Kai Dewey
+ * @brief Congestion control of the data frames sent by my_udp.c
+ */
+
+#ifndef MY_CC_H
+#define MY_CC_H
+
+#include "common.h"
+
+#define BBR_BW_ROUNDS 10 // rounds the bottleneck bandwidth is the max of
+
+enum cc_algorithm {
+    CC_CUBIC, // loss based, cubic window growth (RFC 8312)
+    CC_BBR, // model based, paced at the measured bottleneck bandwidth
+};
+
+typedef enum cc_algorithm cc_algorithm;
+
+/// @brief An acknowledgement as seen by the congestion control
+struct cc_ack_t {
+    int acked; // frames newly acknowledged
+    int inflight; // frames sent and not acknowledged
+    long long rtt_us; // latest round trip sample, 0 if there is none
+    long long srtt_us; // smoothed round trip time, 0 if there is none
+    long long now_us;
+};
+
+typedef struct cc_ack_t cc_ack_t;
+
+typedef struct cc_t cc_t;
+
+/// @brief Callbacks of a congestion control algorithm
+struct cc_ops_t {
+    const char* name;
+    void (*init)(cc_t* cc);
+    void (*on_ack)(cc_t* cc, const cc_ack_t* ack);
+    void (*on_loss)(cc_t* cc, long long now_us); // once per window that lost frames
+    void (*on_timeout)(cc_t* cc, long long now_us);
+    void (*on_resume)(cc_t* cc, double used_cwnd); // a new transfer takes over the state, used_cwnd is the window before the idle time
+};
+
+typedef struct cc_ops_t cc_ops_t;
+
+/// @brief Congestion state of one transfer. Windows and rates are counted in frames.
+struct cc_t {
+    const cc_ops_t* ops;
+    int min_cwnd;
+    int max_cwnd;
+    double cwnd; // frames allowed in flight
+    double pacing_rate; // frames per second, 0 sends without pacing
+
+    union {
+        struct {
+            double ssthresh;
+            double w_max; // window before the last reduction
+            double w_est; // window reno would have, cubic grows at least as fast
+            double k; // seconds from the start of the epoch until the window is back at w_max
+            long long epoch_start_us; // 0 until the first ack after a reduction
+        } cubic;
+
+        struct {
+            int mode;
+            double btl_bw; // bottleneck bandwidth, max of bw_samples
+            double bw_samples[BBR_BW_ROUNDS];
+            int round;
+            long long round_start_us;
+            int round_delivered; // frames acknowledged this round
+            long long min_rtt_us;
+            long long min_rtt_stamp_us;
+            double full_bw; // bandwidth startup last grew to
+            int full_bw_rounds; // rounds since startup grew the bandwidth
+            int cycle; // index into the probe bandwidth gains
+            double pacing_gain;
+            double cwnd_gain;
+        } bbr;
+    };
+};
+
+/// @brief Parse the name of a congestion control algorithm
+/// @param name "cubic" or "bbr"
+/// @param algorithm
+/// @return Return true on failure
+bool cc_parse(const char* name, cc_algorithm* algorithm);
+
+/// @brief Start the congestion control of a transfer
+/// @param cc
+/// @param algorithm
+/// @param initial_cwnd
+/// @param max_cwnd largest window the sender can track
+void cc_init(cc_t* cc, cc_algorithm algorithm, int initial_cwnd, int max_cwnd);
+
+/// @brief Continue the congestion state of the last transfer on the same path in a new
+/// transfer. The window was only validated while it was used, so it is halved for every
+/// rto the path was idle, down to initial_cwnd (RFC 2861). Starts over with cc_init if
+/// the algorithm changed.
+/// @param cc state of the last transfer
+/// @param algorithm
+/// @param initial_cwnd
+/// @param max_cwnd largest window the sender can track
+/// @param idle_us time since the last transfer stopped sending
+/// @param rto_us
+void cc_resume(cc_t* cc, cc_algorithm algorithm, int initial_cwnd, int max_cwnd, long long idle_us, long long rto_us);
+
+void cc_on_ack(cc_t* cc, const cc_ack_t* ack);
+
+void cc_on_loss(cc_t* cc, long long now_us);
+
+void cc_on_timeout(cc_t* cc, long long now_us);
+
+/// @brief Get the number of frames that may be in flight
+int cc_get_window(const cc_t* cc);
+
+/// @brief Get the time between two paced frames
+/// @return microseconds, 0 when frames are not paced
+int cc_get_send_interval_us(const cc_t* cc);
+
+#endif // MY_CC_H
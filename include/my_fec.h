@@ -0,0 +1,37 @@
+/**
+ * @file my_fec.h
+ * @author Kai Dewey
+ * @brief Erasure code that rebuilds lost frames of a block from repair frames
+ */
+
+#ifndef MY_FEC_H
+#define MY_FEC_H
+
+#include "common.h"
+
+#define FEC_MAX_FRAMES 128 // most data frames in a block
+#define FEC_MAX_REPAIRS 128 // most repair frames of a block
+
+/// @brief Add a data frame to a repair frame. A repair frame starts zeroed and gets every
+/// data frame of its block added. The code is a Cauchy Reed-Solomon code over GF(256),
+/// so any k of the k data frames and their repair frames rebuild the block.
+/// @param repair repair frame of size bytes
+/// @param index index of the repair frame in its block, below FEC_MAX_REPAIRS
+/// @param frame index of the data frame in its block, below FEC_MAX_FRAMES
+/// @param data
+/// @param len bytes of data, up to size. Shorter frames count as padded with zeros.
+void fec_encode(char* repair, int index, int frame, const char* data, int len);
+
+/// @brief Rebuild the lost frames of a block
+/// @param frames the k data frames of the block, NULL for the lost ones
+/// @param lens bytes of each data frame that is there
+/// @param k
+/// @param repairs repair frames of the block
+/// @param indices index of each repair frame
+/// @param count number of repair frames
+/// @param lost filled with the lost frames, in the order they have in the block
+/// @param size bytes of a frame
+/// @return Return true if more frames are lost than there are repair frames
+bool fec_decode(const char* const* frames, const int* lens, int k, char* const* repairs, const int* indices, int count, char** lost, int size);
+
+#endif // MY_FEC_H
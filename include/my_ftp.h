@@ -10,12 +10,18 @@
 #include "common.h"
 #include "my_udp.h"
 
-enum ftp_command { // all commands send a ftp_response. The response comes before any sent data.
-    GET, // CMD(s) -> FILENAME(s) -> RESPONSE(r)
-    PUT, // CMD(s) -> FILENAME(s) -> DATA(s)
-    DELETE, // CMD(s) -> FILENAME(s)
-    LS, // CMD(s) -> RESPONSE(r)
-    EXIT, // CMD(s)
+#include <sys/stat.h>
+
+// Every command is one request message and one reply message, see ftp_message_t. Files up
+// to FTP_INLINE_MAX bytes and the list of LS travel inside them, larger files follow as a
+// data transfer right after the request (PUT) or the reply (GET).
+enum ftp_command {
+    GET, // REQUEST(s) -> REPLY(r) [-> DATA(r)]
+    PUT, // REQUEST(s) [-> DATA(s)] -> REPLY(r)
+    DELETE, // REQUEST(s) -> REPLY(r)
+    LS, // REQUEST(s) -> REPLY(r), see FTP_LISTING
+    EXIT, // REQUEST(s) -> REPLY(r)
+    RESUME, // REQUEST(s) -> REPLY(r), see FTP_RESUME
 };
 
 enum ftp_response {
@@ -26,10 +32,212 @@ enum ftp_response {
 typedef enum ftp_command ftp_command;
 typedef enum ftp_response ftp_response;
 
-void handle_session(int s);
+#define FTP_MAGIC 0x32505446 // "FTP2", legacy clients send a bare ftp_command instead of a message
+#define FTP_INLINE 0x1 // the data is in the message, no data transfer follows
+#define FTP_INLINE_MAX (64 * 1024) // largest file sent inside a message
+#define FTP_LISTING 0x2 // LS: the request asks for a page of entries instead of the text list, the reply holds one
+#define FTP_LISTING_MORE 0x4 // LS: more entries follow the ones of the reply
+#define FTP_LISTING_MAX 1024 // most entries in a page, the reply is also kept within FTP_INLINE_MAX bytes
+#define FTP_ENTRY_HEADER 18 // bytes of an entry before its name: size, mtime and the length of the name
+#define FTP_TEMP_PREFIX ".uftp-" // uploads are written to a file with this prefix next to their name, LS skips them
+#define FTP_RESUME 0x8 // GET, PUT and RESUME: an ftp_resume_t follows the filename, see ftp_resume_t
+#define FTP_PARTIAL_SUFFIX ".part" // a partial file is named FTP_TEMP_PREFIX, its name and this suffix
+#define FTP_JOURNAL_SUFFIX ".journal" // the journal of a partial file is named FTP_TEMP_PREFIX, its name and this suffix
+#define FTP_UPLOAD_SUFFIX ".upload" // the client notes an upload that may resume in a file named FTP_TEMP_PREFIX, its name and this suffix
+#define FTP_JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+
+/// @brief Header of a request or a reply. The filename follows it with its terminator, then
+/// an ftp_resume_t when FTP_RESUME is set, then the data when FTP_INLINE is set.
+struct ftp_message_t {
+    uint32_t magic; // FTP_MAGIC
+    int32_t code; // ftp_command of a request, ftp_response of a reply
+    uint32_t flags;
+    uint32_t name_len; // bytes of the filename including its terminator, 0 without one
+    int64_t size; // bytes of the data of PUT, GET or LS
+};
+
+typedef struct ftp_message_t ftp_message_t;
+
+// An LS request with FTP_LISTING carries the prefix of the names it wants as its filename,
+// none for every file, and an ftp_listing_query_t as its data. The reply carries the entries
+// that follow the cursor in the order of their names, each one FTP_ENTRY_HEADER bytes
+// (int64 size, int64 mtime in seconds, uint16 length of the name) and the name without its
+// terminator. Servers that don't know the flag reply with the text list.
+
+/// @brief Data of an LS request with FTP_LISTING, followed by the cursor
+struct ftp_listing_query_t {
+    uint32_t limit; // most entries to send, up to FTP_LISTING_MAX
+    uint32_t after_len; // bytes of the cursor, the name of the last entry of the previous page. 0 on the first page.
+};
+
+typedef struct ftp_listing_query_t ftp_listing_query_t;
+
+/// @brief An entry of a page of LS
+struct ftp_entry_t {
+    const char* name; // not terminated, points into the page
+    int name_len;
+    long long size;
+    long long mtime; // seconds since the epoch
+};
+
+typedef struct ftp_entry_t ftp_entry_t;
+
+// A file transfer that fails part way resumes where it stopped. The data is written in order,
+// so what the receiver has is the start of the file: it keeps it in a partial file next to the
+// name, with a journal of how many bytes of it are written and of which file they are. The
+// journal is written again as the data arrives, see ftp_journal_due.
+// GET with FTP_RESUME sends the offset the client has and the version of the file from the reply
+// it got then. The server sends the data from that offset if the file is still the same, from the
+// start otherwise, and its reply has FTP_RESUME with the offset and the version of the file.
+// PUT with FTP_RESUME sends the version of the local file and the offset the data starts at, 0
+// unless the client notes an upload of the file that didn't finish. It then first asks with
+// RESUME, the size and the version how many bytes of that upload the server has, and the reply
+// has FTP_RESUME with that offset. A PUT that resumes also sends the hash of the whole file
+// (ftp_hash_t): the server hashes the partial file again from its start as it is written, and
+// only gives the file its name if the hashes match. The reply of the PUT has FTP_RESUME with the
+// hash of what the server wrote, which the client checks when it didn't know the hash yet.
+// Servers that don't know the flag send GET from the start and take the whole PUT, and don't
+// answer RESUME.
+
+/// @brief Where a resumed transfer starts, see FTP_RESUME
+struct ftp_resume_t {
+    int64_t offset; // bytes of the file the receiver has
+    uint64_t version; // of the file, see ftp_file_version
+    uint64_t hash; // PUT: of the whole file, 0 if the client doesn't know it. The reply of PUT: of what the server wrote.
+};
+
+typedef struct ftp_resume_t ftp_resume_t;
+
+/// @brief Journal of a partial file, a range of bytes from its start
+struct ftp_journal_t {
+    uint32_t magic; // FTP_JOURNAL_MAGIC
+    uint32_t reserved;
+    int64_t size; // bytes of the whole file
+    uint64_t version; // see ftp_resume_t
+    int64_t offset; // bytes from the start of the file that are written
+    uint64_t hash; // the note of an upload on the client: of the whole file, 0 until it is known
+};
+
+typedef struct ftp_journal_t ftp_journal_t;
+
+/// @brief Build a request or a reply
+/// @param code ftp_command or ftp_response
+/// @param flags FTP_LISTING and FTP_LISTING_MORE, FTP_INLINE and FTP_RESUME are set with their part
+/// @param filename NULL for none
+/// @param resume sent with FTP_RESUME when not NULL
+/// @param data sent inline when not NULL, otherwise size bytes follow in a data transfer
+/// @param size
+/// @param len set to the length of the message
+/// @return the message, the caller frees it. NULL on failure
+char* ftp_pack(int code, uint32_t flags, const char* filename, const ftp_resume_t* resume, const char* data, long long size, long long* len);
+
+/// @brief Read a request or a reply
+/// @param msg
+/// @param len
+/// @param header set to the header
+/// @param filename set to the filename, NULL without one
+/// @param resume set with FTP_RESUME, zeroed without it
+/// @param data set to the inline data, NULL without it
+/// @return Return true if msg is not a valid message
+bool ftp_unpack(const char* msg, long long len, ftp_message_t* header, const char** filename, ftp_resume_t* resume, const char** data);
+
+/// @brief Add an entry to a page of LS
+/// @param buf room for FTP_ENTRY_HEADER + name_len bytes
+/// @param name
+/// @param name_len up to UINT16_MAX
+/// @param size
+/// @param mtime
+/// @return bytes written
+int ftp_pack_entry(char* buf, const char* name, int name_len, long long size, long long mtime);
+
+/// @brief Read the next entry of a page of LS
+/// @param data the page
+/// @param len
+/// @param offset of the entry, moved past it
+/// @param entry set to the entry
+/// @return Return true at the end of the page, or if the entry is cut
+bool ftp_unpack_entry(const char* data, long long len, long long* offset, ftp_entry_t* entry);
+
+/// @brief Hash of a file that is read in order while it is sent or written, see FTP_RESUME
+struct ftp_hash_t {
+    uint64_t state;
+    int64_t offset; // bytes hashed, whole words until the end of the file
+    int64_t len; // bytes of the file
+};
+
+typedef struct ftp_hash_t ftp_hash_t;
+
+/// @brief Start the hash of a file
+/// @param hash
+/// @param len bytes of the file
+void ftp_hash_init(ftp_hash_t* hash, long long len);
+
+/// @brief Hash the bytes of a file from where the hash is to end. Only whole words are hashed
+/// before the end of the file, the rest waits for the next update.
+/// @param hash
+/// @param fd
+/// @param end
+/// @return Return true if the file can't be read or is shorter
+bool ftp_hash_update(ftp_hash_t* hash, int fd, long long end);
+
+/// @brief Get the hash of the whole file
+/// @param hash updated to the end of the file
+/// @return the hash
+uint64_t ftp_hash_final(const ftp_hash_t* hash);
+
+/// @brief Get the version of a file, it changes when the file is written or replaced
+/// @param st
+/// @return a hash of its device, inode, size and modification time
+uint64_t ftp_file_version(const struct stat* st);
+
+/// @brief Get the name of the partial file of a file, or of its journal, in the same directory
+/// @param filename
+/// @param suffix FTP_PARTIAL_SUFFIX or FTP_JOURNAL_SUFFIX
+/// @return the name, the caller frees it. NULL on failure
+char* ftp_partial_name(const char* filename, const char* suffix);
+
+/// @brief Read the journal of a partial file
+/// @param path
+/// @param journal
+/// @return Return true if there is none, or it is not a journal
+bool ftp_journal_read(const char* path, ftp_journal_t* journal);
+
+/// @brief Write the journal of a partial file
+/// @param path
+/// @param journal
+/// @param sync sync it before returning
+/// @return Return true on failure
+bool ftp_journal_write(const char* path, const ftp_journal_t* journal, bool sync);
+
+/// @brief Check if the journal of a partial file is due to be written again. Under SYNC_NONE
+/// it is rewritten every SYNC_BATCH_BYTES, since that costs no sync. With SYNC_BATCHED each
+/// rewrite syncs the data, so it waits for more of it, and SYNC_STRICT has it synced already.
+/// @param journal
+/// @param offset bytes from the start of the file that are written now
+/// @return true if it is
+bool ftp_journal_due(const ftp_journal_t* journal, long long offset);
 
-// void handler();
+/// @brief Record in the journal of a partial file that the bytes before offset are written.
+/// Unless the policy is SYNC_NONE the data is synced first, then the journal.
+/// @param path of the journal
+/// @param fd of the partial file
+/// @param journal its offset is set
+/// @param offset
+/// @return Return true on failure
+bool ftp_journal_checkpoint(const char* path, int fd, ftp_journal_t* journal, long long offset);
 
-// void recv_command();
+/// @brief Serve the commands of every client on the socket. An upload is written to a
+/// temporary file, preallocated to the size of the request, and renamed to its name once it
+/// is complete, so a failed upload keeps the old file. How it reaches the disk follows
+/// set_sync_policy: with SYNC_BATCHED and SYNC_STRICT it is synced before the rename, and with
+/// SYNC_STRICT the directory is synced after it, before the reply. An upload with FTP_RESUME
+/// is written to its partial file instead, which is hashed and journaled as it is written,
+/// renamed only if its hash matches the one of the request, and kept with its journal when
+/// the upload fails, cut to what the journal records. Temporary and partial files nothing
+/// wrote for a day are removed. Each client gets a session, keyed by its address, and the
+/// transfers of all sessions run at once. Never returns. Threads may each run a server on
+/// their own socket.
+/// @param s bound socket
+void run_server(int s);
 
 #endif // MY_FTP_H
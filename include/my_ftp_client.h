@@ -10,11 +10,40 @@
 #include "common.h"
 #include "my_ftp.h"
 
-char* ftp_get(int s, char* filename, int* len);
-void ftp_put(int s, char* filename, char* filedata, int filedata_len);
-void ftp_delete(int s, char* filename);
-char* ftp_ls(int s);
-void ftp_exit(int s);
+// The commands run on a peer of the server, see peer_create. It keeps what the transfers
+// learn about the path, so each command continues from the round trip, congestion window
+// and loss of the last one.
+
+/// @brief Ask the server for a file. Small files come with the reply, otherwise the file data
+/// follows, receive it with peer_recv_data or peer_recv_data_to_fd_at.
+/// @param peer
+/// @param filename
+/// @param resume NULL for the whole file, or the start of the file the client has, see FTP_RESUME.
+/// Set to where the data that follows starts and to the version of the file.
+/// @param data set to the file when it came with the reply, the caller frees it. NULL when it follows.
+/// @param len set to the size of the file
+/// @return Return true on failure
+bool ftp_get_request(peer_t* peer, char* filename, ftp_resume_t* resume, char** data, long long* len);
+char* ftp_get(peer_t* peer, char* filename, long long* len);
+void ftp_put(peer_t* peer, char* filename, char* filedata, long long filedata_len);
+/// @brief Put a file, the data is read from fd while it is sent instead of being loaded first.
+/// A PUT of the same file that failed part way resumes where the server has it to, see FTP_RESUME.
+void ftp_put_from_fd(peer_t* peer, char* filename, int fd, long long filedata_len);
+void ftp_delete(peer_t* peer, char* filename);
+char* ftp_ls(peer_t* peer);
+/// @brief Ask the server for a page of the files, see ftp_listing_query_t. Read the
+/// entries of the page with ftp_unpack_entry.
+/// @param peer
+/// @param prefix only names that start with it, NULL for all
+/// @param after the name of the last entry of the previous page, NULL on the first page
+/// @param after_len
+/// @param limit most entries, up to FTP_LISTING_MAX
+/// @param data set to the page. Servers without FTP_LISTING send the text list of all files instead.
+/// @param len set to the bytes of data
+/// @param flags set to FTP_LISTING for a page, with FTP_LISTING_MORE if more entries follow it
+/// @return the reply that holds data, the caller frees it. NULL on failure
+char* ftp_ls_page(peer_t* peer, const char* prefix, const char* after, int after_len, int limit, const char** data, long long* len, uint32_t* flags);
+void ftp_exit(peer_t* peer);
 
 void repl(int sockfd);
 
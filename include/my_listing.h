@@ -0,0 +1,36 @@
+/**
+ * @file my_listing.h
+ * @author Kai Dewey
+ * @brief Index of the files of the directory the server serves, for LS
+ */
+
+#ifndef MY_LISTING_H
+#define MY_LISTING_H
+
+#include "common.h"
+
+// The index holds the name, size and modification time of every regular file of the
+// working directory, sorted by name. It is read once with getdents64 and fstatat and then
+// kept up to date from inotify: each LS first applies the events since the last one, so it
+// costs the same however many files the directory holds. Without inotify, or when its queue
+// overflows, the index is read again. It is shared by all threads.
+
+/// @brief Read the index and start watching the directory, so the first LS doesn't wait for it
+void listing_open();
+
+/// @brief Get the list of the files, one name per line
+/// @param len set to the bytes of the list with its terminator
+/// @return the list, the caller frees it. NULL on failure
+char* listing_get_text(long long* len);
+
+/// @brief Get a page of the files, see ftp_listing_query_t
+/// @param prefix only names that start with it, NULL for all
+/// @param after only names that sort after it, NULL from the first one
+/// @param after_len
+/// @param limit most entries, up to FTP_LISTING_MAX. The page also stays within FTP_INLINE_MAX bytes.
+/// @param len set to the bytes of the page
+/// @param more set if more names follow the page
+/// @return the entries packed with ftp_pack_entry, the caller frees it. NULL on failure
+char* listing_get_page(const char* prefix, const char* after, int after_len, int limit, long long* len, bool* more);
+
+#endif // MY_LISTING_H
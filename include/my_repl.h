@@ -8,8 +8,9 @@
 #define MY_REPL_H
 
 #include "common.h"
+#include "my_udp.h"
 
-bool handle_line(int sockfd, char* line);
+bool handle_line(peer_t* peer, char* line);
 void my_repl(int sockfd);
 
 #endif // MY_REPL_H
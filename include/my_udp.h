@@ -8,8 +8,10 @@
 #define MY_UDP_H
 
 #include "common.h"
+#include "my_cc.h"
 
-#define PACKET_SIZE 1024
+#define PACKET_SIZE 1024 // payload of a frame unless both sides agree on another size
+#define MAX_PACKET_SIZE (63 * 1024)
 #define RETRY_COUNT 10
 
 
@@ -17,11 +19,209 @@ typedef struct sockaddr_in sockaddr_in;
 typedef struct sockaddr sockaddr;
 typedef struct sockaddr_storage sockaddr_storage;
 
+/// @brief Round trip estimate of the transport, see get_rtt_info
+struct rtt_info_t {
+    int srtt_us; // smoothed round trip time, 0 before the first measurement
+    int rttvar_us; // round trip time variation
+    int rto_ms; // current retransmission timeout, including backoff
+};
+
+typedef struct rtt_info_t rtt_info_t;
+
 void handle_error(const char* msg);
-void clear_remaining_input(int sockfd);
 
-int send_data(int sockfd, const char* msg, int len, sockaddr* dest_addr, socklen_t* dest_addr_len);
+/// @brief Send and receive data frames in batches of datagrams per syscall, on by default where supported
+void set_batch_io(bool enabled);
+
+/// @brief Drive the sockets and files of each thread through an io_uring instead of poll and
+/// one syscall per operation, off by default. Falls back to poll where io_uring is not available.
+void set_io_uring(bool enabled);
+
+/// @brief Set the largest frame payload this side wants to use. A transfer uses the smaller
+/// of the sizes set on both sides, and PACKET_SIZE with peers that don't negotiate.
+void set_packet_size(int packet_size);
+
+/// @brief Choose the congestion control of the following transfers, CC_BBR by default
+void set_congestion_control(cc_algorithm algorithm);
+
+/// @brief Ask the receivers of the following transfers to ack every frames data frames at
+/// once instead of each one, 10 by default. They still ack gaps, duplicates and the frames
+/// that fill the window right away, and hold an ack back for at most a few ms.
+void set_ack_frequency(int frames);
+
+/// @brief Send the data frames of files with MSG_ZEROCOPY, so the kernel sends them from the
+/// pages of the file without a copy. Off by default: pinning the pages and reading the
+/// completions only pays off for large frames on a real NIC, and the transport stops using
+/// it on a socket once the kernel reports that it copied anyway, as it does over loopback.
+/// Files are sent from a mapping either way, and not with io_uring.
+/// @param enabled
+void set_zerocopy(bool enabled);
+
+#define FEC_ADAPTIVE -1.0 // set_fec: size the repair frames to the loss the receiver reports
+
+/// @brief Send repair frames with the data frames of the following transfers, off by default.
+/// Each block of data frames gets ratio repair frames per frame, and the receiver rebuilds
+/// lost frames from them instead of waiting a round trip for them to be resent. Receivers
+/// that don't support it, and transfers without selective repeat, send no repair frames.
+/// @param ratio repair frames per data frame, 0 for none or FEC_ADAPTIVE
+void set_fec(double ratio);
+
+/// @brief Parse the argument of set_fec
+/// @param arg "auto" for FEC_ADAPTIVE, or repair frames per data frame, like 0.25
+/// @param ratio
+/// @return Return true on failure
+bool fec_parse(const char* arg, double* ratio);
+
+enum sync_policy {
+    SYNC_NONE, // leave the writes of received files to the page cache
+    SYNC_BATCHED, // start writing back every SYNC_BATCH_BYTES received
+    SYNC_STRICT, // also wait for the previous batch to be on disk before the next one
+};
+
+typedef enum sync_policy sync_policy;
+
+#define SYNC_BATCH_BYTES (8 * 1024 * 1024) // bytes of a received file written back at once
+
+/// @brief Set how the files of recv_data_to_fd go to disk while they are received, SYNC_NONE
+/// by default. Writing them back in batches keeps the disk busy at a steady rate instead of
+/// leaving it all to a flush at the end, and with SYNC_STRICT at most two batches are dirty.
+/// Callers that want the file on disk still sync it once the transfer is done.
+/// @param policy
+void set_sync_policy(sync_policy policy);
+
+sync_policy get_sync_policy();
+
+/// @brief Parse a sync policy
+/// @param arg "none", "batched" or "strict"
+/// @param policy
+/// @return Return true on failure
+bool sync_policy_parse(const char* arg, sync_policy* policy);
+
+/// @brief Get the round trip estimate used to time retransmissions
+void get_rtt_info(rtt_info_t* info);
+
+long long send_data(int sockfd, const char* msg, long long len, sockaddr* dest_addr, socklen_t* dest_addr_len);
+
+/// @brief Send data read from a file as the frames go out, memory use is bounded by the
+/// window instead of the size of the data. The next part of the window is read ahead.
+/// @param sockfd 
+/// @param fd source, read with pread from offset 0
+/// @param len bytes to send
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return bytes sent. -1 on failure
+long long send_data_from_fd(int sockfd, int fd, long long len, sockaddr* dest_addr, socklen_t* dest_addr_len);
+
+void* recv_data(int sockfd, long long* len, sockaddr* client_addr, socklen_t* client_addr_len);
+
+/// @brief Receive data and write it to a file as it arrives, memory use is bounded by the
+/// window instead of the size of the data. The file is truncated to the size of the data.
+/// @param sockfd 
+/// @param fd destination, written with pwrite. -1 to receive and drop the data
+/// @param client_addr 
+/// @param client_addr_len 
+/// @return Return bytes received. -1 on failure
+long long recv_data_to_fd(int sockfd, int fd, sockaddr* client_addr, socklen_t* client_addr_len);
+
+/// @brief One side of the transfers with a peer, driven by the caller instead of blocking.
+/// The calls above run the same transfers to completion.
+typedef struct peer_t peer_t;
+
+enum transfer_status {
+    TRANSFER_RUNNING,
+    TRANSFER_DONE,
+    TRANSFER_FAILED,
+};
+
+typedef enum transfer_status transfer_status;
+
+/// @brief Create the transfer state of a peer
+/// @param sockfd
+/// @param addr where the frames go, NULL if sockfd is connected to the peer
+/// @param addr_len
+/// @return NULL on failure
+peer_t* peer_create(int sockfd, const sockaddr* addr, socklen_t addr_len);
+
+void peer_free(peer_t* peer);
+
+/// @brief Start sending data, msg must stay valid until the transfer is done
+void peer_send_data(peer_t* peer, const char* msg, long long len);
+
+/// @brief Start sending data read from a file, see send_data_from_fd
+void peer_send_data_from_fd(peer_t* peer, int fd, long long len);
+
+/// @brief Start sending the len bytes of a file from offset on, to resume a transfer
+void peer_send_data_from_fd_at(peer_t* peer, int fd, long long offset, long long len);
+
+/// @brief Start receiving data into memory, see peer_take_data
+void peer_recv_data(peer_t* peer);
+
+/// @brief Start receiving data into a file, see recv_data_to_fd
+void peer_recv_data_to_fd(peer_t* peer, int fd);
+
+/// @brief Start receiving data into a file from offset on, to resume a transfer. The bytes
+/// before offset are kept and the file is truncated to offset plus the size of the data.
+void peer_recv_data_to_fd_at(peer_t* peer, int fd, long long offset);
+
+/// @brief Handle a datagram of the peer, see recv_datagram
+void peer_handle_datagram(peer_t* peer, const char* buf, int len);
+
+/// @brief Send what is due and handle expired timers
+void peer_poll(peer_t* peer);
+
+/// @brief Get how long until peer_poll has work to do
+/// @return timeout in ms, -1 if there is no transfer running
+int peer_get_timeout_ms(const peer_t* peer);
+
+transfer_status peer_get_status(const peer_t* peer);
+
+/// @brief Get the length of the data of the transfer, known once it started
+long long peer_get_length(const peer_t* peer);
+
+/// @brief Get how many bytes from the start of the data of the last receive into a file
+/// are written to it, also once it failed. The frames are written in order, so a failed
+/// transfer can resume from there.
+/// @return bytes after the offset of the receive, 0 if a write failed
+long long peer_get_written(const peer_t* peer);
+
+/// @brief Run the transfer of the peer until it is done, blocking on its socket. A peer
+/// keeps what it learns about the path (round trip, congestion window, loss) across its
+/// transfers, so the blocking calls on a peer are reentrant and each transfer continues
+/// where the last one left off, unlike send_data and recv_data, which share one peer per thread.
+/// @param peer
+/// @return Return true on failure
+bool peer_wait(peer_t* peer);
+
+/// @brief Run the transfer of the peer like peer_wait, but return once timeout_ms passed,
+/// so the caller can do its own work while a long transfer runs
+/// @param peer
+/// @param timeout_ms
+/// @return the status of the transfer, TRANSFER_RUNNING if it is not done yet
+transfer_status peer_run(peer_t* peer, int timeout_ms);
+
+/// @brief Get the round trip estimate of a peer, see get_rtt_info
+void peer_get_rtt_info(const peer_t* peer, rtt_info_t* info);
+
+/// @brief Take the data of a finished peer_recv_data, the caller frees it
+/// @return NULL if there is none
+void* peer_take_data(peer_t* peer, long long* len);
+
+/// @brief Get a datagram that is waiting on the socket without blocking
+/// @param sockfd
+/// @param buf the datagram, valid until the next one is received
+/// @param len
+/// @param addr source of the datagram
+/// @param addr_len
+/// @return Return true if there is none
+bool recv_datagram(int sockfd, const char** buf, int* len, sockaddr* addr, socklen_t* addr_len);
+
+/// @brief Check for datagrams that were already taken from the socket. They don't wake up
+/// a poll on the descriptor of get_recv_fd, so don't wait while there are some.
+bool recv_datagram_pending(int sockfd);
 
-void* recv_data(int sockfd, int* len, sockaddr* client_addr, socklen_t* client_addr_len);
+/// @brief Get the descriptor to poll for datagrams of the socket
+/// @param sockfd
+/// @return the io_uring of the thread when it receives for the socket, otherwise sockfd
+int get_recv_fd(int sockfd);
 
 #endif
@@ -0,0 +1,99 @@
+/**
+ * @file my_uring.h
+ * @author Kai Dewey
+ * @brief A small io_uring, set up with the raw syscalls so no library is needed
+ */
+
+#ifndef MY_URING_H
+#define MY_URING_H
+
+#include "common.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+
+/// @brief The mapped queues of a ring, and the buffer ring the kernel picks receive buffers from
+struct uring_t {
+    int fd;
+
+    // submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // sqes handed out, the kernel sees them once they are submitted
+    struct io_uring_sqe* sqes;
+
+    // completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // registered buffer ring, receives with IOSQE_BUFFER_SELECT take their buffer from it
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* buffers;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+};
+
+typedef struct uring_t uring_t;
+
+/// @brief Set up a ring. Needs a kernel that can wait with a timeout (5.11).
+/// @param ring
+/// @param entries size of the submission queue, a power of 2
+/// @return Return true on failure
+bool uring_init(uring_t* ring, unsigned entries);
+
+void uring_free(uring_t* ring);
+
+/// @brief Get a zeroed sqe, submitting the queue first if it is full
+/// @param ring
+/// @return NULL on failure
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+/// @brief Submit the sqes handed out and wait for completions
+/// @param ring
+/// @param wait_nr completions to wait for, 0 to only submit
+/// @param timeout_ms -1 to wait without timeout
+/// @return Return true on failure or timeout, errno is ETIME on timeout
+bool uring_enter(uring_t* ring, unsigned wait_nr, int timeout_ms);
+
+/// @brief Get the oldest completion
+/// @param ring
+/// @return NULL if there is none
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+
+/// @brief Give the completion from uring_peek_cqe back to the kernel
+void uring_cqe_seen(uring_t* ring);
+
+/// @brief Register a buffer ring for receives (5.19)
+/// @param ring
+/// @param group buffer group the receives select from
+/// @param count number of buffers, a power of 2
+/// @param size bytes per buffer
+/// @return Return true on failure
+bool uring_setup_buffers(uring_t* ring, unsigned short group, unsigned count, unsigned size);
+
+/// @brief Get a buffer of the buffer ring
+/// @param ring
+/// @param bid buffer id from the flags of a completion
+/// @return pointer to the buffer
+char* uring_get_buffer(uring_t* ring, unsigned bid);
+
+/// @brief Hand a buffer back to the kernel once its contents are used
+void uring_recycle_buffer(uring_t* ring, unsigned bid);
+
+#endif // __linux__
+
+#endif // MY_URING_H
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Put and get a file larger than 4 GB through a local server.
+# The file is sparse, only a marker every MARKER_STEP bytes is written, so it is quick to create.
+# usage: large_file_test.py [gigabytes]
+
+import subprocess
+import tempfile
+import logging
+import time
+import sys
+import os
+
+logging.basicConfig(format='%(asctime)s [%(levelname)s] %(message)s', level=logging.DEBUG)
+
+PORT = 21234
+PACKET_SIZE = 60000 # large frames keep the transfer short
+MARKER_STEP = 64 * 1024 * 1024
+GIGABYTE = 1024 * 1024 * 1024
+
+current_dir = os.path.dirname(os.path.abspath(__file__))
+size = int(float(sys.argv[1]) * GIGABYTE) if len(sys.argv) > 1 else 4 * GIGABYTE + 12345
+
+def make_sparse_file(path, size):
+    with open(path, 'wb') as f:
+        f.truncate(size)
+        # markers tell misplaced frames apart, including the ones past 2 GB and 4 GB
+        for offset in list(range(0, size, MARKER_STEP)) + [2**31 - 4, 2**32 - 4, size - 8]:
+            if 0 <= offset < size:
+                f.seek(offset)
+                f.write(offset.to_bytes(8, 'little')[:size - offset])
+
+def run_ftp_client(cwd, command):
+    logging.info(f'Running : {command}')
+    start = time.time()
+    process = subprocess.run([os.path.join(current_dir, 'ftp_client'), '-s', str(PACKET_SIZE), '127.0.0.1', str(PORT)],
+        cwd=cwd, input=command + '\nexit\n', capture_output=True, universal_newlines=True, timeout=1800)
+    logging.info(f'{command} took {time.time() - start:.1f} s')
+    if len(process.stderr.strip()) > 0:
+        logging.error(process.stderr.strip())
+
+def same_file(a, b):
+    return os.path.getsize(a) == os.path.getsize(b) and subprocess.run(['cmp', '-s', a, b]).returncode == 0
+
+with tempfile.TemporaryDirectory() as tmp:
+    server_dir = os.path.join(tmp, 'server')
+    client_dir = os.path.join(tmp, 'client')
+    os.mkdir(server_dir)
+    os.mkdir(client_dir)
+
+    original = os.path.join(tmp, 'large.orig')
+    make_sparse_file(original, size)
+    os.link(original, os.path.join(client_dir, 'large.bin'))
+    logging.info(f'Created sparse file of {size} bytes')
+
+    server = subprocess.Popen([os.path.join(current_dir, 'ftp_server'), '-s', str(PACKET_SIZE), str(PORT)],
+        cwd=server_dir, stdout=subprocess.DEVNULL)
+    time.sleep(0.5)
+    try:
+        run_ftp_client(client_dir, 'put large.bin')
+        put_ok = same_file(original, os.path.join(server_dir, 'large.bin'))
+
+        os.unlink(os.path.join(client_dir, 'large.bin'))
+        run_ftp_client(client_dir, 'get large.bin')
+        get_ok = same_file(original, os.path.join(client_dir, 'large.bin'))
+    finally:
+        server.kill()
+        server.wait()
+
+    logging.info(f'put: {"ok" if put_ok else "FAILED"}, get: {"ok" if get_ok else "FAILED"}')
+    sys.exit(0 if put_ok and get_ok else 1)
@@ -0,0 +1,403 @@
+/**
+ * @file my_cache.c
+ * @author Kai Dewey
+ */
+
+#include "my_cache.h"
+
+#include <fcntl.h>
+#include <threads.h>
+#include <time.h>
+
+#define CACHE_BUCKETS 1024 // buckets of the table of files, keyed by path
+#define CACHE_ADMIT_SECONDS 60 // a file is kept once it is asked for twice within this
+#define CACHE_FILLS 16 // files waiting to be read into the cache, more are skipped
+
+/// @brief A file in the cache. Entries live in the table and the LRU list while they are
+/// cached, and are freed once they are dropped and no send uses them anymore.
+struct file_cache_entry_t {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    long long size;
+    struct timespec mtime;
+    char* data;
+    int refs; // sends that use the data
+    bool cached; // in the table and the LRU list
+    struct file_cache_entry_t* next; // next entry in the same bucket
+    struct file_cache_entry_t* newer; // LRU list, toward NEWEST
+    struct file_cache_entry_t* older; // LRU list, toward OLDEST
+};
+
+static long long CAPACITY = FILE_CACHE_DEFAULT_CAPACITY;
+/// @brief A file that was asked for and not kept yet, see file_cache_get
+struct file_cache_seen_t {
+    uint32_t hash; // of the path
+    dev_t dev;
+    ino_t ino;
+    time_t time; // of the miss
+};
+
+/// @brief A file to read into the cache, see fill_entries
+struct file_cache_fill_t {
+    char* path;
+    struct stat st; // of the lookup that admitted the file
+};
+
+static file_cache_entry_t* BUCKETS[CACHE_BUCKETS];
+static struct file_cache_seen_t SEEN[CACHE_BUCKETS]; // last miss of each bucket
+static file_cache_entry_t* NEWEST; // most recently used
+static file_cache_entry_t* OLDEST; // dropped first
+static long long BYTES;
+static long long HITS;
+static long long MISSES;
+static struct file_cache_fill_t FILLS[CACHE_FILLS]; // ring of the files to read
+static int FILLS_HEAD;
+static int FILLS_COUNT;
+static bool FILLER; // the thread that reads them is running
+static mtx_t LOCK; // the threads of the server share the cache
+static cnd_t FILLS_READY; // signaled when a file is queued
+static once_flag LOCK_ONCE = ONCE_FLAG_INIT;
+
+static int fill_entries(void* arg);
+
+static void cache_init(void) {
+    if (mtx_init(&LOCK, mtx_plain) != thrd_success || cnd_init(&FILLS_READY) != thrd_success) {
+        fprintf(stderr, "mtx_init: failed to create the lock of the file cache\n");
+        exit(1);
+    }
+    thrd_t filler;
+    if (thrd_create(&filler, fill_entries, NULL) == thrd_success) {
+        thrd_detach(filler);
+        FILLER = true;
+    }
+    else {
+        fprintf(stderr, "thrd_create: failed to start the reader of the file cache, nothing is cached\n");
+    }
+}
+
+/// @brief Hash a path (FNV-1a)
+/// @param path
+/// @return hash
+static uint32_t hash_path(const char* path) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*)path; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned get_bucket(const char* path) {
+    return hash_path(path) % CACHE_BUCKETS;
+}
+
+/// @brief Note a miss, and check if the file missed before. One-off downloads are then
+/// read from the disk as usual instead of taking the place of the files that are hot.
+/// @param path
+/// @param st
+/// @return true if the file was asked for within CACHE_ADMIT_SECONDS
+static bool admit_file(const char* path, const struct stat* st) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t hash = hash_path(path);
+    struct file_cache_seen_t* seen = &SEEN[hash % CACHE_BUCKETS];
+    bool admit = seen->time != 0 && seen->hash == hash && seen->dev == st->st_dev && seen->ino == st->st_ino
+        && now.tv_sec - seen->time < CACHE_ADMIT_SECONDS;
+    seen->hash = hash;
+    seen->dev = st->st_dev;
+    seen->ino = st->st_ino;
+    seen->time = admit ? 0 : now.tv_sec; // the next miss starts over once the file is read
+    return admit;
+}
+
+static file_cache_entry_t* find_entry(const char* path) {
+    for (file_cache_entry_t* entry = BUCKETS[get_bucket(path)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Check if an entry still holds the file as it is now
+/// @param entry
+/// @param st
+/// @return true if it does
+static bool entry_matches(const file_cache_entry_t* entry, const struct stat* st) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size
+        && entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/// @brief Check if two stats are of the same version of a file
+/// @param a
+/// @param b
+/// @return true if they are
+static bool stat_matches(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void free_entry(file_cache_entry_t* entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static void unlink_lru(file_cache_entry_t* entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    }
+    else {
+        NEWEST = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    }
+    else {
+        OLDEST = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void push_lru(file_cache_entry_t* entry) {
+    entry->older = NEWEST;
+    entry->newer = NULL;
+    if (NEWEST != NULL) {
+        NEWEST->newer = entry;
+    }
+    NEWEST = entry;
+    if (OLDEST == NULL) {
+        OLDEST = entry;
+    }
+}
+
+/// @brief Drop an entry from the cache, it is freed once no send uses it
+/// @param entry
+static void remove_entry(file_cache_entry_t* entry) {
+    file_cache_entry_t** link = &BUCKETS[get_bucket(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    unlink_lru(entry);
+    BYTES -= entry->size;
+    entry->cached = false;
+    if (entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/// @brief Read a file into a new entry
+/// @param path
+/// @param expected stat of the file the caller is about to describe
+/// @return NULL on failure, or if the file is not or no longer the one of expected
+static file_cache_entry_t* read_entry(const char* path, const struct stat* expected) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || !stat_matches(&st, expected)) {
+        close(fd);
+        return NULL;
+    }
+
+    file_cache_entry_t* entry = (file_cache_entry_t*)calloc(1, sizeof(file_cache_entry_t));
+    char* data = (char*)malloc(st.st_size + 1);
+    char* copy = strdup(path);
+    if (entry == NULL || data == NULL || copy == NULL) {
+        perror("malloc");
+        free(entry);
+        free(data);
+        free(copy);
+        close(fd);
+        return NULL;
+    }
+    long long done = 0;
+    while (done < st.st_size) {
+        ssize_t n = pread(fd, data + done, st.st_size - done, done);
+        if (n <= 0) {
+            // the file shrank, the next lookup reads it again
+            free(entry);
+            free(data);
+            free(copy);
+            close(fd);
+            return NULL;
+        }
+        done += n;
+    }
+    // a write while the file was read leaves a mix of the two versions
+    if (fstat(fd, &st) == -1 || !stat_matches(&st, expected)) {
+        free(entry);
+        free(data);
+        free(copy);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    entry->path = copy;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->data = data;
+    return entry;
+}
+
+/// @brief Add an entry that was read to the cache, in place of an older version of the file
+/// @param entry
+/// @param st stat of the file that was read
+static void insert_entry(file_cache_entry_t* entry, const struct stat* st) {
+    file_cache_entry_t* other = find_entry(entry->path);
+    if (other != NULL && entry_matches(other, st)) {
+        // the file was queued twice, it is cached already
+        free_entry(entry);
+        return;
+    }
+    if (CAPACITY == 0 || entry->size > CAPACITY / 4) {
+        // the capacity changed while the file was read
+        free_entry(entry);
+        return;
+    }
+    if (other != NULL) {
+        remove_entry(other);
+    }
+    unsigned bucket = get_bucket(entry->path);
+    entry->next = BUCKETS[bucket];
+    BUCKETS[bucket] = entry;
+    push_lru(entry);
+    BYTES += entry->size;
+    entry->cached = true;
+    while (BYTES > CAPACITY && OLDEST != entry) {
+        remove_entry(OLDEST);
+    }
+}
+
+/// @brief Queue a file to be read into the cache
+/// @param path
+/// @param st
+static void queue_fill(const char* path, const struct stat* st) {
+    if (!FILLER || FILLS_COUNT == CACHE_FILLS) {
+        return;
+    }
+    for (int i = 0; i < FILLS_COUNT; i++) {
+        if (strcmp(FILLS[(FILLS_HEAD + i) % CACHE_FILLS].path, path) == 0) {
+            return;
+        }
+    }
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        perror("strdup");
+        return;
+    }
+    struct file_cache_fill_t* fill = &FILLS[(FILLS_HEAD + FILLS_COUNT) % CACHE_FILLS];
+    fill->path = copy;
+    fill->st = *st;
+    FILLS_COUNT++;
+    cnd_signal(&FILLS_READY);
+}
+
+/// @brief Read the queued files into the cache. The reads run on a thread of their own, so
+/// the loops of the server never wait on them, and without the lock, so the lookups go on.
+/// @param arg unused
+/// @return never returns
+static int fill_entries(void* arg) {
+    (void)arg;
+    mtx_lock(&LOCK);
+    while (true) {
+        while (FILLS_COUNT == 0) {
+            cnd_wait(&FILLS_READY, &LOCK);
+        }
+        struct file_cache_fill_t fill = FILLS[FILLS_HEAD];
+        FILLS_HEAD = (FILLS_HEAD + 1) % CACHE_FILLS;
+        FILLS_COUNT--;
+        mtx_unlock(&LOCK);
+
+        file_cache_entry_t* entry = read_entry(fill.path, &fill.st);
+        free(fill.path);
+
+        mtx_lock(&LOCK);
+        if (entry != NULL) {
+            insert_entry(entry, &fill.st);
+        }
+    }
+    return 0;
+}
+
+void set_file_cache(long long capacity) {
+    call_once(&LOCK_ONCE, cache_init);
+    mtx_lock(&LOCK);
+    CAPACITY = capacity < 0 ? 0 : capacity;
+    while (OLDEST != NULL && BYTES > CAPACITY) {
+        remove_entry(OLDEST);
+    }
+    mtx_unlock(&LOCK);
+}
+
+file_cache_entry_t* file_cache_get(const char* path, const struct stat* st) {
+    call_once(&LOCK_ONCE, cache_init);
+    mtx_lock(&LOCK);
+    if (CAPACITY == 0) {
+        mtx_unlock(&LOCK);
+        return NULL;
+    }
+
+    file_cache_entry_t* entry = find_entry(path);
+    if (entry != NULL && entry_matches(entry, st)) {
+        HITS++;
+        entry->refs++;
+        unlink_lru(entry);
+        push_lru(entry);
+        mtx_unlock(&LOCK);
+        return entry;
+    }
+    MISSES++;
+    if (entry != NULL) {
+        // the file changed since it was read
+        remove_entry(entry);
+    }
+    // this send reads the file from the disk as usual, the later ones find it in memory
+    if (st->st_size <= CAPACITY / 4 && admit_file(path, st)) {
+        queue_fill(path, st);
+    }
+    mtx_unlock(&LOCK);
+    return NULL;
+}
+
+const char* file_cache_data(const file_cache_entry_t* entry, long long* size) {
+    *size = entry->size;
+    return entry->data;
+}
+
+void file_cache_release(file_cache_entry_t* entry) {
+    if (entry == NULL) {
+        return;
+    }
+    mtx_lock(&LOCK);
+    entry->refs--;
+    if (entry->refs == 0 && !entry->cached) {
+        free_entry(entry);
+    }
+    mtx_unlock(&LOCK);
+}
+
+void file_cache_invalidate(const char* path) {
+    call_once(&LOCK_ONCE, cache_init);
+    mtx_lock(&LOCK);
+    file_cache_entry_t* entry = find_entry(path);
+    if (entry != NULL) {
+        remove_entry(entry);
+    }
+    mtx_unlock(&LOCK);
+}
+
+void file_cache_get_stats(long long* hits, long long* misses, long long* bytes) {
+    call_once(&LOCK_ONCE, cache_init);
+    mtx_lock(&LOCK);
+    *hits = HITS;
+    *misses = MISSES;
+    *bytes = BYTES;
+    mtx_unlock(&LOCK);
+}
@@ -0,0 +1,295 @@
+/**
+ * @file my_cc.c
+ * @author Kai Dewey
+ */
+
+#include "my_cc.h"
+
+#include <math.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define CUBIC_SS_PACING_GAIN 2.0 // pace ahead of the window while it doubles every round
+#define CUBIC_CA_PACING_GAIN 1.2
+
+#define BBR_HIGH_GAIN 2.885 // 2 / ln(2), doubles the sending rate every round
+#define BBR_CWND_GAIN 2.0
+#define BBR_MIN_RTT_WINDOW_US 10000000
+#define BBR_MIN_ROUND_US 1000 // shortest round, bandwidth samples of shorter rounds are noise
+#define BBR_FULL_BW_GROWTH 1.25
+#define BBR_FULL_BW_ROUNDS 3
+
+enum bbr_mode {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+};
+
+static const double BBR_PROBE_BW_GAINS[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+#define BBR_CYCLE_LENGTH ((int)(sizeof(BBR_PROBE_BW_GAINS) / sizeof(BBR_PROBE_BW_GAINS[0])))
+
+static void cc_clamp_cwnd(cc_t* cc) {
+    cc->cwnd = MAX(cc->min_cwnd, MIN(cc->cwnd, cc->max_cwnd));
+}
+
+static void cubic_init(cc_t* cc) {
+    cc->cubic.ssthresh = cc->max_cwnd;
+    cc->cubic.w_max = 0;
+    cc->cubic.w_est = 0;
+    cc->cubic.k = 0;
+    cc->cubic.epoch_start_us = 0;
+}
+
+static void cubic_on_ack(cc_t* cc, const cc_ack_t* ack) {
+    if (cc->cwnd < cc->cubic.ssthresh) {
+        // slow start
+        cc->cwnd += ack->acked;
+    }
+    else {
+        if (cc->cubic.epoch_start_us == 0) {
+            cc->cubic.epoch_start_us = ack->now_us;
+            cc->cubic.w_est = cc->cwnd;
+            cc->cubic.k = cc->cwnd < cc->cubic.w_max ? cbrt((cc->cubic.w_max - cc->cwnd) / CUBIC_C) : 0;
+            if (cc->cwnd >= cc->cubic.w_max) {
+                cc->cubic.w_max = cc->cwnd;
+            }
+        }
+
+        // aim for the window the curve reaches one round trip from now
+        double t = (ack->now_us - cc->cubic.epoch_start_us + ack->srtt_us) / 1e6;
+        double target = CUBIC_C * pow(t - cc->cubic.k, 3) + cc->cubic.w_max;
+        if (target > cc->cwnd) {
+            cc->cwnd += (target - cc->cwnd) / cc->cwnd * ack->acked;
+        }
+        else {
+            cc->cwnd += 0.01 * ack->acked / cc->cwnd;
+        }
+
+        // never grow slower than reno would
+        cc->cubic.w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ack->acked / cc->cwnd;
+        cc->cwnd = MAX(cc->cwnd, cc->cubic.w_est);
+    }
+    cc_clamp_cwnd(cc);
+
+    if (ack->srtt_us > 0) {
+        double gain = cc->cwnd < cc->cubic.ssthresh ? CUBIC_SS_PACING_GAIN : CUBIC_CA_PACING_GAIN;
+        cc->pacing_rate = gain * cc->cwnd * 1e6 / ack->srtt_us;
+    }
+}
+
+static void cubic_on_loss(cc_t* cc, long long now_us) {
+    (void)now_us;
+
+    // release bandwidth to new flows if the window did not recover since the last loss
+    if (cc->cwnd < cc->cubic.w_max) {
+        cc->cubic.w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    }
+    else {
+        cc->cubic.w_max = cc->cwnd;
+    }
+    cc->cwnd *= CUBIC_BETA;
+    cc_clamp_cwnd(cc);
+    cc->cubic.ssthresh = cc->cwnd;
+    cc->cubic.epoch_start_us = 0;
+}
+
+static void cubic_on_timeout(cc_t* cc, long long now_us) {
+    cubic_on_loss(cc, now_us);
+    cc->cwnd = cc->min_cwnd;
+}
+
+static void cubic_on_resume(cc_t* cc, double used_cwnd) {
+    // slow start back to most of the window that was used, then a new epoch of the curve
+    cc->cubic.ssthresh = MAX(cc->cubic.ssthresh, 0.75 * used_cwnd);
+    cc->cubic.epoch_start_us = 0;
+}
+
+static void bbr_init(cc_t* cc) {
+    memset(&cc->bbr, 0, sizeof(cc->bbr));
+    cc->bbr.mode = BBR_STARTUP;
+    cc->bbr.pacing_gain = BBR_HIGH_GAIN;
+    cc->bbr.cwnd_gain = BBR_HIGH_GAIN;
+}
+
+/// @brief Get the bandwidth-delay product of the path
+/// @param cc
+/// @return frames, 0 until the path is measured
+static double bbr_get_bdp(const cc_t* cc) {
+    return cc->bbr.btl_bw * cc->bbr.min_rtt_us / 1e6;
+}
+
+/// @brief Take a bandwidth sample and move through the modes once per round
+/// @param cc
+/// @param ack
+static void bbr_end_round(cc_t* cc, const cc_ack_t* ack) {
+    long long elapsed_us = ack->now_us - cc->bbr.round_start_us;
+    cc->bbr.bw_samples[cc->bbr.round % BBR_BW_ROUNDS] = cc->bbr.round_delivered * 1e6 / elapsed_us;
+    cc->bbr.round++;
+    cc->bbr.round_start_us = ack->now_us;
+    cc->bbr.round_delivered = 0;
+
+    cc->bbr.btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        cc->bbr.btl_bw = MAX(cc->bbr.btl_bw, cc->bbr.bw_samples[i]);
+    }
+
+    switch (cc->bbr.mode) {
+    case BBR_STARTUP:
+        // the pipe is full once the bandwidth stops growing
+        if (cc->bbr.btl_bw >= cc->bbr.full_bw * BBR_FULL_BW_GROWTH) {
+            cc->bbr.full_bw = cc->bbr.btl_bw;
+            cc->bbr.full_bw_rounds = 0;
+        }
+        else if (++cc->bbr.full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+            cc->bbr.mode = BBR_DRAIN;
+            cc->bbr.pacing_gain = 1 / BBR_HIGH_GAIN;
+        }
+        break;
+    case BBR_DRAIN:
+        break;
+    case BBR_PROBE_BW:
+        cc->bbr.cycle = (cc->bbr.cycle + 1) % BBR_CYCLE_LENGTH;
+        cc->bbr.pacing_gain = BBR_PROBE_BW_GAINS[cc->bbr.cycle];
+        break;
+    }
+}
+
+static void bbr_on_ack(cc_t* cc, const cc_ack_t* ack) {
+    if (ack->rtt_us > 0 && (cc->bbr.min_rtt_us == 0 || ack->rtt_us < cc->bbr.min_rtt_us
+        || ack->now_us - cc->bbr.min_rtt_stamp_us > BBR_MIN_RTT_WINDOW_US)) {
+        cc->bbr.min_rtt_us = ack->rtt_us;
+        cc->bbr.min_rtt_stamp_us = ack->now_us;
+    }
+
+    if (cc->bbr.round_start_us == 0) {
+        cc->bbr.round_start_us = ack->now_us;
+    }
+    cc->bbr.round_delivered += ack->acked;
+    if (ack->now_us - cc->bbr.round_start_us >= MAX(cc->bbr.min_rtt_us, BBR_MIN_ROUND_US)) {
+        bbr_end_round(cc, ack);
+    }
+
+    double bdp = bbr_get_bdp(cc);
+    if (cc->bbr.mode == BBR_DRAIN && ack->inflight <= bdp) {
+        // the queue built in startup is gone, probe around the measured bandwidth
+        cc->bbr.mode = BBR_PROBE_BW;
+        cc->bbr.cycle = 2;
+        cc->bbr.pacing_gain = BBR_PROBE_BW_GAINS[cc->bbr.cycle];
+        cc->bbr.cwnd_gain = BBR_CWND_GAIN;
+    }
+
+    // grow like slow start until the window covers the pipe
+    double target = cc->bbr.cwnd_gain * bdp;
+    if (cc->bbr.mode == BBR_STARTUP || cc->cwnd < target) {
+        cc->cwnd += ack->acked;
+    }
+    if (bdp > 0 && cc->bbr.mode != BBR_STARTUP) {
+        cc->cwnd = MIN(cc->cwnd, target);
+    }
+    cc_clamp_cwnd(cc);
+
+    if (cc->bbr.btl_bw > 0) {
+        cc->pacing_rate = cc->bbr.pacing_gain * cc->bbr.btl_bw;
+    }
+    else if (ack->srtt_us > 0) {
+        cc->pacing_rate = cc->bbr.pacing_gain * cc->cwnd * 1e6 / ack->srtt_us;
+    }
+}
+
+static void bbr_on_loss(cc_t* cc, long long now_us) {
+    // the model is not based on loss, the pacing rate already keeps the queue short
+    (void)cc;
+    (void)now_us;
+}
+
+static void bbr_on_timeout(cc_t* cc, long long now_us) {
+    (void)now_us;
+
+    // start over from a small window, acks grow it back to the model
+    cc->cwnd = cc->min_cwnd;
+
+    // the wait for the timeout says nothing about the bandwidth. Counting it in the
+    // round drags the estimate down until the pacing stalls the transfer.
+    cc->bbr.round_start_us = 0;
+    cc->bbr.round_delivered = 0;
+}
+
+static void bbr_on_resume(cc_t* cc, double used_cwnd) {
+    (void)used_cwnd;
+
+    // the model of the path is kept, the idle time is no part of a round
+    cc->bbr.round_start_us = 0;
+    cc->bbr.round_delivered = 0;
+}
+
+static const cc_ops_t CUBIC_OPS = { "cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout, cubic_on_resume };
+static const cc_ops_t BBR_OPS = { "bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_timeout, bbr_on_resume };
+
+static const cc_ops_t* CC_OPS[] = {
+    [CC_CUBIC] = &CUBIC_OPS,
+    [CC_BBR] = &BBR_OPS,
+};
+
+bool cc_parse(const char* name, cc_algorithm* algorithm) {
+    for (int i = 0; i < (int)(sizeof(CC_OPS) / sizeof(CC_OPS[0])); i++) {
+        if (strcmp(name, CC_OPS[i]->name) == 0) {
+            *algorithm = i;
+            return false;
+        }
+    }
+    return true;
+}
+
+void cc_init(cc_t* cc, cc_algorithm algorithm, int initial_cwnd, int max_cwnd) {
+    cc->ops = CC_OPS[algorithm];
+    cc->min_cwnd = MIN(2, max_cwnd);
+    cc->max_cwnd = max_cwnd;
+    cc->cwnd = initial_cwnd;
+    cc->pacing_rate = 0;
+    cc_clamp_cwnd(cc);
+    cc->ops->init(cc);
+}
+
+void cc_resume(cc_t* cc, cc_algorithm algorithm, int initial_cwnd, int max_cwnd, long long idle_us, long long rto_us) {
+    if (cc->ops != CC_OPS[algorithm]) {
+        cc_init(cc, algorithm, initial_cwnd, max_cwnd);
+        return;
+    }
+
+    double used_cwnd = cc->cwnd;
+    for (long long idle = idle_us; idle >= rto_us && cc->cwnd > initial_cwnd; idle -= rto_us) {
+        cc->cwnd = MAX(cc->cwnd / 2, initial_cwnd);
+    }
+    cc->min_cwnd = MIN(2, max_cwnd);
+    cc->max_cwnd = max_cwnd;
+    cc_clamp_cwnd(cc);
+    cc->ops->on_resume(cc, used_cwnd);
+}
+
+void cc_on_ack(cc_t* cc, const cc_ack_t* ack) {
+    if (ack->acked > 0) {
+        cc->ops->on_ack(cc, ack);
+    }
+}
+
+void cc_on_loss(cc_t* cc, long long now_us) {
+    cc->ops->on_loss(cc, now_us);
+}
+
+void cc_on_timeout(cc_t* cc, long long now_us) {
+    cc->ops->on_timeout(cc, now_us);
+}
+
+int cc_get_window(const cc_t* cc) {
+    return (int)cc->cwnd;
+}
+
+int cc_get_send_interval_us(const cc_t* cc) {
+    if (cc->pacing_rate <= 0) {
+        return 0;
+    }
+    return (int)MIN(1e6 / cc->pacing_rate, 1e6);
+}
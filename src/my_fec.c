@@ -0,0 +1,172 @@
+/**
+ * @file my_fec.c
+ * @author Kai Dewey
+ */
+
+#include "my_fec.h"
+
+#include <threads.h>
+
+#define GF_POLYNOMIAL 0x11d // x^8 + x^4 + x^3 + x^2 + 1, 2 generates the field
+
+static uint8_t GF_EXP[2 * 255];
+static uint8_t GF_LOG[256];
+static once_flag GF_ONCE = ONCE_FLAG_INIT;
+
+static void gf_init(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        GF_EXP[i] = x;
+        GF_EXP[i + 255] = x;
+        GF_LOG[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return GF_EXP[GF_LOG[a] + GF_LOG[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return GF_EXP[255 - GF_LOG[a]];
+}
+
+/// @brief Get the coefficient of a data frame in a repair frame. The rows x = index and
+/// the columns y = FEC_MAX_REPAIRS + frame never meet, so every square part of the
+/// matrix 1 / (x + y) can be inverted.
+/// @param index
+/// @param frame
+/// @return coefficient
+static uint8_t get_coefficient(int index, int frame) {
+    return gf_inv((uint8_t)(index ^ (FEC_MAX_REPAIRS + frame)));
+}
+
+/// @brief dst += c * src
+/// @param dst
+/// @param src
+/// @param c
+/// @param len
+static void gf_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, int len) {
+    if (c == 0) {
+        return;
+    }
+    uint8_t table[256];
+    for (int i = 0; i < 256; i++) {
+        table[i] = gf_mul(c, i);
+    }
+    for (int i = 0; i < len; i++) {
+        dst[i] ^= table[src[i]];
+    }
+}
+
+/// @brief Invert a matrix in place with Gauss-Jordan elimination
+/// @param m n by n matrix, rows first
+/// @param n
+/// @return Return true if the matrix can't be inverted
+static bool gf_invert(uint8_t* m, int n) {
+    uint8_t inv[FEC_MAX_FRAMES * FEC_MAX_FRAMES];
+    memset(inv, 0, n * n);
+    for (int i = 0; i < n; i++) {
+        inv[i * n + i] = 1;
+    }
+
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return true;
+        }
+        for (int i = 0; i < n; i++) {
+            uint8_t t = m[col * n + i];
+            m[col * n + i] = m[pivot * n + i];
+            m[pivot * n + i] = t;
+            t = inv[col * n + i];
+            inv[col * n + i] = inv[pivot * n + i];
+            inv[pivot * n + i] = t;
+        }
+
+        uint8_t scale = gf_inv(m[col * n + col]);
+        for (int i = 0; i < n; i++) {
+            m[col * n + i] = gf_mul(m[col * n + i], scale);
+            inv[col * n + i] = gf_mul(inv[col * n + i], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t factor = m[row * n + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                m[row * n + i] ^= gf_mul(factor, m[col * n + i]);
+                inv[row * n + i] ^= gf_mul(factor, inv[col * n + i]);
+            }
+        }
+    }
+
+    memcpy(m, inv, n * n);
+    return false;
+}
+
+void fec_encode(char* repair, int index, int frame, const char* data, int len) {
+    call_once(&GF_ONCE, gf_init);
+    gf_mul_add((uint8_t*)repair, (const uint8_t*)data, get_coefficient(index, frame), len);
+}
+
+bool fec_decode(const char* const* frames, const int* lens, int k, char* const* repairs, const int* indices, int count, char** lost, int size) {
+    call_once(&GF_ONCE, gf_init);
+
+    int missing[FEC_MAX_FRAMES];
+    int n = 0;
+    for (int i = 0; i < k; i++) {
+        if (frames[i] == NULL) {
+            missing[n++] = i;
+        }
+    }
+    if (n > count) {
+        return true;
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    // take what the frames that are there added out of n repair frames, what is
+    // left is n equations of the lost frames
+    uint8_t* left = (uint8_t*)malloc((size_t)n * size);
+    if (left == NULL) {
+        return true;
+    }
+    uint8_t matrix[FEC_MAX_FRAMES * FEC_MAX_FRAMES];
+    for (int r = 0; r < n; r++) {
+        uint8_t* row = left + (size_t)r * size;
+        memcpy(row, repairs[r], size);
+        for (int i = 0; i < k; i++) {
+            if (frames[i] != NULL) {
+                gf_mul_add(row, (const uint8_t*)frames[i], get_coefficient(indices[r], i), lens[i]);
+            }
+        }
+        for (int c = 0; c < n; c++) {
+            matrix[r * n + c] = get_coefficient(indices[r], missing[c]);
+        }
+    }
+
+    if (gf_invert(matrix, n)) {
+        free(left);
+        return true;
+    }
+    for (int c = 0; c < n; c++) {
+        memset(lost[c], 0, size);
+        for (int r = 0; r < n; r++) {
+            gf_mul_add((uint8_t*)lost[c], left + (size_t)r * size, matrix[c * n + r], size);
+        }
+    }
+
+    free(left);
+    return false;
+}
@@ -3,11 +3,72 @@
  * @author Kai Dewey
  */
 
+#define _GNU_SOURCE // fallocate, sync_file_range
+
 #include "my_ftp.h"
+#include "my_cache.h"
+#include "my_listing.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include <time.h>
+
+#define SESSION_BUCKETS 256 // buckets of the table of sessions, keyed by client address
+#define MAX_DATAGRAMS_PER_LOOP 256 // datagrams handled before the timers of the sessions are run
+#define TEMP_NAME_ATTEMPTS 16 // names tried for the temporary file of an upload
+#define HASH_CHUNK (64 * 1024) // bytes read at a time by ftp_hash_update
+#define HASH_STEP (4 * 1024 * 1024) // most bytes of a partial file a session hashes in a pass of the loop
+#define PARTIAL_MAX_AGE (24 * 60 * 60) // seconds the temporary and partial files of uploads are kept once nothing writes them
+#define SWEEP_INTERVAL (60 * 60) // seconds between the sweeps of those files
+
+enum session_state {
+    SESSION_COMMAND, // receiving the request, or the command of a legacy client
+    SESSION_FILENAME, // receiving the filename of GET, PUT and DELETE from a legacy client
+    SESSION_DATA, // sending the file of GET or the list of LS, receiving the file of PUT
+    SESSION_RESPONSE, // sending the reply, it comes before the data of GET and LS
+    SESSION_VERIFY, // hashing the rest of the partial file of a PUT with FTP_RESUME once it is received
+    SESSION_CLOSED, // EXIT was answered, or the client was idle too long
+};
+
+/// @brief The commands of one client. Each step of a command is a transfer of the peer,
+/// the session moves to the next step once it is done.
+struct session_t {
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    peer_t* peer;
+    enum session_state state;
+    bool legacy; // the client sends the command and the filename as transfers of their own
+    ftp_command cmd;
+    ftp_response response;
+    char* reply; // message sent as the reply
+    char* filename;
+    int fd; // file of GET or PUT, -1 if none
+    char* temp_name; // file PUT writes to until it is complete, removed unless it is renamed or resumable
+    char* journal_name; // journal of the partial file of a PUT with FTP_RESUME, NULL for other uploads
+    ftp_journal_t journal; // of the PUT with FTP_RESUME, offset is the start of the file that is written
+    ftp_hash_t hash; // of the PUT with FTP_RESUME, of the partial file from its start
+    bool resuming; // the request has FTP_RESUME
+    ftp_resume_t resume; // of the request
+    long long file_offset; // where the data of GET or PUT starts in the file
+    file_cache_entry_t* cached; // contents of the file of GET when it is sent from the cache
+    long long file_size; // size of the file of GET
+    char* files; // list or page sent by LS
+    long long files_len;
+    struct session_t* next; // next session in the same bucket
+};
+
+typedef struct session_t session_t;
+
+static thread_local session_t* SESSIONS[SESSION_BUCKETS]; // sessions of the socket of this thread
+static atomic_uint TEMP_COUNTER; // tells the temporary files of the threads apart
+static atomic_llong LAST_SWEEP; // time of the last sweep of stale uploads, one thread runs it
 
 void print_command(ftp_command cmd) {
     switch (cmd) {
@@ -25,279 +86,1268 @@ void print_command(ftp_command cmd) {
         break;
     case EXIT:
         printf("EXIT\n");
+        break;
+    case RESUME:
+        printf("RESUME\n");
     }
 }
 
-static void response_ok(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    ftp_response response = OK;
-    if (send_data(s, (char*)&response, sizeof(response), client_addr, client_addr_len) == -1) {
-        fprintf(stderr, "RESP_OK: failed to send response\n");
+char* ftp_pack(int code, uint32_t flags, const char* filename, const ftp_resume_t* resume, const char* data, long long size, long long* len) {
+    ftp_message_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FTP_MAGIC;
+    header.code = code;
+    header.flags = flags | (data != NULL ? FTP_INLINE : 0) | (resume != NULL ? FTP_RESUME : 0);
+    header.name_len = filename != NULL ? strlen(filename) + 1 : 0;
+    header.size = size;
+
+    long long resume_len = resume != NULL ? sizeof(*resume) : 0;
+    *len = sizeof(header) + header.name_len + resume_len + (data != NULL ? size : 0);
+    char* msg = (char*)malloc(*len);
+    if (msg == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(msg, &header, sizeof(header));
+    if (filename != NULL) {
+        memcpy(msg + sizeof(header), filename, header.name_len);
     }
+    if (resume != NULL) {
+        memcpy(msg + sizeof(header) + header.name_len, resume, resume_len);
+    }
+    if (data != NULL) {
+        memcpy(msg + sizeof(header) + header.name_len + resume_len, data, size);
+    }
+    return msg;
 }
 
-static void response_error(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    ftp_response response = ERROR;
-    if (send_data(s, (char*)&response, sizeof(response), client_addr, client_addr_len) == -1) {
-        fprintf(stderr, "RESP_ERR: failed to send response\n");
+bool ftp_unpack(const char* msg, long long len, ftp_message_t* header, const char** filename, ftp_resume_t* resume, const char** data) {
+    if (msg == NULL || len < (long long)sizeof(*header)) {
+        return true;
+    }
+    memcpy(header, msg, sizeof(*header));
+    if (header->magic != FTP_MAGIC || header->name_len > len - sizeof(*header) || header->size < 0) {
+        return true;
+    }
+
+    *filename = NULL;
+    if (header->name_len > 0) {
+        *filename = msg + sizeof(*header);
+        if ((*filename)[header->name_len - 1] != '\0') {
+            return true;
+        }
     }
+
+    long long offset = sizeof(*header) + header->name_len;
+    memset(resume, 0, sizeof(*resume));
+    if (header->flags & FTP_RESUME) {
+        if (len - offset < (long long)sizeof(*resume)) {
+            return true;
+        }
+        memcpy(resume, msg + offset, sizeof(*resume));
+        offset += sizeof(*resume);
+    }
+
+    *data = NULL;
+    if (header->flags & FTP_INLINE) {
+        if (len - offset != header->size) {
+            return true;
+        }
+        *data = msg + offset;
+    }
+    return false;
 }
 
-static void handle_get(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    int len;
-    char* filename = (char*)recv_data(s, &len, (sockaddr*)client_addr, client_addr_len);
-    if (filename == NULL) {
-        fprintf(stderr, "GET: failed to read filename\n");
-        response_error(s, client_addr, client_addr_len);
-        return;
+int ftp_pack_entry(char* buf, const char* name, int name_len, long long size, long long mtime) {
+    int64_t size64 = size;
+    int64_t mtime64 = mtime;
+    uint16_t len16 = name_len;
+    memcpy(buf, &size64, sizeof(size64));
+    memcpy(buf + 8, &mtime64, sizeof(mtime64));
+    memcpy(buf + 16, &len16, sizeof(len16));
+    memcpy(buf + FTP_ENTRY_HEADER, name, name_len);
+    return FTP_ENTRY_HEADER + name_len;
+}
+
+bool ftp_unpack_entry(const char* data, long long len, long long* offset, ftp_entry_t* entry) {
+    if (*offset + FTP_ENTRY_HEADER > len) {
+        return true;
+    }
+    int64_t size64;
+    int64_t mtime64;
+    uint16_t len16;
+    memcpy(&size64, data + *offset, sizeof(size64));
+    memcpy(&mtime64, data + *offset + 8, sizeof(mtime64));
+    memcpy(&len16, data + *offset + 16, sizeof(len16));
+    if (*offset + FTP_ENTRY_HEADER + len16 > len) {
+        return true;
     }
-    FILE* file = fopen(filename, "r");
+    entry->size = size64;
+    entry->mtime = mtime64;
+    entry->name_len = len16;
+    entry->name = data + *offset + FTP_ENTRY_HEADER;
+    *offset += FTP_ENTRY_HEADER + len16;
+    return false;
+}
 
-    if (file == NULL) {
-        response_error(s, client_addr, client_addr_len);
-        free(filename);
-        // no need to print error if file not found
-        // perror("fopen");
-        return;
+/// @brief Mix a word into a hash of ftp_hash_update
+/// @param hash 
+/// @param word 
+/// @return the hash
+static uint64_t hash_word(uint64_t hash, uint64_t word) {
+    hash ^= word * 0x87c37b91114253d5ULL;
+    hash = (hash << 31 | hash >> 33) * 0x4cf5ad432745937fULL;
+    return hash;
+}
+
+void ftp_hash_init(ftp_hash_t* hash, long long len) {
+    hash->state = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+    hash->offset = 0;
+    hash->len = len;
+}
+
+bool ftp_hash_update(ftp_hash_t* hash, int fd, long long end) {
+    if (end >= hash->len) {
+        end = hash->len;
+    }
+    else {
+        // the words don't depend on where the updates stop
+        end -= end % 8;
+    }
+    char buf[HASH_CHUNK];
+    while (hash->offset < end) {
+        long long chunk = end - hash->offset < HASH_CHUNK ? end - hash->offset : HASH_CHUNK;
+        ssize_t n = pread(fd, buf, chunk, hash->offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0 && hash->offset + n < hash->len) {
+            n -= n % 8;
+        }
+        if (n <= 0) {
+            return true;
+        }
+
+        long long i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t word;
+            memcpy(&word, buf + i, sizeof(word));
+            hash->state = hash_word(hash->state, word);
+        }
+        if (i < n) {
+            // the last word of the file
+            uint64_t word = 0;
+            memcpy(&word, buf + i, n - i);
+            hash->state = hash_word(hash->state, word);
+        }
+        hash->offset += n;
     }
+    return false;
+}
 
-    // get file size
-    fseek(file, 0, SEEK_END);
-    int file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+uint64_t ftp_hash_final(const ftp_hash_t* hash) {
+    // spread the last words over every bit
+    uint64_t h = hash->state;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
-    // read file into memory
-    char* data = (char*)malloc(file_size);
-    if (data == NULL) {
-        response_error(s, client_addr, client_addr_len);
-        free(filename);
+uint64_t ftp_file_version(const struct stat* st) {
+    uint64_t fields[] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        hash = (hash ^ fields[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+char* ftp_partial_name(const char* filename, const char* suffix) {
+    // the name is cut so the prefix and the suffix still fit in a file name
+    const char* slash = strrchr(filename, '/');
+    int dir_len = slash != NULL ? slash - filename + 1 : 0;
+    const char* format = "%.*s" FTP_TEMP_PREFIX "%.200s%s";
+    int len = snprintf(NULL, 0, format, dir_len, filename, filename + dir_len, suffix);
+    char* name = (char*)malloc(len + 1);
+    if (name == NULL) {
         perror("malloc");
-        return;
+        return NULL;
     }
+    snprintf(name, len + 1, format, dir_len, filename, filename + dir_len, suffix);
+    return name;
+}
 
-    int bytes = fread(data, 1, file_size, file);
-    if (bytes < 0) {
-        response_error(s, client_addr, client_addr_len);
-        free(data);
-        free(filename);
-        perror("fread");
-        return;
+bool ftp_journal_read(const char* path, ftp_journal_t* journal) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return true;
+    }
+    ssize_t n = pread(fd, journal, sizeof(*journal), 0);
+    close(fd);
+    // a journal cut by a crash is no journal, the transfer starts over
+    return n != (ssize_t)sizeof(*journal) || journal->magic != FTP_JOURNAL_MAGIC
+        || journal->size < 0 || journal->offset < 0 || journal->offset > journal->size;
+}
+
+bool ftp_journal_write(const char* path, const ftp_journal_t* journal, bool sync) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return true;
+    }
+    bool failed = pwrite(fd, journal, sizeof(*journal), 0) != (ssize_t)sizeof(*journal);
+    if (failed) {
+        perror("pwrite");
     }
-    fclose(file);
+    if (!failed && sync && fdatasync(fd) == -1) {
+        perror("fdatasync");
+        failed = true;
+    }
+    close(fd);
+    return failed;
+}
 
-    printf("GET: sending file (%d bytes): \"%s\"\n", file_size, filename);
+bool ftp_journal_due(const ftp_journal_t* journal, long long offset) {
+    long long interval = get_sync_policy() == SYNC_BATCHED ? 8LL * SYNC_BATCH_BYTES : SYNC_BATCH_BYTES;
+    return offset - journal->offset >= interval;
+}
 
-    response_ok(s, client_addr, client_addr_len);
-    if (send_data(s, data, file_size, client_addr, client_addr_len) == -1) {
-        fprintf(stderr, "GET: failed to send file\n");
+bool ftp_journal_checkpoint(const char* path, int fd, ftp_journal_t* journal, long long offset) {
+    // the journal only counts bytes that are on disk, unless nothing is synced
+    bool sync = get_sync_policy() != SYNC_NONE;
+    if (sync && fdatasync(fd) == -1) {
+        perror("fdatasync");
+        return true;
     }
+    journal->offset = offset;
+    return ftp_journal_write(path, journal, sync);
+}
 
-    free(data);
-    free(filename);
+static void start_command(session_t* session);
+
+/// @brief Hash a client address (FNV-1a)
+/// @param addr 
+/// @param addr_len 
+/// @return bucket of the address
+static unsigned get_bucket(const sockaddr_storage* addr, socklen_t addr_len) {
+    const unsigned char* bytes = (const unsigned char*)addr;
+    uint32_t hash = 2166136261u;
+    for (socklen_t i = 0; i < addr_len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash % SESSION_BUCKETS;
+}
+
+/// @brief Find the session of a client, and create it on its first datagram
+/// @param s 
+/// @param addr 
+/// @param addr_len 
+/// @return NULL on failure
+static session_t* get_session(int s, const sockaddr_storage* addr, socklen_t addr_len) {
+    unsigned bucket = get_bucket(addr, addr_len);
+    for (session_t* session = SESSIONS[bucket]; session != NULL; session = session->next) {
+        if (session->addr_len == addr_len && memcmp(&session->addr, addr, addr_len) == 0) {
+            return session;
+        }
+    }
+
+    session_t* session = (session_t*)calloc(1, sizeof(session_t));
+    if (session == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    session->peer = peer_create(s, (const sockaddr*)addr, addr_len);
+    if (session->peer == NULL) {
+        free(session);
+        return NULL;
+    }
+    memcpy(&session->addr, addr, addr_len);
+    session->addr_len = addr_len;
+    session->fd = -1;
+    session->next = SESSIONS[bucket];
+    SESSIONS[bucket] = session;
+
+    start_command(session);
+    return session;
+}
+
+/// @brief Remove the temporary file of an upload, and its journal
+/// @param session 
+static void discard_upload(session_t* session) {
+    if (session->fd != -1) {
+        close(session->fd);
+        session->fd = -1;
+    }
+    if (session->temp_name != NULL) {
+        unlink(session->temp_name);
+    }
+    if (session->journal_name != NULL) {
+        unlink(session->journal_name);
+    }
+    free(session->temp_name);
+    free(session->journal_name);
+    session->temp_name = NULL;
+    session->journal_name = NULL;
+}
+
+/// @brief Close the partial file of a resumable upload, and leave it and its journal as they are
+/// @param session 
+static void release_upload(session_t* session) {
+    if (session->fd != -1) {
+        close(session->fd);
+        session->fd = -1;
+    }
+    free(session->temp_name);
+    free(session->journal_name);
+    session->temp_name = NULL;
+    session->journal_name = NULL;
+}
+
+/// @brief Hash the next part of the partial file of a resumable upload, at most HASH_STEP
+/// bytes so the other sessions of the thread don't wait on it for long
+/// @param session 
+/// @param end bytes of the file that are written
+/// @return Return true if the file can't be read
+static bool hash_upload(session_t* session, long long end) {
+    long long step_end = session->hash.offset + HASH_STEP;
+    return ftp_hash_update(&session->hash, session->fd, end < step_end ? end : step_end);
+}
+
+/// @brief Get how many bytes of a resumable upload are handed to the disk. Unless the policy
+/// is SYNC_NONE, the receive starts the writeback of each batch of the file as it arrives (see
+/// set_sync_policy), so the bytes before the last two batches had a batch of time to get there.
+/// @param session 
+/// @return bytes from the start of the file
+static long long get_written_back(const session_t* session) {
+    long long written = session->file_offset + peer_get_written(session->peer);
+    return get_sync_policy() == SYNC_NONE ? written : written - 2LL * SYNC_BATCH_BYTES;
 }
 
-static void handle_put(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    // get filename
-    char* filename = (char*)recv_data(s, NULL, client_addr, client_addr_len);
-    if (filename == NULL) {
-        fprintf(stderr, "PUT: failed to read filename\n");
-        response_error(s, client_addr, client_addr_len);
+/// @brief Record in the journal of a resumable upload that the bytes before offset are written.
+/// Unless the policy is SYNC_NONE, sync_file_range waits for them first, which is short since
+/// their writeback started already, see get_written_back. Unlike ftp_journal_checkpoint this
+/// syncs neither the metadata of the file nor the journal, which would hold up the loop: after
+/// a crash the journal may count bytes that are lost, and the hash check of the PUT catches them.
+/// @param session 
+/// @param offset 
+/// @return Return true on failure
+static bool save_journal(session_t* session, long long offset) {
+    ftp_journal_t* journal = &session->journal;
+    if (offset <= journal->offset) {
+        return false;
+    }
+    if (get_sync_policy() != SYNC_NONE && sync_file_range(session->fd, journal->offset, offset - journal->offset,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+        perror("sync_file_range");
+        return true;
+    }
+    journal->offset = offset;
+    return ftp_journal_write(session->journal_name, journal, false);
+}
+
+/// @brief Hash what a resumable upload wrote, and write its journal again once it is due.
+/// Run in each pass of the loop while the upload is received, neither waits for the disk.
+/// @param session 
+static void checkpoint_upload(session_t* session) {
+    long long written = session->file_offset + peer_get_written(session->peer);
+    // a read that fails is tried again, and reported once the upload is complete
+    hash_upload(session, written);
+    long long written_back = get_written_back(session);
+    if (ftp_journal_due(&session->journal, written_back) && save_journal(session, written_back)) {
+        fprintf(stderr, "PUT: failed to write the journal: \"%s\"\n", session->filename);
+    }
+}
+
+/// @brief Leave the partial file of a resumable upload for the next PUT, cut to the bytes its
+/// journal records. That also gives back the blocks preallocated past them, see on_put_filename.
+/// @param session 
+static void keep_partial(session_t* session) {
+    if (ftruncate(session->fd, session->journal.offset) == -1) {
+        perror("ftruncate");
+    }
+    release_upload(session);
+}
+
+/// @brief Keep the partial file of a resumable upload that failed, and record in its journal
+/// how much of it is written, see FTP_RESUME
+/// @param session 
+static void keep_upload(session_t* session) {
+    if (save_journal(session, get_written_back(session))) {
+        discard_upload(session);
         return;
     }
+    printf("PUT: kept %lld of %lld bytes to resume: \"%s\"\n", (long long)session->journal.offset, (long long)session->journal.size, session->filename);
+    keep_partial(session);
+}
 
-    // get file data
-    int len;
-    char* filedata = (char*)recv_data(s, &len, client_addr, client_addr_len);
-    if (filedata == NULL) {
-        fprintf(stderr, "PUT: failed to read filedata\n");
-        free(filename);
-        response_error(s, client_addr, client_addr_len);
+/// @brief Close the temporary file of an upload that failed. A resumable upload keeps what
+/// it received, other ones are removed.
+/// @param session 
+static void drop_upload(session_t* session) {
+    if (session->temp_name == NULL) {
+        return;
+    }
+    if (session->journal_name != NULL && session->fd != -1) {
+        keep_upload(session);
         return;
     }
+    discard_upload(session);
+}
 
-    printf("PUT: received file (%d bytes): \"%s\"\n", len, filename);
+/// @brief Drop what the last command of a session holds
+/// @param session 
+static void reset_command(session_t* session) {
+    free(session->filename);
+    free(session->files);
+    free(session->reply);
+    session->filename = NULL;
+    session->files = NULL;
+    session->reply = NULL;
+    file_cache_release(session->cached);
+    session->cached = NULL;
+    drop_upload(session);
+    if (session->fd != -1) {
+        close(session->fd);
+        session->fd = -1;
+    }
+    session->resuming = false;
+    session->file_offset = 0;
+}
 
-    // write to file
-    FILE* file = fopen(filename, "w");
-    if (file == NULL) {
-        perror("fopen");
-        free(filename);
-        free(filedata);
-        response_error(s, client_addr, client_addr_len);
-        return;
+/// @brief Remove a session from the table and free it
+/// @param session 
+static void free_session(session_t* session) {
+    session_t** link = &SESSIONS[get_bucket(&session->addr, session->addr_len)];
+    while (*link != session) {
+        link = &(*link)->next;
     }
+    *link = session->next;
+
+    reset_command(session);
+    peer_free(session->peer);
+    free(session);
+}
+
+/// @brief Wait for the next command of the client
+/// @param session 
+static void start_command(session_t* session) {
+    reset_command(session);
+    session->state = SESSION_COMMAND;
+    peer_recv_data(session->peer);
+}
 
-    int bytes = fwrite(filedata, 1, len, file);
-    if (bytes < 0) {
-        perror("fwrite");
-        free(filename);
-        free(filedata);
-        fclose(file);
-        response_error(s, client_addr, client_addr_len);
+/// @brief Send the reply to the command
+/// @param session 
+/// @param response 
+/// @param data sent inside the reply when not NULL, legacy clients get it as a transfer of its own
+/// @param size bytes of the data, or of the file sent after the reply
+/// @param flags FTP_LISTING and FTP_LISTING_MORE
+/// @param resume sent with FTP_RESUME when not NULL
+static void start_reply(session_t* session, ftp_response response, const char* data, long long size, uint32_t flags, const ftp_resume_t* resume) {
+    session->response = response;
+    session->state = SESSION_RESPONSE;
+    if (session->legacy) {
+        peer_send_data(session->peer, (char*)&session->response, sizeof(session->response));
         return;
     }
-    fclose(file);
 
-    // send response
-    response_ok(s, client_addr, client_addr_len);
+    long long len;
+    free(session->reply);
+    session->reply = ftp_pack(response, flags, NULL, resume, data, size, &len);
+    if (session->reply == NULL) {
+        // the client gives up waiting for the reply
+        start_command(session);
+        return;
+    }
+    peer_send_data(session->peer, session->reply, len);
+}
 
-    // free data
-    free(filename);
-    free(filedata);
+/// @brief Send the response to the command
+/// @param session 
+/// @param response 
+static void start_response(session_t* session, ftp_response response) {
+    start_reply(session, response, NULL, 0, 0, NULL);
 }
 
-static char* get_files_list() {
-    struct stat st;
-    if (stat(".", &st) != 0) {
-        perror("stat");
+/// @brief Read a whole file
+/// @param fd 
+/// @param size 
+/// @return the data, the caller frees it. NULL on failure
+static char* read_file(int fd, long long size) {
+    char* data = (char*)malloc(size + 1);
+    if (data == NULL) {
+        perror("malloc");
         return NULL;
     }
+    long long done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            perror("pread");
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
 
-    if (!S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "Not a directory\n");
-        return NULL;
+/// @brief Write a whole file
+/// @param fd 
+/// @param data 
+/// @param size 
+/// @return Return true on failure
+static bool write_file(int fd, const char* data, long long size) {
+    long long done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if (n == -1) {
+            perror("write");
+            return true;
+        }
+        done += n;
     }
+    return false;
+}
 
-    DIR* dir = opendir(".");
+/// @brief Create the temporary file of an upload in the directory of its name
+/// @param session 
+/// @return fd, -1 on failure
+static int open_temp_file(session_t* session) {
+    const char* slash = strrchr(session->filename, '/');
+    int dir_len = slash != NULL ? slash - session->filename + 1 : 0;
+    for (int i = 0; i < TEMP_NAME_ATTEMPTS; i++) {
+        // the name is cut so the prefix and the suffix still fit in a file name
+        unsigned id = atomic_fetch_add(&TEMP_COUNTER, 1);
+        const char* format = "%.*s" FTP_TEMP_PREFIX "%.200s.%d.%u";
+        int len = snprintf(NULL, 0, format, dir_len, session->filename, session->filename + dir_len, (int)getpid(), id);
+        char* name = (char*)malloc(len + 1);
+        if (name == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        snprintf(name, len + 1, format, dir_len, session->filename, session->filename + dir_len, (int)getpid(), id);
+
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            session->temp_name = name;
+            return fd;
+        }
+        free(name);
+        if (errno != EEXIST) {
+            perror("open");
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/// @brief Open the directory of a file, to sync it once a rename in it is done
+/// @param filename 
+/// @return fd of the directory, -1 on failure
+static int open_directory(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    char* dir = slash != NULL ? strndup(filename, slash - filename + 1) : strdup(".");
     if (dir == NULL) {
-        perror("opendir");
-        return NULL;
+        perror("strdup");
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd == -1) {
+        perror("open");
     }
+    return fd;
+}
 
-    char* files = NULL;
-    size_t files_size = 0;
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        char path[PATH_MAX];
-        snprintf(path, sizeof(path), "%s/%s", ".", entry->d_name);
+/// @brief Give a complete upload its name, see run_server
+/// @param session 
+/// @return Return true on failure, the temporary file is removed with the command
+static bool publish_file(session_t* session) {
+    int fd = session->fd;
+    session->fd = -1;
+    sync_policy policy = get_sync_policy();
+    bool failed = false;
+    if (policy != SYNC_NONE && fdatasync(fd) == -1) {
+        perror("fdatasync");
+        failed = true;
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        failed = true;
+    }
+    // the directory is opened before the rename, so the only failure left once the
+    // file is published is the sync itself
+    int dir_fd = -1;
+    if (failed || (policy == SYNC_STRICT && (dir_fd = open_directory(session->filename)) == -1)) {
+        return true;
+    }
 
-        if (stat(path, &st) != 0) {
-            perror("stat");
-            closedir(dir);
-            free(files);
-            return NULL;
+    if (rename(session->temp_name, session->filename) == -1) {
+        perror("rename");
+        if (dir_fd != -1) {
+            close(dir_fd);
         }
+        return true;
+    }
+    free(session->temp_name);
+    session->temp_name = NULL;
+    if (session->journal_name != NULL) {
+        // a journal left by a crash here has no partial file, it is ignored
+        unlink(session->journal_name);
+        free(session->journal_name);
+        session->journal_name = NULL;
+    }
+    file_cache_invalidate(session->filename);
+    if (dir_fd != -1) {
+        // the file is in place whatever happens now, so the reply stays OK
+        if (fsync(dir_fd) == -1) {
+            perror("fsync");
+            fprintf(stderr, "PUT: \"%s\" is published but its directory isn't synced\n", session->filename);
+        }
+        close(dir_fd);
+    }
+    return false;
+}
 
-        if (S_ISREG(st.st_mode)) {  // Only regular files
-            size_t filename_len = strlen(entry->d_name);
-            size_t new_size = files_size + filename_len + 1;  // +1 for newline character
+/// @brief Start the command of a legacy client once it is received, its filename follows
+/// @param session 
+/// @param cmd 
+static void on_legacy_command(session_t* session, ftp_command cmd) {
+    session->legacy = true;
+    session->cmd = cmd;
 
-            char* new_files = realloc(files, new_size * sizeof(char));
-            if (new_files == NULL) {
-                perror("realloc");
-                free(files);
-                closedir(dir);
-                return NULL;
-            }
+    printf("Received Command: ");
+    print_command(session->cmd);
+
+    switch (session->cmd) {
+    case GET:
+    case PUT:
+    case DELETE:
+        session->state = SESSION_FILENAME;
+        peer_recv_data(session->peer);
+        break;
+    case LS:
+        session->files = listing_get_text(&session->files_len);
+        start_response(session, session->files == NULL ? ERROR : OK);
+        break;
+    case EXIT:
+        start_response(session, OK);
+        break;
+    default:
+        start_command(session);
+        break;
+    }
+}
 
-            files = new_files;
-            strncpy(files + files_size, entry->d_name, filename_len);
+static void on_get_filename(session_t* session);
+static void on_put_filename(session_t* session, const char* data, long long size);
+static void on_delete_filename(session_t* session);
 
-            files_size = new_size;
-            files[files_size - 1] = '\n';
-        }
+/// @brief Reply to an LS request with FTP_LISTING with a page of entries
+/// @param session 
+/// @param prefix NULL for all names
+/// @param data the ftp_listing_query_t and its cursor, NULL if missing
+/// @param size 
+static void on_listing_query(session_t* session, const char* prefix, const char* data, long long size) {
+    ftp_listing_query_t query;
+    if (data == NULL || size < (long long)sizeof(query)) {
+        start_response(session, ERROR);
+        return;
     }
-    closedir(dir);
+    memcpy(&query, data, sizeof(query));
+    if (query.after_len > size - sizeof(query)) {
+        start_response(session, ERROR);
+        return;
+    }
+
+    bool more;
+    const char* after = query.after_len > 0 ? data + sizeof(query) : NULL;
+    session->files = listing_get_page(prefix, after, query.after_len, query.limit, &session->files_len, &more);
+    if (session->files == NULL) {
+        start_response(session, ERROR);
+        return;
+    }
+    start_reply(session, OK, session->files, session->files_len, FTP_LISTING | (more ? FTP_LISTING_MORE : 0), NULL);
+}
 
-    if (files == NULL) {
-        files = strdup("No files found\n");
+/// @brief Reply to a RESUME request with how many bytes of an upload the server has, see FTP_RESUME
+/// @param session 
+/// @param filename 
+/// @param size bytes of the upload
+static void on_resume_query(session_t* session, const char* filename, long long size) {
+    ftp_resume_t resume = { .offset = 0, .version = session->resume.version };
+    char* partial_name = filename != NULL ? ftp_partial_name(filename, FTP_PARTIAL_SUFFIX) : NULL;
+    char* journal_name = filename != NULL ? ftp_partial_name(filename, FTP_JOURNAL_SUFFIX) : NULL;
+    ftp_journal_t journal;
+    struct stat st;
+    if (partial_name != NULL && journal_name != NULL && !ftp_journal_read(journal_name, &journal)
+        && journal.size == size && journal.version == resume.version
+        && stat(partial_name, &st) == 0 && st.st_size >= journal.offset) {
+        resume.offset = journal.offset;
     }
+    free(partial_name);
+    free(journal_name);
+    start_reply(session, OK, NULL, 0, 0, &resume);
+}
 
-    // add null terminator
-    char* new_files = realloc(files, files_size + 1);
-    if (new_files == NULL) {
-        perror("realloc");
-        free(files);
-        return NULL;
+/// @brief Run a request once it is received
+/// @param session 
+/// @param msg 
+/// @param len 
+static void on_request(session_t* session, const char* msg, long long len) {
+    ftp_message_t request;
+    const char* filename;
+    const char* data;
+    if (ftp_unpack(msg, len, &request, &filename, &session->resume, &data)) {
+        start_command(session);
+        return;
     }
-    files = new_files;
-    files[files_size] = '\0';
+    session->legacy = false;
+    session->cmd = request.code;
+    session->resuming = (request.flags & FTP_RESUME) != 0;
+
+    printf("Received Command: ");
+    print_command(session->cmd);
 
-    return files;
+    switch (session->cmd) {
+    case GET:
+    case PUT:
+    case DELETE:
+        session->filename = filename != NULL ? strdup(filename) : NULL;
+        if (session->filename == NULL) {
+            fprintf(stderr, "failed to read filename\n");
+            start_response(session, ERROR);
+        }
+        else if (session->cmd == GET) {
+            on_get_filename(session);
+        }
+        else if (session->cmd == PUT) {
+            on_put_filename(session, data, request.size);
+        }
+        else {
+            on_delete_filename(session);
+        }
+        break;
+    case LS:
+        if (request.flags & FTP_LISTING) {
+            on_listing_query(session, filename, data, request.size);
+            break;
+        }
+        session->files = listing_get_text(&session->files_len);
+        start_reply(session, session->files == NULL ? ERROR : OK, session->files,
+            session->files == NULL ? 0 : session->files_len, 0, NULL);
+        break;
+    case EXIT:
+        start_response(session, OK);
+        break;
+    case RESUME:
+        on_resume_query(session, filename, request.size);
+        break;
+    default:
+        start_command(session);
+        break;
+    }
 }
 
-static void handle_ls(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    char* files = get_files_list();
-    if (files == NULL) {
-        response_error(s, client_addr, client_addr_len);
+/// @brief Start the command once it is received
+/// @param session 
+static void on_command(session_t* session) {
+    long long len;
+    char* msg = (char*)peer_take_data(session->peer, &len);
+    if (msg != NULL && len == sizeof(ftp_command)) {
+        on_legacy_command(session, *(ftp_command*)msg);
+    }
+    else {
+        on_request(session, msg, len);
+    }
+    free(msg);
+}
+
+/// @brief Send the reply of a GET whose file follows it. A client that resumes gets the file
+/// from its offset on if it is still the one it has the start of.
+/// @param session 
+/// @param st 
+static void start_file_reply(session_t* session, const struct stat* st) {
+    if (!session->resuming) {
+        start_reply(session, OK, NULL, session->file_size, 0, NULL);
+        return;
+    }
+    ftp_resume_t resume = { .offset = 0, .version = ftp_file_version(st) };
+    if (session->resume.version == resume.version && session->resume.offset > 0 && session->resume.offset <= session->file_size) {
+        resume.offset = session->resume.offset;
+        printf("GET: resuming at %lld bytes: \"%s\"\n", (long long)resume.offset, session->filename);
+    }
+    session->file_offset = resume.offset;
+    start_reply(session, OK, NULL, session->file_size, 0, &resume);
+}
+
+static void on_get_filename(session_t* session) {
+    struct stat st;
+    if (stat(session->filename, &st) == -1 || !S_ISREG(st.st_mode)) {
+        start_response(session, ERROR);
+        return;
+    }
+
+    // hot files are sent from memory, without reading the disk
+    session->cached = file_cache_get(session->filename, &st);
+    if (session->cached != NULL) {
+        const char* data = file_cache_data(session->cached, &session->file_size);
+        long long hits, misses, bytes;
+        file_cache_get_stats(&hits, &misses, &bytes);
+        printf("GET: sending file (%lld bytes): \"%s\" (cache: %lld hits, %lld misses, %lld bytes)\n",
+            session->file_size, session->filename, hits, misses, bytes);
+        if (session->legacy || session->file_size > FTP_INLINE_MAX) {
+            start_file_reply(session, &st);
+            return;
+        }
+        // small files go inside the reply, it holds a copy
+        start_reply(session, OK, data, session->file_size, 0, NULL);
+        file_cache_release(session->cached);
+        session->cached = NULL;
+        return;
+    }
+
+    session->fd = open(session->filename, O_RDONLY);
+    if (session->fd == -1) {
+        // no need to print error if file not found
+        // perror("open");
+        start_response(session, ERROR);
+        return;
+    }
+
+    // get file size, the data is read while it is sent
+    if (fstat(session->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        start_response(session, ERROR);
+        return;
+    }
+
+    session->file_size = st.st_size;
+
+    printf("GET: sending file (%lld bytes): \"%s\"\n", session->file_size, session->filename);
+    if (session->legacy || session->file_size > FTP_INLINE_MAX) {
+        start_file_reply(session, &st);
         return;
     }
 
-    response_ok(s, client_addr, client_addr_len);
-    if (send_data(s, files, strlen(files) + 1, client_addr, client_addr_len) == -1) {
-        fprintf(stderr, "LS: failed to send ls data\n");
+    // small files go inside the reply
+    char* data = read_file(session->fd, session->file_size);
+    close(session->fd);
+    session->fd = -1;
+    start_reply(session, data == NULL ? ERROR : OK, data, data == NULL ? 0 : session->file_size, 0, NULL);
+    free(data);
+}
+
+/// @brief Open the partial file of a PUT with FTP_RESUME, and take over what an earlier
+/// upload of the same file left in it
+/// @param session 
+/// @param size 
+/// @return Return true on failure, the data is dropped
+static bool open_partial_file(session_t* session, long long size) {
+    char* partial_name = ftp_partial_name(session->filename, FTP_PARTIAL_SUFFIX);
+    char* journal_name = ftp_partial_name(session->filename, FTP_JOURNAL_SUFFIX);
+    int fd = partial_name != NULL && journal_name != NULL ? open(partial_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    struct stat st;
+    if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        // another upload of the file is running, it owns the partial file
+        fprintf(stderr, "PUT: another upload of the file is running: \"%s\"\n", session->filename);
+        close(fd);
+        fd = -1;
     }
+    else if (fd != -1 && (fstat(fd, &st) == -1 || st.st_nlink == 0)) {
+        // the sweep removed it as stale between the open and the lock, see sweep_uploads
+        fprintf(stderr, "PUT: the partial file was removed meanwhile: \"%s\"\n", session->filename);
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        free(partial_name);
+        free(journal_name);
+        return true;
+    }
+    session->fd = fd;
+    session->temp_name = partial_name;
+    session->journal_name = journal_name;
 
-    free(files);
+    ftp_journal_t* journal = &session->journal;
+    long long offset = session->resume.offset;
+    bool same = offset > 0 && !ftp_journal_read(journal_name, journal) && journal->size == size
+        && journal->version == session->resume.version && offset == journal->offset;
+    if (!same && offset != 0) {
+        fprintf(stderr, "PUT: no partial file to resume at %lld bytes: \"%s\"\n", offset, session->filename);
+        release_upload(session);
+        return true;
+    }
+    // the hash reads the bytes that are there again, the journal only says how many there are
+    ftp_hash_init(&session->hash, size);
+    if (!same) {
+        // what is there belongs to another upload, or the client starts over
+        memset(journal, 0, sizeof(*journal));
+        journal->magic = FTP_JOURNAL_MAGIC;
+        journal->size = size;
+        journal->version = session->resume.version;
+        if (ftruncate(fd, 0) == -1 || ftp_journal_write(journal_name, journal, false)) {
+            discard_upload(session);
+            return true;
+        }
+    }
+    if (offset > 0) {
+        printf("PUT: resuming at %lld bytes: \"%s\"\n", offset, session->filename);
+    }
+    session->file_offset = offset;
+    return false;
 }
 
-static void handle_delete(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    // get filename
-    char* filename = (char*)recv_data(s, NULL, client_addr, client_addr_len);
-    if (filename == NULL) {
-        fprintf(stderr, "failed to read filename\n");
-        response_error(s, client_addr, client_addr_len);
-        free(filename);
+/// @brief Receive the file of PUT
+/// @param session 
+/// @param data the file when it came inside the request, NULL when it follows
+/// @param size 
+static void on_put_filename(session_t* session, const char* data, long long size) {
+    // the file data is written as it arrives, if the file can't be opened the data is dropped
+    if (data == NULL && session->resuming) {
+        open_partial_file(session, size);
+    }
+    else {
+        session->fd = open_temp_file(session);
+    }
+
+    if (data != NULL) {
+        bool failed = session->fd == -1 || write_file(session->fd, data, size) || publish_file(session);
+        if (failed) {
+            drop_upload(session);
+        }
+        else {
+            printf("PUT: received file (%lld bytes): \"%s\"\n", size, session->filename);
+        }
+        start_response(session, failed ? ERROR : OK);
         return;
     }
 
+    // take the blocks of the whole file now, so it is laid out in one piece and a full disk
+    // shows before the data is sent. Legacy clients don't send the size.
+    long long offset = session->file_offset;
+    if (session->fd != -1 && size > offset && fallocate(session->fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) == -1 && errno == ENOSPC) {
+        fprintf(stderr, "PUT: not enough space for file (%lld bytes): \"%s\"\n", size, session->filename);
+        // a partial file stays to resume once there is room, the data is dropped
+        if (session->journal_name != NULL) {
+            keep_partial(session);
+        }
+        else {
+            discard_upload(session);
+        }
+    }
+
+    // get file data
+    session->state = SESSION_DATA;
+    peer_recv_data_to_fd_at(session->peer, session->fd, offset);
+}
+
+static void on_delete_filename(session_t* session) {
     // delete file
-    if (remove(filename) != 0) {
+    if (remove(session->filename) != 0) {
         perror("remove");
-        free(filename);
-        response_error(s, client_addr, client_addr_len);
+        start_response(session, ERROR);
         return;
     }
+    file_cache_invalidate(session->filename);
 
-    response_ok(s, client_addr, client_addr_len);
+    start_response(session, OK);
+}
 
-    // free variables
-    free(filename);
+/// @brief Handle the filename of GET, PUT and DELETE once it is received
+/// @param session 
+static void on_filename(session_t* session) {
+    long long len;
+    session->filename = (char*)peer_take_data(session->peer, &len);
+    if (session->filename == NULL || len == 0 || session->filename[len - 1] != '\0') {
+        fprintf(stderr, "failed to read filename\n");
+        start_response(session, ERROR);
+        return;
+    }
+
+    switch (session->cmd) {
+    case GET:
+        on_get_filename(session);
+        break;
+    case PUT:
+        on_put_filename(session, NULL, 0);
+        break;
+    default:
+        on_delete_filename(session);
+        break;
+    }
 }
 
-static void handle_exit(int s, sockaddr* client_addr, socklen_t* client_addr_len) {
-    response_ok(s, client_addr, client_addr_len);
+/// @brief Send the data of GET once the reply is sent, and the list of LS to legacy clients
+/// @param session 
+static void on_response(session_t* session) {
+    if (peer_get_status(session->peer) == TRANSFER_FAILED) {
+        fprintf(stderr, "failed to send response\n");
+    }
+
+    if (session->cmd == EXIT) {
+        session->state = SESSION_CLOSED;
+        printf("end of client session\n");
+    }
+    else if (session->response == OK && session->cmd == GET && session->cached != NULL) {
+        long long size;
+        const char* data = file_cache_data(session->cached, &size);
+        session->state = SESSION_DATA;
+        peer_send_data(session->peer, data + session->file_offset, size - session->file_offset);
+    }
+    else if (session->response == OK && session->cmd == GET && session->fd != -1) {
+        session->state = SESSION_DATA;
+        peer_send_data_from_fd_at(session->peer, session->fd, session->file_offset, session->file_size - session->file_offset);
+    }
+    else if (session->response == OK && session->cmd == LS && session->legacy) {
+        session->state = SESSION_DATA;
+        peer_send_data(session->peer, session->files, session->files_len);
+    }
+    else {
+        start_command(session);
+    }
 }
 
-void handle_session(int s) {
-    while (true) {
-        sockaddr_storage client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
+/// @brief Give the file of PUT its name once it is received, and reply
+/// @param session 
+/// @param failed the data didn't arrive, or the partial file can't be hashed
+static void finish_put(session_t* session, bool failed) {
+    // a resumable upload is checked against the hash of the request before it gets its
+    // name, and the reply has the hash of what was written
+    bool resumable = session->journal_name != NULL && session->fd != -1;
+    if (!failed && resumable && session->resume.hash != 0 && session->resume.hash != ftp_hash_final(&session->hash)) {
+        // the partial file isn't what the client sent, the next PUT starts over
+        fprintf(stderr, "PUT: file doesn't match the hash of the client: \"%s\"\n", session->filename);
+        discard_upload(session);
+        start_response(session, ERROR);
+        return;
+    }
+    if (failed || session->fd == -1 || publish_file(session)) {
+        drop_upload(session);
+        start_response(session, ERROR);
+        return;
+    }
+    long long size = session->file_offset + peer_get_length(session->peer);
+    printf("PUT: received file (%lld bytes): \"%s\"\n", size, session->filename);
 
-        int len;
+    // send response
+    ftp_resume_t resume = { .offset = size, .version = session->resume.version, .hash = ftp_hash_final(&session->hash) };
+    start_reply(session, OK, NULL, 0, 0, resumable ? &resume : NULL);
+}
 
-        fflush(stdout);
-        ftp_command* data = (ftp_command*)recv_data(s, &len, (sockaddr*)&client_addr, &client_addr_len);
-        // no command received
-        if (data == NULL) {
-            continue;
+/// @brief Hash the next step of the partial file of a PUT once it is received, and finish
+/// the PUT once the whole file is hashed
+/// @param session 
+/// @return true if there is more to hash
+static bool on_verify(session_t* session) {
+    if (hash_upload(session, session->hash.len)) {
+        fprintf(stderr, "PUT: failed to hash file: \"%s\"\n", session->filename);
+        finish_put(session, true);
+        return false;
+    }
+    if (session->hash.offset < session->hash.len) {
+        return true;
+    }
+    finish_put(session, false);
+    return false;
+}
+
+/// @brief Finish the data of GET, PUT and LS
+/// @param session 
+static void on_data(session_t* session) {
+    bool failed = peer_get_status(session->peer) == TRANSFER_FAILED;
+    switch (session->cmd) {
+    case GET:
+        if (failed) {
+            fprintf(stderr, "GET: failed to send file\n");
         }
+        break;
+    case LS:
+        if (failed) {
+            fprintf(stderr, "LS: failed to send ls data\n");
+        }
+        break;
+    case PUT:
+        if (failed) {
+            fprintf(stderr, "PUT: failed to read filedata\n");
+        }
+        else if (session->journal_name != NULL && session->fd != -1) {
+            // the hash of the partial file may lag behind the data, see on_verify
+            session->state = SESSION_VERIFY;
+            return;
+        }
+        finish_put(session, failed);
+        return;
+    default:
+        break;
+    }
+    start_command(session);
+}
 
-        printf("Received Command: ");
-        print_command(*data);
+/// @brief Move a session to its next step once the transfer of the current one is done
+/// @param session 
+/// @return true if the session is closed and was freed
+static bool advance_session(session_t* session) {
+    while (session->state != SESSION_CLOSED) {
+        transfer_status status = peer_get_status(session->peer);
+        if (status == TRANSFER_RUNNING) {
+            return false;
+        }
 
-        switch (*data) {
-        case GET:
-            handle_get(s, (sockaddr*)&client_addr, &client_addr_len);
+        switch (session->state) {
+        case SESSION_COMMAND:
+            if (status == TRANSFER_FAILED) {
+                // no command received, the client is gone or idle. A later command opens a new session.
+                session->state = SESSION_CLOSED;
+            }
+            else {
+                on_command(session);
+            }
             break;
-        case PUT:
-            handle_put(s, (sockaddr*)&client_addr, &client_addr_len);
+        case SESSION_FILENAME:
+            if (status == TRANSFER_FAILED) {
+                fprintf(stderr, "failed to read filename\n");
+                start_response(session, ERROR);
+            }
+            else {
+                on_filename(session);
+            }
             break;
-        case DELETE:
-            handle_delete(s, (sockaddr*)&client_addr, &client_addr_len);
+        case SESSION_RESPONSE:
+            on_response(session);
             break;
-        case LS:
-            handle_ls(s, (sockaddr*)&client_addr, &client_addr_len);
+        case SESSION_DATA:
+            on_data(session);
             break;
-        case EXIT:
-            handle_exit(s, (sockaddr*)&client_addr, &client_addr_len);
-            free(data);
+        case SESSION_VERIFY:
+            if (on_verify(session)) {
+                // the next pass goes on
+                return false;
+            }
+            break;
+        case SESSION_CLOSED:
+            break;
+        }
+    }
+
+    free_session(session);
+    return true;
+}
+
+/// @brief Get how long until a session has work to do
+/// @return timeout in ms, -1 if there are no sessions
+static int get_sessions_timeout_ms() {
+    int timeout_ms = -1;
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        for (session_t* session = SESSIONS[i]; session != NULL; session = session->next) {
+            int session_timeout_ms = session->state == SESSION_VERIFY ? 0 : peer_get_timeout_ms(session->peer);
+            if (session_timeout_ms != -1 && (timeout_ms == -1 || session_timeout_ms < timeout_ms)) {
+                timeout_ms = session_timeout_ms;
+            }
+        }
+    }
+    return timeout_ms;
+}
+
+/// @brief Hand the datagrams that arrived to the sessions of their clients
+/// @param s 
+static void handle_datagrams(int s) {
+    for (int i = 0; i < MAX_DATAGRAMS_PER_LOOP; i++) {
+        const char* buf;
+        int len;
+        sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        if (recv_datagram(s, &buf, &len, (sockaddr*)&client_addr, &client_addr_len)) {
             return;
         }
 
-        free(data);
-        clear_remaining_input(s);
+        session_t* session = get_session(s, &client_addr, client_addr_len);
+        if (session != NULL) {
+            peer_handle_datagram(session->peer, buf, len);
+            advance_session(session);
+        }
+    }
+}
+
+/// @brief Send what is due in every session and run their timers
+static void poll_sessions() {
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        session_t* next;
+        for (session_t* session = SESSIONS[i]; session != NULL; session = next) {
+            next = session->next;
+            peer_poll(session->peer);
+            if (session->state == SESSION_DATA && session->journal_name != NULL && session->fd != -1) {
+                checkpoint_upload(session);
+            }
+            advance_session(session);
+        }
+    }
+}
+
+/// @brief Remove the temporary and partial files of uploads, and their journals, that nothing
+/// wrote for PARTIAL_MAX_AGE. A client that gives up on an upload never comes back for it, and
+/// a server that crashes leaves its temporary files. Only the directory of the server is swept.
+/// @param now 
+static void sweep_uploads(time_t now) {
+    DIR* dir = opendir(".");
+    if (dir == NULL) {
+        perror("opendir");
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, FTP_TEMP_PREFIX, strlen(FTP_TEMP_PREFIX)) != 0) {
+            continue;
+        }
+        int fd = open(entry->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        // an upload that is running holds the lock of its partial file
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > PARTIAL_MAX_AGE
+            && flock(fd, LOCK_EX | LOCK_NB) == 0 && unlink(entry->d_name) == 0) {
+            printf("removed stale upload: \"%s\"\n", entry->d_name);
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
+/// @brief Sweep the stale uploads every SWEEP_INTERVAL, in the first thread that gets there
+static void sweep_uploads_if_due() {
+    time_t now = time(NULL);
+    long long last = atomic_load(&LAST_SWEEP);
+    if (now - last >= SWEEP_INTERVAL && atomic_compare_exchange_strong(&LAST_SWEEP, &last, now)) {
+        sweep_uploads(now);
+    }
+}
+
+void run_server(int s) {
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        handle_error("epoll_create1");
+    }
+
+    // with io_uring the datagrams arrive on the ring instead of the socket
+    int fd = get_recv_fd(s);
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        handle_error("epoll_ctl");
+    }
 
-        printf("waiting for command: ");
+    while (true) {
         fflush(stdout);
+        int timeout_ms = recv_datagram_pending(s) ? 0 : get_sessions_timeout_ms();
+        if (epoll_wait(epfd, &event, 1, timeout_ms) == -1 && errno != EINTR) {
+            handle_error("epoll_wait");
+        }
+
+        handle_datagrams(s);
+        poll_sessions();
+        sweep_uploads_if_due();
     }
 }
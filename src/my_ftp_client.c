@@ -5,36 +5,114 @@
 
 #include "my_ftp_client.h"
 
-char* ftp_get(int s, char* filename, int* len) {
-    // send command
-    ftp_command cmd = GET;
-    if (send_data(s, (char*)&cmd, sizeof(GET), NULL, NULL) == -1) {
-        fprintf(stderr, "GET: failed to send command\n");
-        return NULL;
+#define PUT_HASH_WAIT_MS 4 // a PUT runs this long between the steps of the hash of its file
+#define PUT_HASH_STEP (1 << 20) // bytes of the file hashed at a time while a PUT is sent
+#define PUT_VERIFY_TRIES 6 // waits for the reply of a resumable PUT, the server may still be hashing the file
+
+/// @brief Send a request in one message
+/// @param peer
+/// @param action name of the command for the error messages
+/// @param cmd
+/// @param filename NULL for none
+/// @param resume sent with FTP_RESUME when not NULL
+/// @param data sent inside the request when not NULL
+/// @param size bytes of the data, or of the data transfer that follows the request
+/// @param flags FTP_LISTING
+/// @return Return true on failure
+static bool send_request(peer_t* peer, const char* action, ftp_command cmd, const char* filename, const ftp_resume_t* resume, const char* data, long long size, uint32_t flags) {
+    long long len;
+    char* msg = ftp_pack(cmd, flags, filename, resume, data, size, &len);
+    if (msg == NULL) {
+        return true;
+    }
+    peer_send_data(peer, msg, len);
+    if (peer_wait(peer)) {
+        fprintf(stderr, "%s: failed to send request\n", action);
+        free(msg);
+        return true;
     }
+    free(msg);
+    return false;
+}
 
-    // send filename
-    if (send_data(s, filename, strlen(filename) + 1, NULL, NULL) == -1) {
-        fprintf(stderr, "GET: failed to send filename\n");
+/// @brief Receive the reply to a request
+/// @param peer
+/// @param action name of the command for the error messages
+/// @param tries times the reply is waited for before giving up
+/// @param reply set to the header of the reply
+/// @param resume set with FTP_RESUME, zeroed without it
+/// @param data set to the data inside the reply, NULL without it
+/// @return the message, the caller frees it. NULL on failure
+static char* recv_reply(peer_t* peer, const char* action, int tries, ftp_message_t* reply, ftp_resume_t* resume, const char** data) {
+    long long len;
+    char* msg = NULL;
+    for (int i = 0; i < tries && msg == NULL; i++) {
+        peer_recv_data(peer);
+        msg = peer_wait(peer) ? NULL : (char*)peer_take_data(peer, &len);
+    }
+    if (msg == NULL) {
+        fprintf(stderr, "%s: No response\n", action);
         return NULL;
     }
 
-    // get status
-    ftp_response* status = (ftp_response*)recv_data(s, NULL, NULL, NULL);
-    if (status == NULL) {
-        fprintf(stderr, "GET: No response\n");
+    const char* filename;
+    if (ftp_unpack(msg, len, reply, &filename, resume, data)) {
+        fprintf(stderr, "%s: invalid response\n", action);
+        free(msg);
         return NULL;
     }
+    return msg;
+}
+
+bool ftp_get_request(peer_t* peer, char* filename, ftp_resume_t* resume, char** data, long long* len) {
+    if (send_request(peer, "GET", GET, filename, resume, NULL, 0, 0)) {
+        return true;
+    }
 
-    if (*status == ERROR) {
+    ftp_message_t reply;
+    ftp_resume_t reply_resume;
+    const char* reply_data;
+    char* msg = recv_reply(peer, "GET", 1, &reply, &reply_resume, &reply_data);
+    if (msg == NULL) {
+        return true;
+    }
+    if (reply.code == ERROR) {
         fprintf(stderr, "GET: server failed to get file: \"%s\"\n", filename);
-        free(status);
+        free(msg);
+        return true;
+    }
+
+    *len = reply.size;
+    *data = NULL;
+    if (resume != NULL) {
+        // servers without FTP_RESUME send the file from the start
+        *resume = reply_resume;
+        if (resume->offset < 0 || resume->offset > reply.size) {
+            resume->offset = 0;
+        }
+    }
+    if (reply_data != NULL) {
+        // small files come inside the reply, hand them out in the message
+        memmove(msg, reply_data, reply.size);
+        *data = msg;
+        return false;
+    }
+    free(msg);
+    return false;
+}
+
+char* ftp_get(peer_t* peer, char* filename, long long* len) {
+    char* data;
+    if (ftp_get_request(peer, filename, NULL, &data, len)) {
         return NULL;
     }
-    free(status);
+    if (data != NULL) {
+        return data;
+    }
 
     // get data
-    char* data = recv_data(s, len, NULL, NULL);
+    peer_recv_data(peer);
+    data = peer_wait(peer) ? NULL : (char*)peer_take_data(peer, len);
     if (data == NULL) {
         fprintf(stderr, "GET: failed to receive data\n");
         return NULL;
@@ -42,122 +120,302 @@ char* ftp_get(int s, char* filename, int* len) {
     return data;
 }
 
-void ftp_put(int s, char* filename, char* filedata, int filedata_len) {
-    // send command
-    ftp_command cmd = PUT;
-    if (send_data(s, (char*)&cmd, sizeof(cmd), NULL, NULL) == -1) {
-        fprintf(stderr, "PUT: failed to send command\n");
+/// @brief Receive the reply of a PUT once the file data is sent
+/// @param peer
+/// @param filename
+/// @param tries times the reply is waited for, see recv_reply
+/// @param hash of the file, checked against the one of the reply when the server sends it. 0 for none.
+/// @param mismatch set if the file the server wrote is not the one sent, NULL if not needed
+/// @return Return true on failure
+static bool ftp_put_reply(peer_t* peer, char* filename, int tries, uint64_t hash, bool* mismatch) {
+    ftp_message_t reply;
+    ftp_resume_t resume;
+    const char* data;
+    char* msg = recv_reply(peer, "PUT", tries, &reply, &resume, &data);
+    if (msg == NULL) {
+        return true;
+    }
+    if (reply.code == ERROR) {
+        fprintf(stderr, "PUT: server failed to put file: %s\n", filename);
+        free(msg);
+        return true;
+    }
+    if (hash != 0 && (reply.flags & FTP_RESUME) && resume.hash != hash) {
+        fprintf(stderr, "PUT: the file the server wrote doesn't match, put it again: %s\n", filename);
+        *mismatch = true;
+        free(msg);
+        return true;
+    }
+
+    printf("put file: %s\n", filename);
+    free(msg);
+    return false;
+}
+
+void ftp_put(peer_t* peer, char* filename, char* filedata, long long filedata_len) {
+    // small files go inside the request
+    if (filedata_len <= FTP_INLINE_MAX) {
+        if (send_request(peer, "PUT", PUT, filename, NULL, filedata, filedata_len, 0)) {
+            return;
+        }
+        ftp_put_reply(peer, filename, 1, 0, NULL);
         return;
     }
 
-    // send filename
-    if (send_data(s, filename, strlen(filename) + 1, NULL, NULL) == -1) {
-        fprintf(stderr, "PUT: failed to send filename\n");
+    if (send_request(peer, "PUT", PUT, filename, NULL, NULL, filedata_len, 0)) {
         return;
     }
 
     // send filedata
-    if (send_data(s, filedata, filedata_len, NULL, NULL) == -1) {
+    peer_send_data(peer, filedata, filedata_len);
+    if (peer_wait(peer)) {
         fprintf(stderr, "PUT: failed to send filedata\n");
         return;
     }
 
-    // status
-    ftp_response* status = (ftp_response*)recv_data(s, NULL, NULL, NULL);
-    if (status == NULL) {
-        fprintf(stderr, "No response\n");
-        return;
+    ftp_put_reply(peer, filename, 1, 0, NULL);
+}
+
+/// @brief Ask the server how much of an upload it has, see FTP_RESUME
+/// @param peer
+/// @param filename
+/// @param size bytes of the file
+/// @param resume holds the version of the file, its offset is set to the bytes the server has
+/// @return Return true on failure, servers without FTP_RESUME don't answer
+static bool query_upload(peer_t* peer, char* filename, long long size, ftp_resume_t* resume) {
+    resume->offset = 0;
+    if (send_request(peer, "PUT", RESUME, filename, resume, NULL, size, 0)) {
+        return true;
     }
-    if (*status == ERROR) {
-        fprintf(stderr, "PUT: server failed to put file: %s\n", filename);
-        free(status);
-        return;
+    ftp_message_t reply;
+    ftp_resume_t reply_resume;
+    const char* data;
+    char* msg = recv_reply(peer, "PUT", 1, &reply, &reply_resume, &data);
+    if (msg == NULL) {
+        return true;
+    }
+    if (reply.code == OK && (reply.flags & FTP_RESUME) && reply_resume.version == resume->version
+        && reply_resume.offset > 0 && reply_resume.offset <= size) {
+        resume->offset = reply_resume.offset;
     }
+    free(msg);
+    return false;
+}
 
-    printf("put file: %s\n", filename);
-    free(status);
+/// @brief Hash a whole file
+/// @param fd
+/// @param len
+/// @param hash set to the hash, see ftp_hash_t
+/// @return Return true on failure
+static bool hash_file(int fd, long long len, uint64_t* hash) {
+    ftp_hash_t state;
+    ftp_hash_init(&state, len);
+    if (ftp_hash_update(&state, fd, len)) {
+        return true;
+    }
+    *hash = ftp_hash_final(&state);
+    return false;
 }
 
-void ftp_delete(int s, char* filename) {
-    // command
-    ftp_command cmd = DELETE;
-    if (send_data(s, (char*)&cmd, sizeof(cmd), NULL, NULL) == -1) {
-        fprintf(stderr, "DELETE: failed to send command\n");
+/// @brief Send a file from where the server has it to, and check the hash of the reply
+/// @param peer
+/// @param filename
+/// @param fd
+/// @param filedata_len
+/// @param resume where the data starts, the version of the file and its hash if it is known
+/// @param mismatch set if the file the server wrote is not the one sent
+/// @return Return true on failure
+static bool put_resumable(peer_t* peer, char* filename, int fd, long long filedata_len, const ftp_resume_t* resume, bool* mismatch) {
+    if (send_request(peer, "PUT", PUT, filename, resume, NULL, filedata_len, 0)) {
+        return true;
+    }
+
+    // send filedata, read from the file as it is sent. Unless its hash is known, the file is
+    // hashed meanwhile, a step at a time so the transfer keeps its pace.
+    bool hashing = resume->hash == 0;
+    ftp_hash_t hash;
+    ftp_hash_init(&hash, filedata_len);
+    peer_send_data_from_fd_at(peer, fd, resume->offset, filedata_len - resume->offset);
+    transfer_status status;
+    while ((status = peer_run(peer, hashing ? PUT_HASH_WAIT_MS : -1)) == TRANSFER_RUNNING) {
+        long long end = hash.offset + PUT_HASH_STEP < filedata_len ? hash.offset + PUT_HASH_STEP : filedata_len;
+        ftp_hash_update(&hash, fd, end);
+    }
+    if (status == TRANSFER_FAILED) {
+        fprintf(stderr, "PUT: failed to send filedata, put it again to resume\n");
+        return true;
+    }
+    uint64_t expected = resume->hash;
+    if (hashing && !ftp_hash_update(&hash, fd, filedata_len)) {
+        expected = ftp_hash_final(&hash);
+    }
+    return ftp_put_reply(peer, filename, PUT_VERIFY_TRIES, expected, mismatch);
+}
+
+void ftp_put_from_fd(peer_t* peer, char* filename, int fd, long long filedata_len) {
+    if (filedata_len <= FTP_INLINE_MAX) {
+        char* filedata = (char*)malloc(filedata_len + 1);
+        if (filedata == NULL) {
+            perror("malloc");
+            return;
+        }
+        long long done = 0;
+        while (done < filedata_len) {
+            ssize_t n = pread(fd, filedata + done, filedata_len - done, done);
+            if (n <= 0) {
+                fprintf(stderr, "PUT: failed to read from file: \"%s\"\n", filename);
+                free(filedata);
+                return;
+            }
+            done += n;
+        }
+        ftp_put(peer, filename, filedata, filedata_len);
+        free(filedata);
         return;
     }
 
-    // filename
-    if (send_data(s, filename, strlen(filename) + 1, NULL, NULL) == -1) {
-        fprintf(stderr, "DELETE: failed to send filename\n");
+    struct stat st;
+    char* upload_name = ftp_partial_name(filename, FTP_UPLOAD_SUFFIX);
+    if (upload_name == NULL || fstat(fd, &st) == -1) {
+        fprintf(stderr, "PUT: failed to read from file: \"%s\"\n", filename);
+        free(upload_name);
         return;
     }
 
-    // response
-    ftp_response* status = (ftp_response*)recv_data(s, NULL, NULL, NULL);
-    if (status == NULL) {
-        fprintf(stderr, "DELETE: No response\n");
+    // only a PUT of the same file that didn't finish left its start on the server. The server
+    // checks what it has against the hash of the whole file, the note keeps it once it is known.
+    ftp_resume_t resume = { .offset = 0, .version = ftp_file_version(&st) };
+    ftp_journal_t upload;
+    if (!ftp_journal_read(upload_name, &upload) && upload.size == filedata_len && upload.version == resume.version) {
+        if (upload.hash == 0 && !hash_file(fd, filedata_len, &upload.hash)) {
+            ftp_journal_write(upload_name, &upload, false);
+        }
+        resume.hash = upload.hash;
+        if (resume.hash == 0) {
+            fprintf(stderr, "PUT: failed to read from file, sending the whole file: \"%s\"\n", filename);
+        }
+        else if (query_upload(peer, filename, filedata_len, &resume)) {
+            fprintf(stderr, "PUT: server can't resume, sending the whole file\n");
+        }
+    }
+    else {
+        memset(&upload, 0, sizeof(upload));
+        upload.magic = FTP_JOURNAL_MAGIC;
+        upload.size = filedata_len;
+        upload.version = resume.version;
+        // without the note the next PUT starts over
+        ftp_journal_write(upload_name, &upload, false);
+    }
+    if (resume.offset > 0) {
+        printf("PUT: resuming at %lld bytes: \"%s\"\n", (long long)resume.offset, filename);
+    }
+
+    // the note stays until the server has the file, or lost what it had of it
+    bool mismatch = false;
+    if (!put_resumable(peer, filename, fd, filedata_len, &resume, &mismatch) || mismatch) {
+        unlink(upload_name);
+    }
+    free(upload_name);
+}
+
+void ftp_delete(peer_t* peer, char* filename) {
+    if (send_request(peer, "DELETE", DELETE, filename, NULL, NULL, 0, 0)) {
         return;
     }
-    if (*status == ERROR) {
+
+    ftp_message_t reply;
+    ftp_resume_t resume;
+    const char* data;
+    char* msg = recv_reply(peer, "DELETE", 1, &reply, &resume, &data);
+    if (msg == NULL) {
+        return;
+    }
+    if (reply.code == ERROR) {
         fprintf(stderr, "DELETE: server failed to delete file\n");
-        free(status);
+        free(msg);
         return;
     }
 
-
     printf("deleted file: %s\n", filename);
-    free(status);
+    free(msg);
 }
 
-char* ftp_ls(int s) {
-    // send command
-    ftp_command cmd = LS;
-    if (send_data(s, (char*)&cmd, sizeof(cmd), NULL, NULL) == -1) {
-        fprintf(stderr, "LS: failed to send command\n");
+char* ftp_ls(peer_t* peer) {
+    if (send_request(peer, "LS", LS, NULL, NULL, NULL, 0, 0)) {
         return NULL;
     }
 
-    // receive status
-    ftp_response* status = (ftp_response*)recv_data(s, NULL, NULL, NULL);
-    if (status == NULL) {
-        fprintf(stderr, "LS: No response\n");
+    // the list comes inside the reply
+    ftp_message_t reply;
+    ftp_resume_t resume;
+    const char* data;
+    char* msg = recv_reply(peer, "LS", 1, &reply, &resume, &data);
+    if (msg == NULL) {
         return NULL;
     }
-    if (*status == ERROR) {
+    if (reply.code == ERROR || data == NULL || reply.size == 0 || data[reply.size - 1] != '\0') {
         printf("failed to ls\n");
-        free(status);
+        free(msg);
         return NULL;
     }
-    free(status);
 
-    // receive data
-    char* data = recv_data(s, NULL, NULL, NULL);
-    if (data == NULL) {
-        fprintf(stderr, "LS: failed to receive data\n");
+    memmove(msg, data, reply.size);
+    return msg;
+}
+
+char* ftp_ls_page(peer_t* peer, const char* prefix, const char* after, int after_len, int limit, const char** data, long long* len, uint32_t* flags) {
+    long long query_len = sizeof(ftp_listing_query_t) + after_len;
+    char* query = (char*)malloc(query_len);
+    if (query == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    ftp_listing_query_t header = { .limit = limit, .after_len = after_len };
+    memcpy(query, &header, sizeof(header));
+    if (after_len > 0) {
+        memcpy(query + sizeof(header), after, after_len);
+    }
+    bool failed = send_request(peer, "LS", LS, prefix, NULL, query, query_len, FTP_LISTING);
+    free(query);
+    if (failed) {
         return NULL;
     }
 
-    return data;
+    ftp_message_t reply;
+    ftp_resume_t resume;
+    char* msg = recv_reply(peer, "LS", 1, &reply, &resume, data);
+    if (msg == NULL) {
+        return NULL;
+    }
+    if (reply.code == ERROR || *data == NULL) {
+        printf("failed to ls\n");
+        free(msg);
+        return NULL;
+    }
+    if (!(reply.flags & FTP_LISTING) && (reply.size == 0 || (*data)[reply.size - 1] != '\0')) {
+        printf("failed to ls\n");
+        free(msg);
+        return NULL;
+    }
+    *len = reply.size;
+    *flags = reply.flags & (FTP_LISTING | FTP_LISTING_MORE);
+    return msg;
 }
 
-void ftp_exit(int s) {
-    // send command
-    ftp_command cmd = EXIT;
-    if (send_data(s, (char*)&cmd, sizeof(cmd), NULL, NULL) == -1) {
-        fprintf(stderr, "EXIT: failed to send command\n");
+void ftp_exit(peer_t* peer) {
+    if (send_request(peer, "EXIT", EXIT, NULL, NULL, NULL, 0, 0)) {
         return;
     }
 
-    // receive status
-    ftp_response* status = (ftp_response*)recv_data(s, NULL, NULL, NULL);
-    if (status == NULL) {
-        fprintf(stderr, "EXIT: No response\n");
+    ftp_message_t reply;
+    ftp_resume_t resume;
+    const char* data;
+    char* msg = recv_reply(peer, "EXIT", 1, &reply, &resume, &data);
+    if (msg == NULL) {
         return;
     }
-    if (*status == ERROR) {
+    if (reply.code == ERROR) {
         printf("EXIT: server failed to exit\n");
-        free(status);
-        return;
     }
-    free(status);
+    free(msg);
 }
@@ -0,0 +1,388 @@
+/**
+ * @file my_listing.c
+ * @author Kai Dewey
+ */
+
+#define _GNU_SOURCE // getdents64
+
+#include "my_listing.h"
+#include "my_ftp.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <threads.h>
+
+#define DIRENT_BUFFER (64 * 1024) // bytes read by one getdents64
+
+struct listing_entry_t {
+    long long size;
+    long long mtime;
+    int name_len;
+    char name[]; // terminated
+};
+
+typedef struct listing_entry_t listing_entry_t;
+
+static listing_entry_t** ENTRIES; // sorted by name
+static int COUNT;
+static int CAPACITY;
+static char* TEXT; // text list of the entries, NULL once they change
+static long long TEXT_LEN;
+static int INOTIFY_FD = -1;
+static bool NO_INOTIFY; // the kernel has no inotify, every LS reads the directory
+static bool STALE = true; // the index has to be read again
+static mtx_t LOCK; // the threads of the server share the index
+static once_flag LOCK_ONCE = ONCE_FLAG_INIT;
+
+static void listing_init(void) {
+    if (mtx_init(&LOCK, mtx_plain) != thrd_success) {
+        fprintf(stderr, "mtx_init: failed to create the lock of the listing\n");
+        exit(1);
+    }
+}
+
+/// @brief Compare two names in the order of their bytes
+/// @return < 0, 0 or > 0 like strcmp
+static int compare_names(const char* a, int a_len, const char* b, int b_len) {
+    int n = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (n != 0) {
+        return n;
+    }
+    return a_len - b_len;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const listing_entry_t* x = *(listing_entry_t* const*)a;
+    const listing_entry_t* y = *(listing_entry_t* const*)b;
+    return compare_names(x->name, x->name_len, y->name, y->name_len);
+}
+
+/// @brief Find the first entry that doesn't sort before a name
+/// @param name
+/// @param name_len
+/// @param found set if that entry has the name
+/// @return index of the entry, COUNT if there is none
+static int lower_bound(const char* name, int name_len, bool* found) {
+    int lo = 0;
+    int hi = COUNT;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compare_names(ENTRIES[mid]->name, ENTRIES[mid]->name_len, name, name_len) < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    *found = lo < COUNT && ENTRIES[lo]->name_len == name_len && memcmp(ENTRIES[lo]->name, name, name_len) == 0;
+    return lo;
+}
+
+static void changed() {
+    free(TEXT);
+    TEXT = NULL;
+}
+
+static void clear_entries() {
+    for (int i = 0; i < COUNT; i++) {
+        free(ENTRIES[i]);
+    }
+    COUNT = 0;
+    changed();
+}
+
+/// @brief Make room for one more entry
+/// @return Return true on failure
+static bool reserve_entry() {
+    if (COUNT < CAPACITY) {
+        return false;
+    }
+    int capacity = CAPACITY == 0 ? 256 : 2 * CAPACITY;
+    listing_entry_t** entries = (listing_entry_t**)realloc(ENTRIES, capacity * sizeof(listing_entry_t*));
+    if (entries == NULL) {
+        perror("realloc");
+        return true;
+    }
+    ENTRIES = entries;
+    CAPACITY = capacity;
+    return false;
+}
+
+static listing_entry_t* create_entry(const char* name, int name_len, const struct stat* st) {
+    listing_entry_t* entry = (listing_entry_t*)malloc(sizeof(listing_entry_t) + name_len + 1);
+    if (entry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim.tv_sec;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len + 1);
+    return entry;
+}
+
+/// @brief Check if a file is an upload in progress, see FTP_TEMP_PREFIX
+static bool is_temp_name(const char* name) {
+    return strncmp(name, FTP_TEMP_PREFIX, strlen(FTP_TEMP_PREFIX)) == 0;
+}
+
+/// @brief Read the index again from the directory
+/// @return Return true on failure
+static bool read_entries() {
+    clear_entries();
+    int dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        perror("open");
+        return true;
+    }
+    char* buf = (char*)malloc(DIRENT_BUFFER);
+    if (buf == NULL) {
+        perror("malloc");
+        close(dirfd);
+        return true;
+    }
+
+    while (true) {
+        ssize_t n = getdents64(dirfd, buf, DIRENT_BUFFER);
+        if (n == -1) {
+            perror("getdents64");
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64* dirent = (struct dirent64*)(buf + offset);
+            offset += dirent->d_reclen;
+
+            // only regular files, and the links that may point to one
+            if (dirent->d_type != DT_REG && dirent->d_type != DT_LNK && dirent->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            if (is_temp_name(dirent->d_name)) {
+                continue;
+            }
+            struct stat st;
+            if (fstatat(dirfd, dirent->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            listing_entry_t* entry = create_entry(dirent->d_name, strlen(dirent->d_name), &st);
+            if (entry == NULL || reserve_entry()) {
+                free(entry);
+                continue;
+            }
+            ENTRIES[COUNT++] = entry;
+        }
+    }
+
+    free(buf);
+    close(dirfd);
+    qsort(ENTRIES, COUNT, sizeof(listing_entry_t*), compare_entries);
+    return false;
+}
+
+/// @brief Bring the entry of a name up to date after an event
+/// @param name
+static void update_entry(const char* name) {
+    if (is_temp_name(name)) {
+        return;
+    }
+    int name_len = strlen(name);
+    bool found;
+    int i = lower_bound(name, name_len, &found);
+
+    struct stat st;
+    if (fstatat(AT_FDCWD, name, &st, 0) == -1 || !S_ISREG(st.st_mode)) {
+        if (found) {
+            free(ENTRIES[i]);
+            memmove(ENTRIES + i, ENTRIES + i + 1, (COUNT - i - 1) * sizeof(listing_entry_t*));
+            COUNT--;
+            changed();
+        }
+        return;
+    }
+
+    if (found) {
+        if (ENTRIES[i]->size != st.st_size || ENTRIES[i]->mtime != st.st_mtim.tv_sec) {
+            ENTRIES[i]->size = st.st_size;
+            ENTRIES[i]->mtime = st.st_mtim.tv_sec;
+            changed();
+        }
+        return;
+    }
+    listing_entry_t* entry = create_entry(name, name_len, &st);
+    if (entry == NULL || reserve_entry()) {
+        // the index misses a file, read it again on the next LS
+        free(entry);
+        STALE = true;
+        return;
+    }
+    memmove(ENTRIES + i + 1, ENTRIES + i, (COUNT - i) * sizeof(listing_entry_t*));
+    ENTRIES[i] = entry;
+    COUNT++;
+    changed();
+}
+
+/// @brief Watch the directory for changes to its files
+static void watch_directory() {
+    INOTIFY_FD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (INOTIFY_FD == -1) {
+        perror("inotify_init1");
+        NO_INOTIFY = true;
+        return;
+    }
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE
+        | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+    if (inotify_add_watch(INOTIFY_FD, ".", mask) == -1) {
+        perror("inotify_add_watch");
+        close(INOTIFY_FD);
+        INOTIFY_FD = -1;
+    }
+}
+
+/// @brief Apply the events since the last call, or read the index again when they don't
+/// tell what changed
+static void refresh_entries() {
+    if (INOTIFY_FD == -1 && !NO_INOTIFY) {
+        // the watch is set before the directory is read, so no change slips between them
+        watch_directory();
+        STALE = true;
+    }
+
+    while (INOTIFY_FD != -1) {
+        union {
+            char buf[16 * 1024];
+            struct inotify_event align;
+        } events;
+        ssize_t n = read(INOTIFY_FD, events.buf, sizeof(events.buf));
+        if (n <= 0) {
+            if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                perror("read");
+                close(INOTIFY_FD);
+                INOTIFY_FD = -1;
+                STALE = true;
+            }
+            break;
+        }
+        for (ssize_t offset = 0; offset < n;) {
+            struct inotify_event* event = (struct inotify_event*)(events.buf + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // the watch is gone with the directory, set a new one
+                close(INOTIFY_FD);
+                INOTIFY_FD = -1;
+                STALE = true;
+                break;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                STALE = true;
+            }
+            else if (!STALE && event->len > 0) {
+                update_entry(event->name);
+            }
+        }
+    }
+
+    if (STALE) {
+        STALE = read_entries() || INOTIFY_FD == -1;
+    }
+}
+
+void listing_open() {
+    call_once(&LOCK_ONCE, listing_init);
+    mtx_lock(&LOCK);
+    refresh_entries();
+    mtx_unlock(&LOCK);
+}
+
+char* listing_get_text(long long* len) {
+    call_once(&LOCK_ONCE, listing_init);
+    mtx_lock(&LOCK);
+    refresh_entries();
+
+    if (TEXT == NULL) {
+        const char* empty = "No files found\n";
+        long long text_len = COUNT == 0 ? (long long)strlen(empty) : 0;
+        for (int i = 0; i < COUNT; i++) {
+            text_len += ENTRIES[i]->name_len + 1;
+        }
+        TEXT = (char*)malloc(text_len + 1);
+        if (TEXT == NULL) {
+            perror("malloc");
+            mtx_unlock(&LOCK);
+            return NULL;
+        }
+        char* p = TEXT;
+        for (int i = 0; i < COUNT; i++) {
+            memcpy(p, ENTRIES[i]->name, ENTRIES[i]->name_len);
+            p += ENTRIES[i]->name_len;
+            *p++ = '\n';
+        }
+        if (COUNT == 0) {
+            strcpy(TEXT, empty);
+        }
+        TEXT[text_len] = '\0';
+        TEXT_LEN = text_len + 1;
+    }
+
+    char* text = (char*)malloc(TEXT_LEN);
+    if (text == NULL) {
+        perror("malloc");
+        mtx_unlock(&LOCK);
+        return NULL;
+    }
+    memcpy(text, TEXT, TEXT_LEN);
+    *len = TEXT_LEN;
+    mtx_unlock(&LOCK);
+    return text;
+}
+
+char* listing_get_page(const char* prefix, const char* after, int after_len, int limit, long long* len, bool* more) {
+    if (limit <= 0 || limit > FTP_LISTING_MAX) {
+        limit = FTP_LISTING_MAX;
+    }
+    if (prefix == NULL) {
+        prefix = "";
+    }
+    int prefix_len = strlen(prefix);
+    char* page = (char*)malloc(FTP_INLINE_MAX);
+    if (page == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    call_once(&LOCK_ONCE, listing_init);
+    mtx_lock(&LOCK);
+    refresh_entries();
+
+    // start at the first name that follows the cursor and has the prefix
+    bool found;
+    int i = lower_bound(prefix, prefix_len, &found);
+    if (after != NULL) {
+        int next = lower_bound(after, after_len, &found) + found;
+        if (next > i) {
+            i = next;
+        }
+    }
+
+    long long bytes = 0;
+    for (int count = 0; i < COUNT && count < limit; i++, count++) {
+        listing_entry_t* entry = ENTRIES[i];
+        if (entry->name_len < prefix_len || memcmp(entry->name, prefix, prefix_len) != 0) {
+            break;
+        }
+        if (bytes + FTP_ENTRY_HEADER + entry->name_len > FTP_INLINE_MAX) {
+            break;
+        }
+        bytes += ftp_pack_entry(page + bytes, entry->name, entry->name_len, entry->size, entry->mtime);
+    }
+    *more = i < COUNT && ENTRIES[i]->name_len >= prefix_len && memcmp(ENTRIES[i]->name, prefix, prefix_len) == 0;
+    mtx_unlock(&LOCK);
+
+    *len = bytes;
+    return page;
+}
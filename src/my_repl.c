@@ -8,80 +8,215 @@
 #include "my_ftp_client.h"
 #include "my_repl.h"
 
+#include <fcntl.h>
 #include <regex.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define JOURNAL_WAIT_MS 100 // a GET into a partial file checks this often if its journal is due
+
+/// @brief Receive the file of a GET that follows the reply into its partial file, and give
+/// it its name once it is complete. The journal records how much of it is written as it
+/// arrives and when it fails, for the next GET of the file, see FTP_RESUME.
+/// @param peer 
+/// @param filename 
+/// @param partial_name 
+/// @param journal_name 
+/// @param resume where the data starts and the version of the file, from the reply
+/// @param len bytes of the whole file
+static void recv_partial_file(peer_t* peer, char* filename, const char* partial_name, const char* journal_name, const ftp_resume_t* resume, long long len) {
+    // the data is still received if the file can't be opened
+    int fd = open(partial_name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "GET: failed to open file: \"%s\"\n", partial_name);
+    }
+    if (resume->offset > 0) {
+        printf("GET: resuming at %lld bytes: \"%s\"\n", (long long)resume->offset, filename);
+    }
 
-static bool handle_get(int sockfd, char* filename) {
-    int len;
-    char* data = ftp_get(sockfd, filename, &len);
-    if (data != NULL) {
-        // write data to local file
+    // if the client dies, the next GET resumes from the last checkpoint of the journal
+    ftp_journal_t journal = {
+        .magic = FTP_JOURNAL_MAGIC,
+        .size = len,
+        .version = resume->version,
+        .offset = resume->offset,
+    };
+    if (fd != -1 && ftp_journal_write(journal_name, &journal, false)) {
+        close(fd);
+        fd = -1;
+    }
 
-        FILE* file = fopen(filename, "w");
-        if (file == NULL) {
-            fprintf(stderr, "GET: failed to open file: \"%s\"\n", filename);
-            free(data);
-            return false;
+    peer_recv_data_to_fd_at(peer, fd, resume->offset);
+    transfer_status status;
+    while ((status = peer_run(peer, JOURNAL_WAIT_MS)) == TRANSFER_RUNNING) {
+        long long written = resume->offset + peer_get_written(peer);
+        if (fd != -1 && ftp_journal_due(&journal, written) && ftp_journal_checkpoint(journal_name, fd, &journal, written)) {
+            fprintf(stderr, "GET: failed to write the journal: \"%s\"\n", journal_name);
         }
-
-        if (fwrite(data, 1, len, file) != (unsigned long)len) {
-            fprintf(stderr, "GET: failed to write to file: \"%s\"\n", filename);
-            free(data);
-            fclose(file);
-            return false;
+    }
+    if (fd == -1) {
+        return;
+    }
+    if (status == TRANSFER_FAILED) {
+        bool saved = !ftp_journal_checkpoint(journal_name, fd, &journal, resume->offset + peer_get_written(peer));
+        close(fd);
+        if (saved) {
+            fprintf(stderr, "GET: failed to receive file, get it again to resume: \"%s\"\n", filename);
         }
+        return;
+    }
+    if (close(fd) == -1 || rename(partial_name, filename) == -1) {
+        fprintf(stderr, "GET: failed to write to file: \"%s\"\n", filename);
+        return;
+    }
+    unlink(journal_name);
+    printf("wrote local file: \"%s\"\n", filename);
+}
+
+static bool handle_get(peer_t* peer, char* filename) {
+    char* partial_name = ftp_partial_name(filename, FTP_PARTIAL_SUFFIX);
+    char* journal_name = ftp_partial_name(filename, FTP_JOURNAL_SUFFIX);
+    if (partial_name == NULL || journal_name == NULL) {
+        free(partial_name);
+        free(journal_name);
+        return false;
+    }
+
+    // a GET of the file that failed part way left its start in the partial file
+    ftp_resume_t resume = { .offset = 0, .version = 0 };
+    ftp_journal_t journal;
+    struct stat st;
+    if (!ftp_journal_read(journal_name, &journal) && stat(partial_name, &st) == 0 && st.st_size >= journal.offset) {
+        resume.offset = journal.offset;
+        resume.version = journal.version;
+    }
 
-        printf("wrote local file: \"%s\"\n", filename);
-        fclose(file);
+    char* data;
+    long long len;
+    if (ftp_get_request(peer, filename, &resume, &data, &len)) {
+        free(partial_name);
+        free(journal_name);
+        return false;
+    }
+    if (data == NULL) {
+        recv_partial_file(peer, filename, partial_name, journal_name, &resume, len);
+        free(partial_name);
+        free(journal_name);
+        return false;
+    }
+    free(partial_name);
+    free(journal_name);
+
+    // small files came with the reply
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "GET: failed to open file: \"%s\"\n", filename);
         free(data);
+        return false;
     }
+    long long done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n == -1) {
+            len = -1;
+            break;
+        }
+        done += n;
+    }
+    free(data);
+    if (close(fd) == -1 || len == -1) {
+        fprintf(stderr, "GET: failed to write to file: \"%s\"\n", filename);
+        return false;
+    }
+
+    printf("wrote local file: \"%s\"\n", filename);
     return false;
 }
 
-static bool handle_put(int sockfd, char* filename) {
-    // read data from local file
-
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
+static bool handle_put(peer_t* peer, char* filename) {
+    // data is read from the local file while it is sent
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
         fprintf(stderr, "PUT: failed to open file: \"%s\"\n", filename);
         return false;
     }
 
-    fseek(file, 0, SEEK_END);
-    long len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    char* data = malloc(len);
-    if (fread(data, 1, len, file) != (unsigned long)len) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
         fprintf(stderr, "PUT: failed to read from file: \"%s\"\n", filename);
-        free(data);
-        fclose(file);
+        close(fd);
         return false;
     }
+    long long len = st.st_size;
 
-    fclose(file);
+    printf("PUT: sending file (%lld): \"%s\"\n", len, filename);
 
-    printf("PUT: sending file (%lu): \"%s\"\n", len, filename);
-
-    ftp_put(sockfd, filename, data, len);
-    free(data);
+    ftp_put_from_fd(peer, filename, fd, len);
+    close(fd);
     return false;
 }
 
-static bool handle_delete(int sockfd, char* filename) {
-    ftp_delete(sockfd, filename);
+static bool handle_delete(peer_t* peer, char* filename) {
+    ftp_delete(peer, filename);
     return false;
 }
 
-static bool handle_ls(int sockfd) {
-    char* files = ftp_ls(sockfd);
-    if (files != NULL) {
-        printf("%s", files);
-        free(files);
+/// @brief Print the files of the server, page by page as they arrive
+/// @param peer 
+/// @param prefix only names that start with it, NULL for all
+static bool handle_ls(peer_t* peer, char* prefix) {
+    char* after = NULL;
+    int after_len = 0;
+    bool empty = true;
+    while (true) {
+        const char* data;
+        long long len;
+        uint32_t flags;
+        char* msg = ftp_ls_page(peer, prefix, after, after_len, FTP_LISTING_MAX, &data, &len, &flags);
+        if (msg == NULL) {
+            break;
+        }
+        if (!(flags & FTP_LISTING)) {
+            // an older server sends the text list of every file
+            printf("%s", data);
+            free(msg);
+            break;
+        }
+
+        ftp_entry_t entry;
+        long long offset = 0;
+        while (!ftp_unpack_entry(data, len, &offset, &entry)) {
+            char date[32];
+            struct tm tm;
+            time_t mtime = entry.mtime;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm));
+            printf("%12lld  %s  %.*s\n", entry.size, date, entry.name_len, entry.name);
+            empty = false;
+
+            // the next page starts after the last name of this one
+            char* name = (char*)realloc(after, entry.name_len);
+            if (name == NULL) {
+                perror("realloc");
+                flags = 0;
+                break;
+            }
+            after = name;
+            after_len = entry.name_len;
+            memcpy(after, entry.name, after_len);
+        }
+        free(msg);
+        if (!(flags & FTP_LISTING_MORE) || after == NULL) {
+            if (empty) {
+                printf("No files found\n");
+            }
+            break;
+        }
     }
+    free(after);
     return false;
 }
 
-bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
+bool handle_cmd_arg(peer_t* peer, char* cmd, char* arg) {
     // CAT
     if (strcmp(cmd, "cat") == 0) {
         if (arg == NULL) {
@@ -89,8 +224,8 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
             return false;
         }
 
-        int len;
-        char* data = ftp_get(sockfd, arg, &len);
+        long long len;
+        char* data = ftp_get(peer, arg, &len);
         if (data != NULL) {
             if (len < 1000) {
                 // don't print huge files
@@ -112,7 +247,7 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
             return false;
         }
 
-        return handle_get(sockfd, arg);
+        return handle_get(peer, arg);
     }
 
     // PUT
@@ -122,7 +257,7 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
             return false;
         }
 
-        return handle_put(sockfd, arg);
+        return handle_put(peer, arg);
     }
 
     // DELETE
@@ -132,17 +267,12 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
             return false;
         }
 
-        return handle_delete(sockfd, arg);
+        return handle_delete(peer, arg);
     }
 
     // LS
     else if (strcmp(cmd, "ls") == 0) {
-        if (arg != NULL) {
-            printf("Usage: ls\n");
-            return false;
-        }
-
-        return handle_ls(sockfd);
+        return handle_ls(peer, arg);
     }
 
     // EXIT
@@ -151,7 +281,7 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
             printf("Usage: exit\n");
             return false;
         }
-        ftp_exit(sockfd);
+        ftp_exit(peer);
         return true;
     }
 
@@ -159,15 +289,15 @@ bool handle_cmd_arg(int sockfd, char* cmd, char* arg) {
 }
 
 /// @brief Handle a line of input from the user
-/// @param sockfd 
+/// @param peer 
 /// @param line 
 /// @return should program exit
-bool handle_line(int sockfd, char* line) {
+bool handle_line(peer_t* peer, char* line) {
     // Match against ftp commands
     // get <filename>
     // put <filename>
     // delete <filename>
-    // ls
+    // ls [prefix]
     // exit
 
     regex_t re;
@@ -199,7 +329,7 @@ bool handle_line(int sockfd, char* line) {
             arg[len] = '\0';
         }
 
-        bool exit = handle_cmd_arg(sockfd, cmd, arg);
+        bool exit = handle_cmd_arg(peer, cmd, arg);
 
         if (cmd != NULL) {
             free(cmd);
@@ -225,6 +355,12 @@ bool handle_line(int sockfd, char* line) {
 }
 
 void my_repl(int sockfd) {
+    // the commands share one peer, each transfer continues from what the last one learned
+    peer_t* peer = peer_create(sockfd, NULL, 0);
+    if (peer == NULL) {
+        return;
+    }
+
     char* line = NULL;
     size_t len = 0;
     ssize_t nread;
@@ -233,12 +369,11 @@ void my_repl(int sockfd) {
     while ((nread = getline(&line, &len, stdin)) != -1) {
         if (nread > 1) {
             line[nread - 1] = '\0';
-            if (handle_line(sockfd, line)) {
-                clear_remaining_input(sockfd);
+            if (handle_line(peer, line)) {
                 free(line);
+                peer_free(peer);
                 return;
             }
-            clear_remaining_input(sockfd);
         }
 
         if (line != NULL) {
@@ -250,4 +385,5 @@ void my_repl(int sockfd) {
         fflush(stdout);
     }
     free(line);
+    peer_free(peer);
 }
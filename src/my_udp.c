@@ -3,23 +3,122 @@
  * @author Kai Dewey
  */
 
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
 #include "my_udp.h"
+#include "my_fec.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <poll.h>
+#include <threads.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <netinet/udp.h>
 
 #define DEBUG 0 // 0: no debug, 1: print start and end frames, 2: print all frames
-#define DEFAULT_TIMEOUT_MS 500
+#define DEFAULT_TIMEOUT_MS 500 // retransmission timeout before the first rtt sample, and shortest wait of a receiver
+#define MIN_RTO_MS 20
+#define MAX_RTO_MS 1000
+#define RTT_GRANULARITY_US 1000 // resolution of the socket timeouts
 #define DEFAULT_SEND_TIMEOUT_MS 100
 #define USE_GO_BACK_N 1
-#define MAX_GO_BACK_N 1024
-#define GBN_THRESHOLD_US 200
+#define USE_SELECTIVE_REPEAT 1 // offer selective repeat, peers that don't support it fall back to go-back-n
+#define USE_WIRE_V2 1 // offer the compact frame format, peers that don't support it keep the legacy one
+#define INITIAL_WINDOW 32 // frames of PACKET_SIZE in flight at the start of a transfer
+#define MAX_WINDOW 32768 // most frames of PACKET_SIZE in flight, for paths with a large bandwidth-delay product
+#define LEGACY_WINDOW 1024 // most frames of PACKET_SIZE in flight to receivers that don't advertise their window
+#define FILE_WINDOW 1024 // frames of PACKET_SIZE a file window starts with, it grows as the frames in flight need
+#define PACING_QUANTUM_US 1000 // paced frames due within this are sent together, the timers have ms resolution
+#define READ_AHEAD_PARTS 2 // the window of a file transfer is read in this many parts
+#define SACK_BITS 256 // number of frames described by the bitmap of a selective ack
+#define SACK_DUP_THRESH 3 // frames sent after a hole that must be acked before the hole is resent
+#define ACK_FREQUENCY 10 // data frames acked at once by the receivers of our transfers, see set_ack_frequency
+#define MAX_ACK_FREQUENCY 64 // most data frames a receiver leaves unacknowledged
+#define ACK_DELAY_MS 5 // longest a receiver holds back an ack
+#define MAX_SOCKET_BUFFER (64 * 1024 * 1024) // largest kernel socket buffer the autotuning asks for
+#define SKB_OVERHEAD 256 // bookkeeping the kernel charges to a socket buffer for each datagram
+#ifdef __linux__
+#define USE_BATCH_IO 1 // send and receive data frames with sendmmsg and recvmmsg
+#define USE_UDP_OFFLOAD 1 // segment sends with UDP_SEGMENT and coalesce receives with UDP_GRO
+#define USE_IO_URING 1 // offer the io_uring engine, see set_io_uring
+#define USE_ZEROCOPY 1 // offer MSG_ZEROCOPY for the frames of mapped files, see set_zerocopy
+#define USE_SYNC_FILE_RANGE 1 // write back received files in batches, see set_sync_policy
+#else
+#define USE_BATCH_IO 0
+#define USE_UDP_OFFLOAD 0
+#define USE_IO_URING 0
+#define USE_ZEROCOPY 0
+#define USE_SYNC_FILE_RANGE 0
+#endif
+#define USE_MMAP 1 // send files from a mapping of the page cache instead of reading them into the window
+#define BATCH_SIZE 64 // most datagrams moved by one batched syscall
+#define GSO_MAX_SEGMENTS 64 // most frames the kernel segments out of one send
+#define GSO_MAX_BYTES 65000 // most bytes in one segmented send, below the udp length limit
+#define MAX_DATAGRAM_SIZE 65536
+#define FILE_IO_DEPTH 8 // file reads or writes of a transfer in flight at once
+#define URING_ENTRIES 256 // submission queue of the io_uring engine
+#define URING_BUFFERS 128 // receive buffers the kernel picks from, a power of 2
+#define USE_FEC 1 // accept repair frames from senders that offer them, see set_fec
+#define FEC_BLOCK_FRAMES 16 // data frames covered by the repair frames of a block
+#define FEC_MAX_BLOCK_REPAIRS 16 // most repair frames the sender adds to a block
+#define FEC_TARGET_FAILURE 0.01 // adaptive repair sizes the blocks to be beyond repair this rarely
+#define FEC_LOSS_GAIN 8 // the reported loss moves 1/FEC_LOSS_GAIN of the way to the loss of each block
+#define FEC_BLOCKS (2 * MAX_WINDOW / FEC_BLOCK_FRAMES) // blocks the receiver keeps repair frames for
+
+// flags exchanged in the START frame and its ACK
+#define XFER_SELECTIVE_REPEAT 0x1
+#define XFER_PACKET_SIZE 0x2 // the packet_size field is set
+#define XFER_LARGE 0x4 // the bytes_high field is set, the transfer may be longer than INT_MAX
+#define XFER_FEC 0x8 // REPAIR frames follow the blocks of DATA frames, selective repeat and WIRE_V2 only
+#define XFER_INLINE 0x10 // the data follows the fields of START, the ack of START ends the transfer
+#define XFER_XID 0x20 // the frames after START carry its start_id, WIRE_V2 only. The ack of START echoes it in its id field.
+#define XFER_ACK_FREQ 0x40 // the ack_every field is set, WIRE_V2 only
+#define XFER_WINDOW 0x80 // the v2 acks advertise the room of the receiver, the sender stays within it
+
+// wire formats of the frames after START, the START frame and its ACK always use WIRE_V1
+#define WIRE_V1 1 // frame_header_t, legacy peers send zero in the version fields
+#define WIRE_V2 2 // frame_header_v2_t
+#define WIRE_V2_MARKER 0x82 // byte 4 of a v2 frame, legacy frames have the low byte of their type there
+#define WIRE_V2_TIMESTAMP 0x80 // set in the type of a v2 frame that carries a timestamp
+#define WIRE_V2_LOSS 0x40 // set in the type of a v2 ACK that reports the loss rate, it follows the timestamp
+#define WIRE_V2_XID 0x20 // set in the type of a v2 frame that carries the id of its transfer, it follows the loss rate
+#define WIRE_V2_ACK_NOW 0x10 // set in the type of a v2 DATA frame that the receiver acks at once
+#define WIRE_V2_WINDOW 0x08 // set in the type of a v2 ACK that advertises the receive window, it follows the transfer id
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define ABS(a) ((a) < 0 ? (-a) : (a))
+#define ABS(a) ((a) < 0 ? -(a) : (a))
+
+#if USE_IO_URING
+#include "my_uring.h"
+#endif
+#if USE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
-static int UDP_TIMEOUT_MS = DEFAULT_TIMEOUT_MS;
+/// @brief Round trip estimate of the peer (RFC 6298), kept across transfers
+struct rtt_state_t {
+    bool valid; // a sample was taken
+    long long srtt_us;
+    long long rttvar_us;
+    long long latest_us; // latest sample
+    int rto_ms; // retransmission timeout without backoff
+    int backoff; // timeouts since the last sample, each one doubles the timeout
+};
+
+static bool BATCH_IO = USE_BATCH_IO;
+static thread_local bool UDP_GSO = USE_UDP_OFFLOAD; // cleared if the kernel refuses to segment
+static int LOCAL_PACKET_SIZE = PACKET_SIZE; // largest payload this side wants to use
+static cc_algorithm CC_ALGORITHM = CC_BBR;
+static double FEC_RATIO = 0; // repair frames sent per data frame, FEC_ADAPTIVE to follow the loss
+static int ACK_EVERY = ACK_FREQUENCY; // data frames we ask the receiver to ack at once
+static bool ZEROCOPY = false; // send the frames of mapped files with MSG_ZEROCOPY
+static sync_policy SYNC_POLICY = SYNC_NONE;
 
 static long long get_time_us(void) {
     struct timeval tv;
@@ -31,6 +130,62 @@ static long long get_time_ms(void) {
     return get_time_us() / 1000;
 }
 
+/// @brief Get a random id for a transfer, never 0
+/// @return id
+static uint32_t get_start_id(void) {
+    static thread_local uint32_t state = 0;
+    if (state == 0) {
+        state = ((uint32_t)get_time_us() ^ ((uint32_t)getpid() << 16) ^ (uint32_t)(uintptr_t)&state) | 1;
+    }
+    // xorshift32, never reaches 0 from a state that is not 0
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/// @brief Get the time to put in a frame, only differences of timestamps are meaningful
+/// @return microseconds, never 0 since 0 marks a frame without a timestamp
+static uint32_t get_timestamp(void) {
+    uint32_t timestamp = (uint32_t)get_time_us();
+    return timestamp == 0 ? 1 : timestamp;
+}
+
+/// @brief Get the retransmission timeout, including the backoff for timeouts in a row
+/// @param rtt 
+/// @return timeout in ms
+static int get_rto_ms(const struct rtt_state_t* rtt) {
+    return MIN((long long)rtt->rto_ms << rtt->backoff, MAX_RTO_MS);
+}
+
+/// @brief Update the round trip estimate with a new measurement
+/// @param rtt 
+/// @param rtt_us 
+static void rtt_sample(struct rtt_state_t* rtt, long long rtt_us) {
+    rtt->latest_us = rtt_us;
+    if (!rtt->valid) {
+        rtt->srtt_us = rtt_us;
+        rtt->rttvar_us = rtt_us / 2;
+        rtt->valid = true;
+    }
+    else {
+        rtt->rttvar_us = (3 * rtt->rttvar_us + ABS(rtt->srtt_us - rtt_us)) / 4;
+        rtt->srtt_us = (7 * rtt->srtt_us + rtt_us) / 8;
+    }
+
+    long long rto_us = rtt->srtt_us + MAX(RTT_GRANULARITY_US, 4 * rtt->rttvar_us);
+    rtt->rto_ms = MAX(MIN_RTO_MS, MIN((rto_us + 999) / 1000, MAX_RTO_MS));
+    rtt->backoff = 0;
+}
+
+/// @brief Double the retransmission timeout after a timeout
+/// @param rtt 
+static void rtt_backoff(struct rtt_state_t* rtt) {
+    if (get_rto_ms(rtt) < MAX_RTO_MS) {
+        rtt->backoff++;
+    }
+}
+
 
 
 void handle_error(const char* msg) {
@@ -39,36 +194,137 @@ void handle_error(const char* msg) {
 }
 
 struct frame_header_t {
-    int frame_id;
+    long long frame_id; // only the low 32 bits are sent, see expand_frame_id
     enum {
         DATA,
         START,
         ACK,
         END,
+        REPAIR, // WIRE_V2 only, frame_id is the first frame of the block
     } type;
     int id; // a unique number for debugging. Unique only to the sender
 };
 
 typedef struct frame_header_t frame_header_t;
 
+/// @brief Header of the legacy wire format
+struct frame_header_v1_t {
+    int32_t frame_id;
+    int32_t type;
+    int32_t id;
+};
+
+typedef struct frame_header_v1_t frame_header_v1_t;
+
+/// @brief Compact header used once both sides agree on WIRE_V2. An optional timestamp, loss
+/// rate and transfer id follow the header, then the payload of exactly length bytes.
+struct frame_header_v2_t {
+    uint32_t frame_id;
+    uint8_t version; // WIRE_V2_MARKER
+    uint8_t type; // WIRE_V2_TIMESTAMP, WIRE_V2_LOSS and WIRE_V2_XID are set when those fields are sent
+    uint16_t length; // bytes of the payload
+};
+
+typedef struct frame_header_v2_t frame_header_v2_t;
+
 struct frame_t {
     frame_header_t header;
     union {
-        char data[PACKET_SIZE];
-
         struct {
-            int bytes;
+            uint32_t bytes; // low 32 bits of the size, legacy peers read it as an int
+            int flags; // options the sender wants to use, zero from legacy senders
+            int packet_size; // payload size the sender wants to use
+            int version; // newest wire format the sender speaks
+            uint32_t bytes_high; // high 32 bits of the size
+            uint32_t start_id; // random id of the transfer, 0 from legacy senders
+            int ack_every; // data frames the sender wants acked at once
         } info;
+
+        // optional payload of an ACK, legacy receivers send the bare header
+        struct {
+            int flags; // options accepted by the receiver
+            int packet_size; // payload size of the DATA frames
+            int version; // wire format of the frames after START
+            long long sack_base; // frame id described by the first bit of sack, sent as 32 bits
+            uint32_t sack[SACK_BITS / 32]; // bitmap of frames received after a hole, trailing empty words are not sent
+        } ack;
+
+        // prefix of the payload of a REPAIR frame
+        struct {
+            int index; // which repair frame of the block it is
+            int repairs; // repair frames the sender adds to the block
+        } repair;
     } packet;
 
+    // not sent, the wire format to encode the frame with or that it was decoded from
+    int version;
+
+    // send time of a DATA or END frame, or the one echoed by its ACK. 0 when not sent, v2 only
+    uint32_t timestamp;
+
+    // share of the frames the receiver lost before repair, in 1/65535, sent with the ACKs
+    // of FEC transfers. -1 when not sent
+    int loss;
+
+    // start id of the transfer the frame belongs to, so frames of earlier transfers are told
+    // apart. 0 when not sent
+    uint32_t xid;
+
+    // v2 DATA frames only, the sender needs the ack of the frame at once
+    bool ack_now;
+
+    // DATA frames only, the payload points into a mapped file and may be sent with MSG_ZEROCOPY
+    bool mapped;
+
+    // v2 ACK frames only, frames after frame_id the receiver has room for. -1 when not sent
+    long long window;
+
+    // the payload of a DATA, REPAIR or inline START frame follows the header on the wire, it is not copied into the frame
+    const char* data;
+    int data_len;
 };
 
 typedef struct frame_t frame_t;
 
+// longest wire form of a DATA or REPAIR frame before its data: a v1 header, or a v2 header
+// with its timestamp, transfer id and repair prefix
+#define MAX_DATA_HEADER MAX(sizeof(frame_header_v1_t), sizeof(frame_header_v2_t) + 3 * sizeof(uint32_t))
+
+// longest wire form of a frame before the payload of a DATA frame
+#define MAX_FRAME_HEADER (sizeof(frame_header_v1_t) + sizeof(uint32_t) + sizeof(((frame_t*)NULL)->packet))
+
+/// @brief Get the size of a transfer from its START frame
+/// @param frame 
+/// @return bytes
+static long long get_start_bytes(const frame_t* frame) {
+    long long bytes = frame->packet.info.bytes;
+    if (frame->packet.info.flags & XFER_LARGE) {
+        bytes |= (long long)frame->packet.info.bytes_high << 32;
+    }
+    return bytes;
+}
+
+/// @brief Get the frame id a truncated 32 bit frame id stands for. The frames in flight
+/// are far closer than 2^31 frames to each other, so the id is the one nearest to near.
+/// @param wire_id low 32 bits of the frame id
+/// @param near a frame id the receiver expects, like the next frame or the base of the window
+/// @return frame id
+static long long expand_frame_id(uint32_t wire_id, long long near) {
+    const long long span = 1LL << 32;
+    long long frame_id = (near & ~(span - 1)) | wire_id;
+    if (frame_id < near - span / 2) {
+        frame_id += span;
+    }
+    else if (frame_id > near + span / 2) {
+        frame_id -= span;
+    }
+    return frame_id;
+}
+
 static void print_frame(frame_t* frame) {
     // long long time = get_time_ms();
     // printf("[%lld] ", time);
-    printf("(%5d) [FRAME: %5d]", frame->header.id, frame->header.frame_id);
+    printf("(%5d) [FRAME: %5lld]", frame->header.id, frame->header.frame_id);
 
     switch (frame->header.type) {
     case DATA:
@@ -76,555 +332,3841 @@ static void print_frame(frame_t* frame) {
         break;
     case START:
         printf("  START\n");
-        printf("  bytes = %d\n", frame->packet.info.bytes);
+        printf("  bytes = %lld\n", get_start_bytes(frame));
+        if (frame->packet.info.flags & XFER_PACKET_SIZE) {
+            printf("  packet_size = %d\n", frame->packet.info.packet_size);
+        }
         break;
     case ACK:
         printf("  ACK\n");
+        if (frame->packet.ack.flags & XFER_SELECTIVE_REPEAT) {
+            printf("  sack_base = %lld\n", frame->packet.ack.sack_base);
+        }
         break;
     case END:
         printf("  END\n");
         break;
+    case REPAIR:
+        printf("  REPAIR\n");
+        printf("  index = %d/%d\n", frame->packet.repair.index, frame->packet.repair.repairs);
+        break;
     }
 }
 
 /// @brief Calculate the number number of frames needed to send len bytes
 /// @param len 
+/// @param packet_size payload bytes per frame
 /// @return number of frames needed to send len bytes
-static int get_frame_count(int len) {
-    int frame_count = len / PACKET_SIZE;
-    if (len % PACKET_SIZE != 0) {
+static long long get_frame_count(long long len, int packet_size) {
+    long long frame_count = len / packet_size;
+    if (len % packet_size != 0) {
         frame_count += 1;
     }
     return frame_count;
 }
 
-#ifdef MSG_DONTWAIT
-void clear_remaining_input(int sockfd) {
-
-    int n;
-    bool empty = true;
-    char buf[1];
-    while ((n = recv(sockfd, buf, 1, MSG_DONTWAIT)) > 0) {
-        empty = false;
-    }
-    if (!empty) {
-        fprintf(stderr, "clear_remaining_input: socket was not empty\n");
-    }
+/// @brief Convert a window given in legacy sized frames to frames of packet_size,
+/// so the bytes in flight don't grow with the payload size.
+/// @param frames 
+/// @param packet_size 
+/// @return window in frames
+static int get_window(int frames, int packet_size) {
+    return MAX(1, (int)((long long)frames * PACKET_SIZE / packet_size));
 }
-#else
-void clear_remaining_input(int) {
+
+/// @brief Get a window given in legacy sized frames in frames of packet_size, without
+/// more frames than legacy sized ones
+/// @param frames 
+/// @param packet_size 
+/// @return window in frames
+static int get_max_window(int frames, int packet_size) {
+    return MIN(frames, get_window(frames, packet_size));
 }
-#endif
 
-/// @brief Send data with timeout
-/// @param data 
-/// @param data_len 
-/// @param sockfd 
-/// @param dest_addr 
-/// @param dest_addr_len 
-/// @return Return true on failure
-static bool send_timeout(char* data, int data_len, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
-    struct pollfd pfd[1];
+static bool bitmap_get(const uint32_t* bitmap, long long bit) {
+    return (bitmap[bit / 32] >> (bit % 32)) & 1;
+}
 
-    pfd[0].fd = sockfd;
-    pfd[0].events = POLLOUT;
+static void bitmap_set(uint32_t* bitmap, long long bit) {
+    bitmap[bit / 32] |= (uint32_t)1 << (bit % 32);
+}
 
-    long long start = get_time_ms();
-    while (get_time_ms() - start < DEFAULT_SEND_TIMEOUT_MS) {
-        int num_events = poll(pfd, 1, DEFAULT_SEND_TIMEOUT_MS - (get_time_ms() - start));
+static void bitmap_clear(uint32_t* bitmap, long long bit) {
+    bitmap[bit / 32] &= ~((uint32_t)1 << (bit % 32));
+}
 
-        if (num_events == 0) {
-            return true;
-        }
+/// @brief Allocate a zeroed bitmap with room for bits [0, bits]
+/// @param bits 
+/// @return pointer to bitmap, NULL on failure
+static uint32_t* bitmap_alloc(long long bits) {
+    return (uint32_t*)calloc(bits / 32 + 1, sizeof(uint32_t));
+}
 
-        int pollin_happened = pfd[0].revents & POLLOUT;
-        if (pollin_happened) {
-            break;
-        }
-    }
+/// @brief A queue of frame ids that grows as needed
+struct id_queue_t {
+    long long* ids;
+    long long capacity; // 0 or a power of 2
+    long long head; // ids taken out so far
+    long long tail; // ids put in so far
+};
 
-    if (dest_addr == NULL) {
-        if (send(sockfd, data, data_len, 0) == -1) {
-            handle_error("send");
+/// @brief Put a frame id at the end of a queue
+/// @param queue 
+/// @param id 
+/// @return Return true on failure
+static bool id_queue_push(struct id_queue_t* queue, long long id) {
+    if (queue->tail - queue->head == queue->capacity) {
+        long long capacity = MAX(64, 2 * queue->capacity);
+        long long* ids = (long long*)malloc(capacity * sizeof(long long));
+        if (ids == NULL) {
+            perror("malloc");
+            return true;
         }
-    }
-    else {
-        if (sendto(sockfd, data, data_len, 0, dest_addr, *dest_addr_len) == -1) {
-            handle_error("sendto");
+        for (long long i = queue->head; i < queue->tail; i++) {
+            ids[i & (capacity - 1)] = queue->ids[i & (queue->capacity - 1)];
         }
+        free(queue->ids);
+        queue->ids = ids;
+        queue->capacity = capacity;
     }
-
+    queue->ids[queue->tail++ & (queue->capacity - 1)] = id;
     return false;
 }
 
-/// @brief Receive data from socket with timeout
-/// @param data 
-/// @param data_len 
-/// @param sockfd 
-/// @param client_addr 
-/// @param client_addr_len 
-/// @return Return true on failure
-static bool recv_timeout(char* data, int data_len, int sockfd, sockaddr* client_addr, socklen_t* client_addr_len) {
-    struct pollfd pfd[1];
-
-    pfd[0].fd = sockfd;
-    pfd[0].events = POLLIN;
+/// @brief Get the frame id at the front of a queue that is not empty
+/// @param queue 
+/// @return frame id
+static long long id_queue_front(const struct id_queue_t* queue) {
+    return queue->ids[queue->head & (queue->capacity - 1)];
+}
 
-    long long start = get_time_ms();
+/// @brief Empty a queue and free its ids
+/// @param queue 
+static void id_queue_free(struct id_queue_t* queue) {
+    free(queue->ids);
+    memset(queue, 0, sizeof(*queue));
+}
 
-    while (get_time_ms() - start < UDP_TIMEOUT_MS) {
-        int num_events = poll(pfd, 1, UDP_TIMEOUT_MS - (get_time_ms() - start));
+/// @brief A read or write of a run of frames of a file
+struct file_op_t {
+    bool write;
+    bool done;
+    size_t bytes;
+    long long result; // bytes read or written, or a negative errno
+    long long end_frame; // frame after the run
+};
 
-        if (num_events == 0) {
-            return true;
-        }
+/// @brief The file reads or writes of a transfer. With io_uring they are in flight while the
+/// frames are sent and received, and may complete in any order. Otherwise they are done right away.
+struct file_io_t {
+    bool async; // submitted to the io_uring engine of the thread
+    bool failed;
+    struct file_op_t ops[FILE_IO_DEPTH]; // in the order they were submitted
+    int head;
+    int count;
+    long long done_frame; // lowest frame not read or written, every frame before it is
+    off_t base; // where the first frame is in the file
+};
 
-        int pollin_happened = pfd[0].revents & POLLIN;
-        if (pollin_happened) {
-            break;
-        }
-    }
+/// @brief A block of data frames the receiver keeps repair frames for until it is complete
+struct fec_block_t {
+    long long block; // -1 if the entry is free
+    int received; // data frames of the block received
+    int arrived; // data and repair frames that arrived before the loss of the block was counted
+    int sent_repairs; // repair frames the sender adds to the block, -1 until one arrived
+    bool counted; // its loss is part of fec_loss
+    int repairs; // repair frames kept
+    int indices[FEC_MAX_BLOCK_REPAIRS];
+    char* data[FEC_MAX_BLOCK_REPAIRS];
+};
 
-    if (client_addr == NULL) {
-        if (recv(sockfd, data, data_len, 0) == -1) {
-            handle_error("recv");
-            return true;
-        }
-    }
-    else {
-        if (recvfrom(sockfd, data, data_len, 0, client_addr, client_addr_len) == -1) {
-            handle_error("recvfrom");
-            return true;
-        }
-    }
+/// @brief State the receiver needs to acknowledge frames of a transfer
+struct recv_state_t {
+    int flags; // options accepted from the START frame
+    uint32_t xid; // start id of the transfer when XFER_XID is accepted, else 0
+    int version; // wire format of the frames after START
+    int packet_size; // payload bytes per DATA frame
+    long long next_frame; // lowest frame id not received yet
+    long long frame_count;
+    long long len;
+    uint32_t* received; // frames received out of order from next_frame on, by frame id modulo max_window_frames. Selective repeat only.
 
-    return false;
-}
+    // frames go into data when the whole transfer is kept in memory, otherwise they
+    // are kept in a window of frames until they can be written to fd in order
+    char* data;
+    bool to_fd;
+    int fd; // -1 to drop the data
+    off_t file_offset; // where the data goes in fd
+    char* window;
+    int window_frames;
+    int max_window_frames; // the window grows up to this when frames arrive past it, and received holds as many
+    long long written_frame; // lowest frame id not written to fd
+    long long synced_bytes; // bytes of fd handed to writeback, see set_sync_policy
+    struct file_io_t io; // writes of the window to fd
 
-/// @brief Send frame to socket
-/// @param frame 
-/// @param sockfd 
-/// @param dest_addr 
-/// @param dest_addr_len 
-/// @return Return true on failure
-static bool send_frame(frame_t* frame, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
-    static int id = 0;
-    frame->header.id = id++;
+    // repair frames of the blocks in the window, FEC only
+    struct fec_block_t* fec_blocks;
+    double fec_loss; // share of the frames lost before repair, reported to the sender
+    int fec_repairs; // repair frames per block, as last seen
 
-#if DEBUG > 1
-    printf("SEND ");
-    print_frame(frame);
-#endif
-    int len = sizeof(frame_header_t);
-    switch (frame->header.type) {
-    case DATA:
-        len += sizeof(frame->packet);
-        break;
-    case START:
-        len += sizeof(frame->packet);
-        break;
-    case ACK:
-    case END:
-        break;
-    }
-    bool ret = send_timeout((char*)frame, len, sockfd, dest_addr, dest_addr_len);
-    return ret;
-}
+    // acks are held back until ack_every data frames arrived or ACK_DELAY_MS passed, unless
+    // a frame needs one at once
+    int ack_every; // 1 unless the sender asks for fewer acks
+    int unacked; // data frames received since the last ack
+    long long ack_frame_id; // frame the held back ack answers
+    long long ack_due_us; // when the held back ack is sent, 0 if there is none
 
-/// @brief Get a frame from the socket
-/// @param frame 
-/// @param sockfd 
-/// @param client_addr 
-/// @param client_addr_len 
-/// @return Return true on failure
-static bool recv_frame(frame_t* frame, int sockfd, sockaddr* client_addr, socklen_t* client_addr_len) {
-    bool ret = recv_timeout((char*)frame, sizeof(frame_t), sockfd, client_addr, client_addr_len);
-    if (ret) {
-        return true;
-    }
+    // data frames since rate_start_us, their rate sizes the receive buffer of the socket
+    long long rate_start_us;
+    int rate_frames;
 
-#if DEBUG > 1
-    printf("RECV ");
-    print_frame(frame);
-#endif
+    int wait_ms; // how long the sender may be silent before a wait counts as failed
+    int failures; // waits in a row without a frame
+    int deci_position; // progress printed, in tenths
+};
 
-    return false;
-}
+typedef struct recv_state_t recv_state_t;
 
-/// @brief Wait for an acknowledge
-/// @param frame_id 
-/// @param ack_frame_id 
-/// @param sockfd 
-/// @param client_addr 
-/// @param client_addr_len 
-/// @return Return true on failure. Failure is likely due to timeout
-static bool try_recv_ack(int frame_id, int* ack_frame_id, int sockfd, sockaddr* client_addr, socklen_t* client_addr_len) {
+/// @brief The data of a transfer and how it is cut into frames
+struct send_state_t {
+    const char* msg; // whole transfer in memory, NULL when it is read from fd
+    long long len;
+    int packet_size; // payload bytes per DATA frame, agreed on in the START handshake
+    int version; // wire format, agreed on in the START handshake
+    uint32_t xid; // start id sent in the frames when the receiver echoes XFER_XID, else 0
+    long long frame_count;
 
-    // wait for ack for timeout
-    frame_t frame;
-    while (recv_frame(&frame, sockfd, client_addr, client_addr_len) == false) {
-        // if there is an end frame from a previous transaction and we are waiting for
-        // a start frame, we will ack it, but not use it.
-        if (frame.header.type == END && frame_id == 0) {
-            frame_t ack;
-            ack.header.frame_id = frame.header.frame_id;
-            ack.header.type = ACK;
-            if (send_frame(&ack, sockfd, client_addr, client_addr_len)) {
-                fprintf(stderr, "Failed to send ack\n");
-            }
-            continue;
-        }
+    // frames read from fd are kept in a window of frames until they are acknowledged,
+    // unless the file is mapped into msg
+    int fd;
+    off_t file_offset; // where the data starts in fd
+    bool mapped; // msg is a mapping of fd, unmapped once the data frames are sent
+    long map_delta; // bytes mapped before msg, the mapping starts at a page
+    char* window;
+    int window_frames; // grows up to max_window_frames before the frames that need it are sent
+    long long read_frame; // lowest frame id not read from fd
+    long long base_frame; // lowest frame id not acknowledged, its slot and the ones after it are in use
+    struct file_io_t io; // reads of the window from fd
 
-        *ack_frame_id = frame.header.frame_id;
+    // state of the data frames, go-back-n unless the receiver accepts selective repeat
+    bool selective;
+    bool ack_freq; // the receiver holds back its acks, frames that need one at once are marked
+    long long window_end; // lowest frame id the receiver has no room for, as its acks advertise
+    int max_window_frames; // most frames from base_frame on that may be in flight
+    cc_t cc;
+    long long next_frame; // lowest frame never sent, or to send next with go-back-n
+    int inflight; // frames sent and not acknowledged, selective repeat only
+    bool holes; // lost frames are waiting to be resent
+    uint32_t* acked; // frames of the window acked, by frame id modulo max_window_frames. Selective repeat only.
+    uint32_t* lost; // frames of the window waiting in lost_ids, by frame id modulo max_window_frames
+    long long* sent_seq; // order in which the frames of the window were last sent, by frame id modulo max_window_frames
+    struct id_queue_t sent; // frame ids by send order, 0 for repair frames. The frames before acked_seq are checked for loss once.
+    struct id_queue_t lost_ids; // lost frames in the order they were found, until they are resent
+    long long send_seq; // sends so far, the send order of the next one
+    long long acked_seq; // latest send order acknowledged by the receiver
+    long long recovery_seq; // losses of frames sent before this were already reported to cc
+    int reset_counter; // retransmission timeouts in a row
+    int deci_position; // progress printed, in tenths
+    long long next_send_us; // when the next paced frame is due
 
-        // we allow for a header frame id to be greater than the frame id
-        // since ack are only sent for frames that the client has received in order.
-        // Due to this, we can garantee that the client has has received any skipped frames.
-        // if we are recieving a future ack frame, we most likely has missed ack.
-        if (frame.header.type == ACK && frame.header.frame_id >= frame_id) {
-            return false;
-        }
-    }
+    // repair frames, selective repeat with FEC only. They are built while the data frames
+    // of a block go out for the first time, and sent after the last one.
+    bool fec;
+    int fec_repairs; // repair frames of the block being sent
+    char* fec_buf; // those repair frames
+    int fec_sent[FEC_BLOCKS]; // repair frames sent after each block of the window
+};
 
+typedef struct send_state_t send_state_t;
 
-    return true;
-}
+enum transfer_phase {
+    PHASE_IDLE, // no transfer was started
+    PHASE_START, // the sender waits for the ack of START, the receiver for START
+    PHASE_DATA,
+    PHASE_END, // the sender waits for the ack of END, the receiver for END
+    PHASE_DONE,
+    PHASE_FAILED,
+};
 
-/// @brief Send a frame of data and wait for an acknowledge
-/// @param frame 
-/// @param wait_ack 
-/// @param sockfd 
-/// @param dest_addr 
-/// @param dest_addr_len 
-/// @return 
-static bool send_frame_ack(frame_t* frame, bool wait_ack, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
-    // send frame
-    for (int i = 0; i < RETRY_COUNT; i++) {
-        if (send_frame(frame, sockfd, dest_addr, dest_addr_len)) {
-#if DEBUG > 1
-            printf("Failed to send frame\n");
-#endif
-            continue;
-        }
+/// @brief One side of the transfers with a peer. A transfer never blocks: it moves on when
+/// a frame of the peer arrives (peer_handle_datagram) and when its timers expire (peer_poll).
+struct peer_t {
+    int sockfd;
+    sockaddr_storage addr;
+    socklen_t addr_len; // 0 when sockfd is connected to the peer
+    struct rtt_state_t rtt;
 
+    // loss before repair, kept across transfers so the repair frames fit the link from the start
+    double fec_loss_sent; // of our frames, as the peer reports it
+    double fec_loss_received; // of the frames of the peer
 
-        // check acknowledge
-        // we are using GO-BACK-N so we don't need to wait for ack for data frames.
-        // We will wait for the last ending frame, and for the start frame.
-        if (!wait_ack) {
-            return false;
-        }
+    // congestion state of the last transfer we sent, the next one to the peer continues it
+    // instead of probing the path from INITIAL_WINDOW again
+    cc_t cc;
+    int cc_packet_size; // payload bytes of the frames cc counts, 0 if there is no state to continue
+    long long cc_end_us; // when the last transfer stopped sending
 
-        int ack_frame_id;
-        if (try_recv_ack(frame->header.frame_id, &ack_frame_id, sockfd, dest_addr, dest_addr_len)) {
-#if DEBUG > 1
-            printf("Failed to receive ack\n");
-#endif
-            continue;
-        }
-        else {
-            return false;
-        }
-    }
+    // start id of the last transfer received inside its START. The sender resends that
+    // START until it gets our ack, so it is acked again instead of taken as a new transfer.
+    uint32_t inline_start_id;
 
-    printf("Failed to send frame:\n");
+    // start ids of the current and of the previous transfer. Frames that carry another id
+    // are late copies from an earlier transfer and are dropped.
+    uint32_t xid;
+    uint32_t last_xid;
 
-    print_frame(frame);
+    bool sending;
+    enum transfer_phase phase;
+    send_state_t ss;
+    recv_state_t rs;
 
-    printf("Transaction dropped\n");
+    frame_t control; // START or END frame of the sender, resent until it is acknowledged
+    int tries; // times the control frame was sent
+    long long timer_us; // start of the retransmission timer, or of the wait of the receiver
+};
 
-    return true;
+#if !USE_BATCH_IO
+// one datagram per call where the kernel has no sendmmsg and recvmmsg
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
 
+static int sendmmsg(int sockfd, struct mmsghdr* msgs, unsigned int vlen, int flags) {
+    (void)vlen;
+    ssize_t n = sendmsg(sockfd, &msgs[0].msg_hdr, flags);
+    if (n == -1) {
+        return -1;
+    }
+    msgs[0].msg_len = n;
+    return 1;
 }
 
-/// @brief Receive a frame of data and send an acknowledge
-/// @param frame 
-/// @param next_frame 
-/// @param sockfd 
-/// @param client_addr 
-/// @param client_addr_len 
-/// @return return true on failure
-static bool recv_frame_ack(frame_t* frame, int next_frame, int sockfd, sockaddr* client_addr, socklen_t* client_addr_len) {
-    // receive frame
-    int failures = 0;
-    while (failures < RETRY_COUNT) {
-        if (recv_frame(frame, sockfd, client_addr, client_addr_len)) {
-            failures++;
-            continue;
-        }
-
-#if DEBUG > 1
-        if (frame->header.frame_id != next_frame) {
-            printf("Received frame %d, expected %d\n", frame->header.frame_id, next_frame);
-        }
-#endif
-
-        if (frame->header.frame_id < next_frame || (frame->header.type == END && next_frame == 0)) {
-            // send again ack in case of failed ack
-            // only ack if we have already passed this frame
-            // we also ack the end frame that may be left over from a previous transaction
-            frame_t ack;
-            ack.header.type = ACK;
-            ack.header.frame_id = frame->header.frame_id;
-
-            if (send_frame(&ack, sockfd, client_addr, client_addr_len)) {
-                fprintf(stderr, "Failed to send ack\n");
-            }
-        }
-        else if (frame->header.frame_id == next_frame) {
-            frame_t ack;
-            ack.header.frame_id = frame->header.frame_id;
-            ack.header.type = ACK;
-            if (send_frame(&ack, sockfd, client_addr, client_addr_len)) {
-                fprintf(stderr, "Failed to send ack\n");
-                continue;
-            }
-            return false;
-        }
+static int recvmmsg(int sockfd, struct mmsghdr* msgs, unsigned int vlen, int flags, struct timespec* timeout) {
+    (void)vlen;
+    (void)timeout;
+    ssize_t n = recvmsg(sockfd, &msgs[0].msg_hdr, flags);
+    if (n == -1) {
+        return -1;
     }
-
-    return true;
+    msgs[0].msg_len = n;
+    return 1;
 }
+#endif // !USE_BATCH_IO
 
-/// @brief Create a frame to send based in the frame id.
-/// @param msg 
-/// @param len 
-/// @param frame_id 
-/// @param wait_ack 
-/// @param sockfd 
-/// @param dest_addr 
-/// @param dest_addr_len 
-/// @return 
-int send_frame_by_id(const char* msg, int len, int frame_id, bool wait_ack, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
-    // create a blank data frame
-    frame_t frame;
-    frame.header.frame_id = frame_id;
-    frame.header.type = DATA;
-    memset(&frame.packet.data, 0, PACKET_SIZE); // zero memory
+/// @brief DATA and REPAIR frames waiting to go out with a single sendmmsg. The payload is sent
+/// straight from the transfer data.
+struct send_batch_t {
+    int count;
+    int mapped; // frames whose payload is a mapped file, MSG_ZEROCOPY may send them
+    char headers[BATCH_SIZE][MAX_DATA_HEADER]; // wire header of each frame
+    struct iovec iovs[BATCH_SIZE][2]; // header and payload of each frame
+};
 
-    // calculate data offset and size
-    int data_offset = PACKET_SIZE * (frame_id - 1);
-    int data_size = MIN(len - data_offset, PACKET_SIZE);
+/// @brief Datagrams read with a single recvmmsg, handed out one frame at a time.
+/// With UDP_GRO one datagram may hold several frames.
+struct recv_batch_t {
+    int sockfd;
+    bool gro; // UDP_GRO is enabled on sockfd
+    int count; // datagrams read
+    int next; // datagram being handed out
+    int offset; // offset of the next frame in that datagram
+    int segment_size[BATCH_SIZE]; // size of the frames coalesced in each datagram
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    sockaddr_storage addrs[BATCH_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control[BATCH_SIZE];
+    char buffers[BATCH_SIZE][MAX_DATAGRAM_SIZE];
+};
 
-    // copy data into frame
-    memcpy(&frame.packet.data, msg + data_offset, data_size);
+/// @brief Sizes of the kernel buffers of the socket of a thread, as the autotuning left them
+struct socket_buffers_t {
+    int sockfd;
+    long long rcvbuf; // bytes asked for, the kernel may have capped it
+    long long sndbuf;
+};
 
-    return send_frame_ack(&frame, wait_ack, sockfd, dest_addr, dest_addr_len);
-}
+/// @brief MSG_ZEROCOPY on the socket of a thread. The kernel pins the pages of the frames
+/// instead of copying them, and reports on the error queue of the socket once it let go of them.
+struct zerocopy_t {
+    int sockfd; // socket SO_ZEROCOPY was asked for on, -1 for none
+    bool copied; // the kernel copied the frames anyway, as it does over loopback, or refused
+    long long sends; // sendmsg calls with MSG_ZEROCOPY
+    long long completions; // of those, the ones the kernel let go of
+};
 
-/// @brief Send some data structure
-/// @param sockfd socket file descriptor
-/// @param msg pointer to data
-/// @param len length of data
-/// @param dest_addr 
-/// @param dest_addr_len 
-/// @return Return bytes sent. -1 on failure
-int send_data(int sockfd, const char* msg, int len, sockaddr* dest_addr, socklen_t* dest_addr_len) {
-    // reset the timeout for new transaction
-    UDP_TIMEOUT_MS = DEFAULT_TIMEOUT_MS;
-    // count how many frames we expect
-    int frame_count = get_frame_count(len);
+// every thread has its own batches, its own sockets and its own peers
+static thread_local struct socket_buffers_t SOCKET_BUFFERS = { .sockfd = -1 };
+static thread_local struct zerocopy_t ZEROCOPY_STATE = { .sockfd = -1 };
+static thread_local struct send_batch_t SEND_BATCH;
+static thread_local struct recv_batch_t* RECV_BATCH; // allocated on first use, it is large
 
-#if DEBUG
-    printf("Expecting to send %d frames\n", frame_count);
-#endif
+#if USE_IO_URING
+#define URING_RECV 1 // user_data of the multishot receive
+#define URING_SEND 2 // user_data of the sends, the other completions are file reads and writes
+#define URING_CANCEL 3
+#define URING_GROUP 0 // buffer group of the receive buffers
+#define URING_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(sockaddr_storage) + URING_CONTROL_SIZE + MAX_DATAGRAM_SIZE)
 
-    // build starting frame
-    frame_t frame;
+/// @brief The sockets and files of a thread driven through one io_uring. A multishot receive
+/// keeps filling the registered buffers with datagrams, without a syscall per datagram. The
+/// sends and the file reads and writes of every transfer go through the same ring.
+struct uring_engine_t {
+    uring_t ring;
+    int sockfd; // socket the receive is set up for, -1 if none
+    bool armed; // the multishot receive is in flight
+    bool gro; // UDP_GRO is enabled on sockfd
+    int recv_error; // error that ended the receive, a negative errno
+    struct msghdr recv_msg; // room the receive leaves for the address and control data
 
-    // we send the total size first so client can allocate space.
-    memset(&frame, 0, sizeof(frame)); // zero memory
-    frame.header.type = START;
-    frame.header.frame_id = 0;
-    frame.packet.info.bytes = len;
+    // datagrams received and not handed out, each one holds a buffer
+    int queue_bid[URING_BUFFERS];
+    int queue_len[URING_BUFFERS];
+    int queue_head;
+    int queue_count;
 
-    if (send_frame_ack(&frame, true, sockfd, dest_addr, dest_addr_len)) {
-        fprintf(stderr, "Failed to send start frame\n");
-        return -1;
-    }
+    // datagram being handed out, one frame at a time with UDP_GRO. Its buffer is
+    // given back to the kernel on the next receive.
+    int held_bid; // -1 if none
+    const char* name;
+    socklen_t name_len;
+    const char* payload;
+    int payload_len;
+    int offset;
+    int segment_size;
 
-#if USE_GO_BACK_N
-    // send data frames sequentially
-    int base_frame_id = 1;
-    int current_frame_id = 1;
-    int reset_counter = 0;
-    int success_counter = 0;
-    int GO_BACK_N = 32;
-    int deci_position = 0;
+    int sends; // sends in flight
+    int send_error; // first error of the sends, a negative errno
+};
 
-    while (base_frame_id <= frame_count) {
-        // send up to base + N frames
-        while (current_frame_id <= MIN(base_frame_id + GO_BACK_N - 1, frame_count)) {
-            if (send_frame_by_id(msg, len, current_frame_id, false, sockfd, dest_addr, dest_addr_len)) {
-                return -1;
-            }
-            current_frame_id++;
-        }
+static bool IO_URING = false;
+static thread_local struct uring_engine_t* URING; // created on first use
+static thread_local bool URING_UNAVAILABLE;
 
-        long long start = get_time_us();
-        int ack_frame_id;
-        // wait for ack
-        if (try_recv_ack(base_frame_id, &ack_frame_id, sockfd, dest_addr, dest_addr_len)) {
-            // failed to receive ack from base frame id
-            reset_counter++;
-            if (reset_counter > RETRY_COUNT) {
-                fprintf(stderr, "Failed to send frame\n");
-                fprintf(stderr, "Sent %d frames out of %d\n", base_frame_id - 1, frame_count);
-                return -1;
+/// @brief Handle a completion of the ring
+/// @param engine 
+/// @param cqe 
+static void uring_handle_cqe(struct uring_engine_t* engine, const struct io_uring_cqe* cqe) {
+    switch (cqe->user_data) {
+    case URING_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0) {
+                int tail = (engine->queue_head + engine->queue_count++) % URING_BUFFERS;
+                engine->queue_bid[tail] = bid;
+                engine->queue_len[tail] = cqe->res;
             }
-#if DEBUG
-            printf("Resetting base frame id to %d\n", base_frame_id);
-#endif
-            current_frame_id = base_frame_id;
-            success_counter = 0;
-
-            if (reset_counter % 2 == 0) {
-                // decrease GO_BACK_N if we are doing poorly
-                GO_BACK_N = GO_BACK_N < 2 ? 1 : GO_BACK_N / 2;
-#if DEBUG
-                printf("Decreasing GO_BACK_N to %d\n", GO_BACK_N);
-#endif
+            else {
+                uring_recycle_buffer(&engine->ring, bid);
             }
-
-            // increase timeout for failed frame
-            UDP_TIMEOUT_MS = MIN(UDP_TIMEOUT_MS * 2, 500);
         }
-        else {
-            reset_counter = 0;
-            success_counter++;
-            base_frame_id = ack_frame_id + 1;
-
-            long long end = get_time_us();
-
-            // set timeout to the time it took to receive a valid frame
-            int elapsed_ms = ((end - start) / 1000);
-            if (elapsed_ms > 50) {
-                UDP_TIMEOUT_MS = elapsed_ms + 50;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // out of buffers or cancelled, anything else is an error of the socket
+            engine->armed = false;
+            if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+                engine->recv_error = cqe->res;
             }
+        }
+        break;
+    case URING_SEND:
+        engine->sends--;
+        if (cqe->res < 0 && engine->send_error == 0) {
+            engine->send_error = cqe->res;
+        }
+        break;
+    case URING_CANCEL:
+        break;
+    default: {
+        struct file_op_t* op = (struct file_op_t*)(uintptr_t)cqe->user_data;
+        op->result = cqe->res;
+        op->done = true;
+        break;
+    }
+    }
+}
 
+/// @brief Handle the completions that are there, without a syscall
+/// @param engine 
+static void uring_reap(struct uring_engine_t* engine) {
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&engine->ring)) != NULL) {
+        uring_handle_cqe(engine, cqe);
+        uring_cqe_seen(&engine->ring);
+    }
+}
 
-            // for large files, print progress
-            if (frame_count > 100) {
-                if (base_frame_id >= (frame_count * deci_position / 10)) {
-                    printf("Sent %d%% (%d/%d)\n", deci_position * 10, base_frame_id, frame_count);
-                    fflush(stdout);
-                    deci_position++;
-                }
+/// @brief Submit what is queued and wait for a completion
+/// @param engine 
+/// @param timeout_ms -1 to wait without timeout
+/// @return Return true on timeout
+static bool uring_wait(struct uring_engine_t* engine, int timeout_ms) {
+    if (uring_enter(&engine->ring, 1, timeout_ms) && errno != ETIME && errno != EINTR) {
+        handle_error("io_uring_enter");
+    }
+    bool timeout = uring_peek_cqe(&engine->ring) == NULL;
+    uring_reap(engine);
+    return timeout;
+}
+
+/// @brief Start the multishot receive on a socket
+/// @param engine 
+/// @param sockfd 
+/// @return Return true on failure
+static bool uring_arm(struct uring_engine_t* engine, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&engine->ring);
+    if (sqe == NULL) {
+        return true;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&engine->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_RECV;
+    engine->armed = true;
+    return uring_enter(&engine->ring, 0, 0);
+}
+
+/// @brief Give the buffers of the datagrams that were not handed out back to the kernel
+/// @param engine 
+/// @return number of datagrams dropped
+static int uring_drop(struct uring_engine_t* engine) {
+    int dropped = engine->queue_count;
+    if (engine->held_bid != -1 && engine->offset < engine->payload_len) {
+        dropped++;
+    }
+    for (; engine->queue_count > 0; engine->queue_count--) {
+        uring_recycle_buffer(&engine->ring, engine->queue_bid[engine->queue_head]);
+        engine->queue_head = (engine->queue_head + 1) % URING_BUFFERS;
+    }
+    if (engine->held_bid != -1) {
+        uring_recycle_buffer(&engine->ring, engine->held_bid);
+        engine->held_bid = -1;
+    }
+    engine->payload_len = 0;
+    engine->offset = 0;
+    return dropped;
+}
+
+/// @brief Stop receiving, the datagrams that were not handed out are dropped
+/// @param engine 
+static void uring_disarm(struct uring_engine_t* engine) {
+    if (engine->armed) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&engine->ring);
+        if (sqe == NULL) {
+            handle_error("io_uring");
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_RECV;
+        sqe->user_data = URING_CANCEL;
+        while (engine->armed) {
+            uring_wait(engine, -1);
+        }
+    }
+    uring_drop(engine);
+    engine->sockfd = -1;
+    engine->recv_error = 0;
+}
+
+/// @brief Point the receive at a socket. UDP_GRO is enabled as on the poll path.
+/// @param engine 
+/// @param sockfd 
+static void uring_setup_socket(struct uring_engine_t* engine, int sockfd) {
+    bool gro = BATCH_IO && USE_UDP_OFFLOAD;
+    if (engine->sockfd == sockfd && engine->gro == gro) {
+        return;
+    }
+    if (engine->sockfd != sockfd) {
+        uring_disarm(engine);
+    }
+
+#if USE_UDP_OFFLOAD
+    int enabled = gro;
+    if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &enabled, sizeof(enabled)) == -1) {
+        gro = false;
+    }
+    if (RECV_BATCH != NULL) {
+        // the poll path sets the option again before it reads from the socket
+        RECV_BATCH->sockfd = -1;
+    }
+#endif // USE_UDP_OFFLOAD
+
+    engine->sockfd = sockfd;
+    engine->gro = gro;
+}
+
+/// @brief Set up the engine of this thread
+/// @return NULL if io_uring is not available
+static struct uring_engine_t* uring_engine_create(void) {
+    struct uring_engine_t* engine = (struct uring_engine_t*)calloc(1, sizeof(struct uring_engine_t));
+    if (engine == NULL) {
+        return NULL;
+    }
+    if (uring_init(&engine->ring, URING_ENTRIES)) {
+        free(engine);
+        return NULL;
+    }
+    engine->sockfd = -1;
+    engine->held_bid = -1;
+    engine->recv_msg.msg_namelen = sizeof(sockaddr_storage);
+    engine->recv_msg.msg_controllen = URING_CONTROL_SIZE;
+
+    // multishot receives need a newer kernel than the ring, try one on a socket of our own
+    bool failed = uring_setup_buffers(&engine->ring, URING_GROUP, URING_BUFFERS, URING_BUFFER_SIZE);
+    int probe = failed ? -1 : socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe == -1 || uring_arm(engine, probe)) {
+        failed = true;
+    }
+    else {
+        uring_reap(engine);
+        failed = !engine->armed;
+        uring_disarm(engine);
+    }
+    if (probe != -1) {
+        close(probe);
+    }
+
+    if (failed) {
+        uring_free(&engine->ring);
+        free(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+/// @brief Get the engine of this thread
+/// @return NULL if io_uring is disabled or not available
+static struct uring_engine_t* get_engine(void) {
+    if (!IO_URING) {
+        if (URING != NULL && URING->sockfd != -1) {
+            // leave the socket to the poll path
+            uring_disarm(URING);
+        }
+        return NULL;
+    }
+    if (URING == NULL && !URING_UNAVAILABLE) {
+        URING = uring_engine_create();
+        if (URING == NULL) {
+            URING_UNAVAILABLE = true;
+            fprintf(stderr, "io_uring is not available, using poll\n");
+        }
+    }
+    return URING;
+}
+
+/// @brief Take the next datagram out of the queue
+/// @param engine 
+/// @return Return true if there is none
+static bool uring_next_datagram(struct uring_engine_t* engine) {
+    while (engine->queue_count > 0) {
+        int bid = engine->queue_bid[engine->queue_head];
+        int len = engine->queue_len[engine->queue_head];
+        engine->queue_head = (engine->queue_head + 1) % URING_BUFFERS;
+        engine->queue_count--;
+
+        // the buffer holds the header, the address, the control data and then the payload
+        char* buf = uring_get_buffer(&engine->ring, bid);
+        struct io_uring_recvmsg_out out;
+        memcpy(&out, buf, sizeof(out));
+        char* control = buf + sizeof(out) + engine->recv_msg.msg_namelen;
+        char* payload = control + engine->recv_msg.msg_controllen;
+        if ((out.flags & MSG_TRUNC) || out.payloadlen == 0 || payload + out.payloadlen > buf + len) {
+            uring_recycle_buffer(&engine->ring, bid);
+            continue;
+        }
+
+        engine->held_bid = bid;
+        engine->name = buf + sizeof(out);
+        engine->name_len = MIN(out.namelen, engine->recv_msg.msg_namelen);
+        engine->payload = payload;
+        engine->payload_len = out.payloadlen;
+        engine->offset = 0;
+        engine->segment_size = out.payloadlen;
+#if USE_UDP_OFFLOAD
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = MIN(out.controllen, engine->recv_msg.msg_controllen);
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                engine->segment_size = MAX(segment_size, 1);
             }
+        }
+#endif // USE_UDP_OFFLOAD
+        return false;
+    }
+    return true;
+}
 
-            // increase GO_BACK_N if we are doing well
-            if (success_counter >= GO_BACK_N && GO_BACK_N < MAX_GO_BACK_N && end - start > GBN_THRESHOLD_US) {
-                GO_BACK_N = GO_BACK_N * 2;
-#if DEBUG
-                printf("Increasing GO_BACK_N to %d\n", GO_BACK_N);
-                fflush(stdout);
-#endif
+/// @brief Get a frame from the datagrams the multishot receive filled in, see recv_batched
+/// @return Return true on timeout
+static bool uring_recv(struct uring_engine_t* engine, const char** buf, int* recv_len, int sockfd, int timeout_ms, sockaddr* client_addr, socklen_t* client_addr_len) {
+    uring_setup_socket(engine, sockfd);
+
+    if (engine->offset >= engine->payload_len) {
+        if (engine->held_bid != -1) {
+            uring_recycle_buffer(&engine->ring, engine->held_bid);
+            engine->held_bid = -1;
+        }
+
+        long long start = get_time_ms();
+        uring_reap(engine);
+        while (uring_next_datagram(engine)) {
+            if (engine->recv_error != 0) {
+                errno = -engine->recv_error;
+                handle_error("recvmsg");
+            }
+            if (!engine->armed && uring_arm(engine, sockfd)) {
+                handle_error("io_uring_enter");
+            }
+
+            int remaining_ms = timeout_ms < 0 ? -1 : MAX(0, timeout_ms - (get_time_ms() - start));
+            if (remaining_ms == 0) {
+                return true;
             }
+            uring_wait(engine, remaining_ms);
         }
     }
-#else // USE_GO_BACK_N
-    for (int i = 1; i <= frame_count; i++) {
-        if (send_frame_by_id(msg, len, i, true, sockfd, dest_addr, dest_addr_len)) {
-            return -1;
+
+    *buf = engine->payload + engine->offset;
+    *recv_len = MIN(engine->segment_size, engine->payload_len - engine->offset);
+    engine->offset += *recv_len;
+
+    if (client_addr != NULL) {
+        memcpy(client_addr, engine->name, MIN(engine->name_len, *client_addr_len));
+        *client_addr_len = engine->name_len;
+    }
+    return false;
+}
+
+/// @brief Send datagrams through the ring and wait until the kernel took them. The kernel
+/// waits for room in the socket buffer itself.
+/// @param engine 
+/// @param sockfd 
+/// @param msgs 
+/// @param count 
+/// @return Return true on failure, errno tells why
+static bool uring_send(struct uring_engine_t* engine, int sockfd, struct mmsghdr* msgs, int count) {
+    engine->send_error = 0;
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&engine->ring);
+        if (sqe == NULL) {
+            handle_error("io_uring");
         }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->user_data = URING_SEND;
+        engine->sends++;
+    }
+    while (engine->sends > 0) {
+        uring_wait(engine, -1);
+    }
+
+    if (engine->send_error != 0) {
+        errno = -engine->send_error;
+        return true;
     }
-#endif // USE_GO_BACK_N
+    return false;
+}
+#endif // USE_IO_URING
 
-    // send end frame
-    memset(&frame, 0, sizeof(frame)); // zero memory
-    frame.header.type = END;
-    frame.header.frame_id = frame_count + 1;
+/// @brief Start the file reads or writes of a transfer
+/// @param io 
+/// @param frame_id first frame of the file
+/// @param base where the first frame is in the file
+static void file_io_reset(struct file_io_t* io, long long frame_id, off_t base) {
+    memset(io, 0, sizeof(*io));
+#if USE_IO_URING
+    io->async = get_engine() != NULL;
+#endif
+    io->done_frame = frame_id;
+    io->base = base;
+}
 
-    if (send_frame_ack(&frame, true, sockfd, dest_addr, dest_addr_len)) {
-        fprintf(stderr, "Failed to send start frame\n");
-        return -1;
+/// @brief Move past the reads or writes that completed, in the order they were submitted
+/// @param io 
+static void file_io_update(struct file_io_t* io) {
+    while (io->count > 0 && io->ops[io->head].done) {
+        struct file_op_t* op = &io->ops[io->head];
+        if (op->result != (long long)op->bytes) {
+            // the file got shorter than the size that was announced, or the disk is full
+            fprintf(stderr, "Failed to %s frames before %lld", op->write ? "write" : "read", op->end_frame);
+            if (op->result < 0) {
+                fprintf(stderr, ": %s", strerror(-op->result));
+            }
+            fprintf(stderr, "\n");
+            io->failed = true;
+        }
+        io->done_frame = op->end_frame;
+        io->head = (io->head + 1) % FILE_IO_DEPTH;
+        io->count--;
+    }
+}
+
+/// @brief Wait until the frames before frame_id are read or written
+/// @param io 
+/// @param frame_id LLONG_MAX to wait for every read or write in flight
+/// @return Return true if a read or write failed
+static bool file_io_wait(struct file_io_t* io, long long frame_id) {
+    file_io_update(io);
+    while (io->count > 0 && io->done_frame < frame_id) {
+#if USE_IO_URING
+        uring_wait(URING, -1);
+#endif
+        file_io_update(io);
     }
+    return io->failed;
+}
 
-#if DEBUG
-    printf("Sent %d bytes\n", len);
+/// @brief Read or write a run of frames of the file
+/// @param io 
+/// @param write 
+/// @param fd -1 to drop the data
+/// @param buf must stay valid until the frames are done, see file_io_wait
+/// @param bytes 
+/// @param offset from the first frame, see file_io_reset
+/// @param end_frame frame after the run
+/// @return Return true on failure
+static bool file_io_submit(struct file_io_t* io, bool write, int fd, char* buf, size_t bytes, off_t offset, long long end_frame) {
+    if (io->count == FILE_IO_DEPTH && file_io_wait(io, io->ops[io->head].end_frame)) {
+        return true;
+    }
+    offset += io->base;
+
+    struct file_op_t* op = &io->ops[(io->head + io->count++) % FILE_IO_DEPTH];
+    op->write = write;
+    op->done = false;
+    op->bytes = bytes;
+    op->result = 0;
+    op->end_frame = end_frame;
+
+#if USE_IO_URING
+    if (io->async && fd != -1 && bytes > 0) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&URING->ring);
+        if (sqe == NULL) {
+            handle_error("io_uring");
+        }
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = bytes;
+        sqe->off = offset;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+        if (uring_enter(&URING->ring, 0, 0)) {
+            handle_error("io_uring_enter");
+        }
+        return false;
+    }
 #endif
 
-    return len;
+    while (fd != -1 && op->result < (long long)bytes) {
+        ssize_t n = write
+            ? pwrite(fd, buf + op->result, bytes - op->result, offset + op->result)
+            : pread(fd, buf + op->result, bytes - op->result, offset + op->result);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            op->result = -errno;
+        }
+        if (n <= 0) {
+            break;
+        }
+        op->result += n;
+    }
+    if (fd == -1) {
+        op->result = bytes;
+    }
+    op->done = true;
+    file_io_update(io);
+    return io->failed;
 }
 
-/// @brief Receive data from socket
+/// @brief Check for datagrams that were already read from the socket
 /// @param sockfd 
-/// @param len 
-/// @param client_addr 
-/// @param client_addr_len 
-/// @return pointer to data on success, NULL on failure
-void* recv_data(int sockfd, int* len, sockaddr* client_addr, socklen_t* client_addr_len) {
-    UDP_TIMEOUT_MS = DEFAULT_TIMEOUT_MS;
-    // receive start frame
-    frame_t frame;
+/// @return true if recv_batched can return a frame without a syscall
+static bool recv_pending(int sockfd) {
+#if USE_IO_URING
+    if (IO_URING && URING != NULL && URING->sockfd == sockfd) {
+        return URING->offset < URING->payload_len || URING->queue_count > 0;
+    }
+#endif
+    return RECV_BATCH != NULL && RECV_BATCH->sockfd == sockfd && RECV_BATCH->next < RECV_BATCH->count;
+}
 
-    // give a dummy length to avoid null error
-    int dummy_len = 0;
-    if (len == NULL) {
-        len = &dummy_len;
+/// @brief Check if the frames of mapped files go out with MSG_ZEROCOPY on a socket, and
+/// enable it on the socket the first time
+/// @param sockfd 
+/// @return true to send with MSG_ZEROCOPY
+static bool zerocopy_enabled(int sockfd) {
+#if USE_ZEROCOPY
+    struct zerocopy_t* state = &ZEROCOPY_STATE;
+    if (!ZEROCOPY) {
+        return false;
     }
+    if (state->sockfd != sockfd) {
+        int enabled = 1;
+        state->sockfd = sockfd;
+        state->copied = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enabled, sizeof(enabled)) == -1;
+        state->sends = 0;
+        state->completions = 0;
+    }
+    return !state->copied;
+#else
+    (void)sockfd;
+    return false;
+#endif
+}
 
-    // poll for start frame
-    if (recv_frame_ack(&frame, 0, sockfd, client_addr, client_addr_len)) {
-        *len = 0;
-        return NULL;
+/// @brief Read the completions of MSG_ZEROCOPY sends from the error queue of the socket. Until
+/// they are read the socket stays readable for poll, and the queue counts against its memory.
+/// @param sockfd 
+static void zerocopy_drain(int sockfd) {
+#if USE_ZEROCOPY
+    struct zerocopy_t* state = &ZEROCOPY_STATE;
+    if (state->sockfd != sockfd || state->completions == state->sends) {
+        return;
     }
+    while (true) {
+        union {
+            char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return;
+        }
 
-    if (frame.header.type != START) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // each completion covers a range of sends
+            state->completions += err.ee_data - err.ee_info + 1;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // the pinning costs more than the copy it saves
+                state->copied = true;
 #if DEBUG
-        fprintf(stderr, "Expected START frame\n");
+                printf("The kernel copied the zerocopy sends, sending with copies\n");
 #endif
-        * len = 0;
-        return NULL;
+            }
+        }
     }
+#else
+    (void)sockfd;
+#endif
+}
 
+/// @brief Wait for the socket to be ready
+/// @param sockfd 
+/// @param events POLLIN or POLLOUT
+/// @param timeout_ms 
+/// @return Return true on timeout
+static bool wait_socket(int sockfd, short events, int timeout_ms) {
+    struct pollfd pfd[1];
+
+    pfd[0].fd = sockfd;
+    pfd[0].events = events;
 
-    *len = frame.packet.info.bytes;
+    long long start = get_time_ms();
+    while (get_time_ms() - start < timeout_ms) {
+        int num_events = poll(pfd, 1, timeout_ms - (get_time_ms() - start));
 
-    // allocate memory for data
-    char* data = (char*)malloc(*len);
+        if (num_events == 0) {
+            return true;
+        }
+        if (pfd[0].revents & POLLERR) {
+            zerocopy_drain(sockfd);
+        }
 
-    // receive data frames
-    int frame_count = get_frame_count(frame.packet.info.bytes);
-#if DEBUG
-    printf("Expecting to receive %d frames\n", frame_count);
+        if (pfd[0].revents & events) {
+            break;
+        }
+    }
+
+    return false;
+}
+
+/// @brief Send data with timeout
+/// @param iov 
+/// @param iovcnt 
+/// @param sockfd 
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return true on failure
+static bool send_timeout(struct iovec* iov, int iovcnt, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if (dest_addr != NULL) {
+        msg.msg_name = dest_addr;
+        msg.msg_namelen = *dest_addr_len;
+    }
+
+#if USE_IO_URING
+    struct uring_engine_t* engine = get_engine();
+    if (engine != NULL) {
+        struct mmsghdr mmsg = { .msg_hdr = msg };
+        if (uring_send(engine, sockfd, &mmsg, 1)) {
+            handle_error("sendmsg");
+        }
+        return false;
+    }
 #endif
-    int data_len = *len;
-
-    int deci_position = 0;
-    for (int i = 1; i <= frame_count; i++) {
-        if (recv_frame_ack(&frame, i, sockfd, client_addr, client_addr_len)) {
-            free(data);
-            *len = 0;
-            fprintf(stderr, "Failed to receive frame %d\n", i);
-            return NULL;
+
+    if (wait_socket(sockfd, POLLOUT, DEFAULT_SEND_TIMEOUT_MS)) {
+        return true;
+    }
+
+    if (sendmsg(sockfd, &msg, 0) == -1) {
+        if (errno == EFAULT) {
+            // a mapped file shrank under the frame
+            fprintf(stderr, "The file changed while it was sent\n");
+            return true;
+        }
+        handle_error("sendmsg");
+    }
+
+    return false;
+}
+
+/// @brief Count the words of a selective ack bitmap that need to be sent
+/// @param frame 
+/// @return number of words up to the last one with a bit set
+static int get_sack_words(const frame_t* frame) {
+    int words = SACK_BITS / 32;
+    while (words > 0 && frame->packet.ack.sack[words - 1] == 0) {
+        words--;
+    }
+    return words;
+}
+
+/// @brief Tag a frame and write its wire form, the payload of a DATA or REPAIR frame is sent separately
+/// @param frame 
+/// @param buf room for MAX_FRAME_HEADER bytes
+/// @return number of bytes written to buf
+static int prepare_frame(frame_t* frame, char* buf) {
+    static thread_local int id = 0;
+    frame->header.id = id++;
+
+#if DEBUG > 1
+    printf("SEND ");
+    print_frame(frame);
+#endif
+
+    if (frame->version >= WIRE_V2 && frame->header.type != START) {
+        frame_header_v2_t header;
+        header.frame_id = (uint32_t)frame->header.frame_id;
+        header.version = WIRE_V2_MARKER;
+        header.type = frame->header.type;
+        header.length = 0;
+        if (frame->header.type == DATA && frame->ack_now) {
+            header.type |= WIRE_V2_ACK_NOW;
+        }
+
+        int len = sizeof(header);
+        if (frame->header.type == DATA || frame->header.type == END) {
+            frame->timestamp = get_timestamp();
         }
+        if (frame->timestamp != 0) {
+            header.type |= WIRE_V2_TIMESTAMP;
+            memcpy(buf + len, &frame->timestamp, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+        }
+        if (frame->header.type == ACK && frame->loss >= 0) {
+            header.type |= WIRE_V2_LOSS;
+            uint16_t loss = frame->loss;
+            memcpy(buf + len, &loss, sizeof(loss));
+            len += sizeof(loss);
+        }
+        if (frame->xid != 0) {
+            header.type |= WIRE_V2_XID;
+            memcpy(buf + len, &frame->xid, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+        }
+        if (frame->header.type == ACK && frame->window >= 0) {
+            header.type |= WIRE_V2_WINDOW;
+            uint32_t window = (uint32_t)MIN(frame->window, UINT32_MAX);
+            memcpy(buf + len, &window, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+        }
+        int payload = len;
 
-        if (frame_count > 100) {
-            if (i >= (frame_count * deci_position / 10)) {
-                printf("Received %d%% (%d/%d)\n", deci_position * 10, i, frame_count);
-                fflush(stdout);
-                deci_position++;
+        if (frame->header.type == DATA) {
+            header.length = frame->data_len;
+        }
+        else if (frame->header.type == REPAIR) {
+            // index, repairs and two reserved bytes, then the repair data
+            buf[len] = (char)frame->packet.repair.index;
+            buf[len + 1] = (char)frame->packet.repair.repairs;
+            buf[len + 2] = 0;
+            buf[len + 3] = 0;
+            len += 4;
+            header.length = len - payload + frame->data_len;
+        }
+        else if (frame->header.type == ACK && (frame->packet.ack.flags & XFER_SELECTIVE_REPEAT)) {
+            // an ack without holes after it is just the header
+            int words = get_sack_words(frame);
+            if (words > 0) {
+                uint32_t sack_base = (uint32_t)frame->packet.ack.sack_base;
+                memcpy(buf + len, &sack_base, sizeof(uint32_t));
+                memcpy(buf + len + sizeof(uint32_t), frame->packet.ack.sack, words * sizeof(uint32_t));
+                len += sizeof(uint32_t) + words * sizeof(uint32_t);
             }
+            header.length = len - payload;
         }
+        memcpy(buf, &header, sizeof(header));
+        return len;
+    }
+
+    frame_header_v1_t header;
+    header.frame_id = (int32_t)frame->header.frame_id;
+    header.type = frame->header.type;
+    header.id = frame->xid != 0 ? (int)frame->xid : frame->header.id;
 
-        // copy data into buffer
-        memcpy(data + PACKET_SIZE * (frame.header.frame_id - 1), &frame.packet.data, MIN(data_len, PACKET_SIZE));
-        data_len = data_len - PACKET_SIZE;
+    int len = sizeof(header);
+    switch (frame->header.type) {
+    case DATA:
+        break;
+    case START:
+        memcpy(buf + len, &frame->packet.info, sizeof(frame->packet.info));
+        len += sizeof(frame->packet.info);
+        break;
+    case ACK:
+        if (frame->packet.ack.flags != 0) {
+            // flags, packet_size, version, then the sack fields as in a v2 ack
+            memcpy(buf + len, &frame->packet.ack, 3 * sizeof(int));
+            len += 3 * sizeof(int);
+            uint32_t sack_base = (uint32_t)frame->packet.ack.sack_base;
+            memcpy(buf + len, &sack_base, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+            int words = get_sack_words(frame);
+            memcpy(buf + len, frame->packet.ack.sack, words * sizeof(uint32_t));
+            len += words * sizeof(uint32_t);
+        }
+        break;
+    case END:
+        break;
+    case REPAIR:
+        // only sent with WIRE_V2
+        break;
     }
+    memcpy(buf, &header, sizeof(header));
+    return len;
+}
 
-    // receive end frame
-    if (recv_frame_ack(&frame, frame_count + 1, sockfd, client_addr, client_addr_len)) {
-        free(data);
-        *len = 0;
-        fprintf(stderr, "Failed to receive end frame\n");
-        return NULL;
+/// @brief Read the wire form of a frame in either format
+/// @param frame 
+/// @param buf 
+/// @param len 
+/// @param near frame id the truncated frame ids are expanded around
+/// @return Return true if the datagram is not a valid frame
+static bool decode_frame(frame_t* frame, const char* buf, int len, long long near) {
+    // the optional fields of a frame read as unset when they are not sent
+    memset(&frame->packet, 0, sizeof(frame->packet));
+
+    if (len >= (int)sizeof(frame_header_v2_t) && (uint8_t)buf[4] == WIRE_V2_MARKER) {
+        frame_header_v2_t header;
+        memcpy(&header, buf, sizeof(header));
+        int offset = sizeof(header);
+        frame->timestamp = 0;
+        if (header.type & WIRE_V2_TIMESTAMP) {
+            if (len < offset + (int)sizeof(uint32_t)) {
+                return true;
+            }
+            memcpy(&frame->timestamp, buf + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+        }
+        frame->loss = -1;
+        if (header.type & WIRE_V2_LOSS) {
+            uint16_t loss;
+            if (len < offset + (int)sizeof(loss)) {
+                return true;
+            }
+            memcpy(&loss, buf + offset, sizeof(loss));
+            frame->loss = loss;
+            offset += sizeof(loss);
+        }
+        frame->xid = 0;
+        if (header.type & WIRE_V2_XID) {
+            if (len < offset + (int)sizeof(uint32_t)) {
+                return true;
+            }
+            memcpy(&frame->xid, buf + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+        }
+        frame->window = -1;
+        if (header.type & WIRE_V2_WINDOW) {
+            uint32_t window;
+            if (len < offset + (int)sizeof(window)) {
+                return true;
+            }
+            memcpy(&window, buf + offset, sizeof(window));
+            frame->window = window;
+            offset += sizeof(window);
+        }
+
+        int type = header.type & ~(WIRE_V2_TIMESTAMP | WIRE_V2_LOSS | WIRE_V2_XID | WIRE_V2_ACK_NOW | WIRE_V2_WINDOW);
+        if (type > REPAIR || len - offset < header.length || (type == REPAIR && header.length < 4)) {
+            return true;
+        }
+
+        frame->version = WIRE_V2;
+        frame->ack_now = header.type & WIRE_V2_ACK_NOW;
+        frame->header.frame_id = expand_frame_id(header.frame_id, near);
+        frame->header.type = type;
+        frame->header.id = 0;
+        frame->data = buf + offset;
+        frame->data_len = header.length;
+
+        if (type == ACK && header.length >= (int)sizeof(uint32_t)) {
+            uint32_t sack_base;
+            memcpy(&sack_base, frame->data, sizeof(uint32_t));
+            frame->packet.ack.flags = XFER_SELECTIVE_REPEAT;
+            frame->packet.ack.sack_base = expand_frame_id(sack_base, near);
+            memcpy(frame->packet.ack.sack, frame->data + sizeof(uint32_t),
+                MIN(header.length - sizeof(uint32_t), sizeof(frame->packet.ack.sack)));
+        }
+        else if (type == REPAIR) {
+            frame->packet.repair.index = (uint8_t)frame->data[0];
+            frame->packet.repair.repairs = (uint8_t)frame->data[1];
+            frame->data += 4;
+            frame->data_len -= 4;
+        }
+        return false;
     }
 
+    frame_header_v1_t header;
+    if (len < (int)sizeof(header)) {
+        return true;
+    }
 
-#if DEBUG
-    printf("Received %d bytes\n", *len);
-#endif
+    // legacy peers send bare ACK frames and don't know the newer START fields
+    memcpy(&header, buf, sizeof(header));
+    frame->version = WIRE_V1;
+    frame->timestamp = 0;
+    frame->loss = -1;
+    frame->xid = 0;
+    frame->ack_now = false;
+    frame->window = -1;
+    frame->header.frame_id = expand_frame_id(header.frame_id, near);
+    frame->header.type = header.type;
+    frame->header.id = header.id;
+    int length = len - sizeof(header);
+    frame->data = buf + sizeof(header);
+    frame->data_len = length;
 
-    return data;
+    if (header.type == START) {
+        memcpy(&frame->packet.info, frame->data, MIN(length, (int)sizeof(frame->packet.info)));
+        if ((frame->packet.info.flags & XFER_INLINE) && length >= (int)sizeof(frame->packet.info)) {
+            frame->data += sizeof(frame->packet.info);
+            frame->data_len -= sizeof(frame->packet.info);
+        }
+        frame->xid = frame->packet.info.start_id;
+    }
+    else if (header.type == ACK && length >= 4 * (int)sizeof(int)) {
+        uint32_t sack_base;
+        memcpy(&frame->packet.ack, frame->data, 3 * sizeof(int));
+        memcpy(&sack_base, frame->data + 3 * sizeof(int), sizeof(uint32_t));
+        frame->packet.ack.sack_base = expand_frame_id(sack_base, near);
+        memcpy(frame->packet.ack.sack, frame->data + 4 * sizeof(int),
+            MIN(length - 4 * sizeof(int), sizeof(frame->packet.ack.sack)));
+    }
+    else if (header.type == ACK) {
+        memcpy(&frame->packet.ack, frame->data, MIN(length, 3 * (int)sizeof(int)));
+    }
+    if (header.type == ACK && (frame->packet.ack.flags & XFER_XID)) {
+        frame->xid = (uint32_t)header.id;
+    }
+    return false;
+}
+
+/// @brief Send frame to socket
+/// @param frame 
+/// @param sockfd 
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return true on failure
+static bool send_frame(frame_t* frame, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    char header[MAX_FRAME_HEADER];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = prepare_frame(frame, header);
+
+    int iovcnt = 1;
+    if (frame->header.type == DATA || frame->header.type == REPAIR || (frame->header.type == START && frame->data_len > 0)) {
+        iov[1].iov_base = (void*)frame->data;
+        iov[1].iov_len = frame->data_len;
+        iovcnt = 2;
+    }
+
+    bool ret = send_timeout(iov, iovcnt, sockfd, dest_addr, dest_addr_len);
+    return ret;
+}
+
+void set_batch_io(bool enabled) {
+    BATCH_IO = enabled && USE_BATCH_IO;
+}
+
+void set_io_uring(bool enabled) {
+    IO_URING = enabled && USE_IO_URING;
+}
+
+void set_packet_size(int packet_size) {
+    LOCAL_PACKET_SIZE = MAX(1, MIN(packet_size, MAX_PACKET_SIZE));
+}
+
+void set_congestion_control(cc_algorithm algorithm) {
+    CC_ALGORITHM = algorithm;
+}
+
+void set_ack_frequency(int frames) {
+    ACK_EVERY = MAX(1, MIN(frames, MAX_ACK_FREQUENCY));
+}
+
+void set_zerocopy(bool enabled) {
+    ZEROCOPY = enabled && USE_ZEROCOPY;
+}
+
+void set_sync_policy(sync_policy policy) {
+    SYNC_POLICY = policy;
+}
+
+sync_policy get_sync_policy() {
+    return SYNC_POLICY;
+}
+
+bool sync_policy_parse(const char* arg, sync_policy* policy) {
+    if (strcmp(arg, "none") == 0) {
+        *policy = SYNC_NONE;
+    }
+    else if (strcmp(arg, "batched") == 0) {
+        *policy = SYNC_BATCHED;
+    }
+    else if (strcmp(arg, "strict") == 0) {
+        *policy = SYNC_STRICT;
+    }
+    else {
+        return true;
+    }
+    return false;
+}
+
+void set_fec(double ratio) {
+    FEC_RATIO = ratio < 0 ? FEC_ADAPTIVE : ratio;
+}
+
+bool fec_parse(const char* arg, double* ratio) {
+    if (strcmp(arg, "auto") == 0) {
+        *ratio = FEC_ADAPTIVE;
+        return false;
+    }
+    char* end;
+    *ratio = strtod(arg, &end);
+    return end == arg || *end != '\0' || !(*ratio >= 0 && *ratio <= 1);
+}
+
+/// @brief Send the queued frames. Runs of frames with the same size go out as one
+/// segmented send when the kernel supports UDP_SEGMENT.
+/// @param sockfd 
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return true on failure
+static bool flush_frames(int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    struct send_batch_t* batch = &SEND_BATCH;
+    if (batch->count == 0) {
+        return false;
+    }
+
+    struct mmsghdr msgs[BATCH_SIZE];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control[BATCH_SIZE];
+
+    // the pages of a mapped file can go out without a copy, other payloads may change
+    // once the batch is sent. A zerocopy send takes every iovec as a fragment and the
+    // kernel caps those per datagram, so segmented sends are copied.
+    int flags = batch->mapped == batch->count && zerocopy_enabled(sockfd) ? MSG_ZEROCOPY : 0;
+#if USE_IO_URING
+    struct uring_engine_t* engine = get_engine();
+    if (engine != NULL) {
+        flags = 0;
+    }
+#endif
+    bool gso = BATCH_IO && UDP_GSO && flags == 0;
+    int msg_count = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < batch->count;) {
+        int segment_size = batch->iovs[i][0].iov_len + batch->iovs[i][1].iov_len;
+        int segments = 1;
+        int bytes = segment_size;
+
+        // only the last frame of a segmented send may be shorter than the others
+        while (gso && i + segments < batch->count && segments < GSO_MAX_SEGMENTS) {
+            int len = batch->iovs[i + segments][0].iov_len + batch->iovs[i + segments][1].iov_len;
+            if (len > segment_size || bytes + len > GSO_MAX_BYTES) {
+                break;
+            }
+            bytes += len;
+            segments++;
+            if (len < segment_size) {
+                break;
+            }
+        }
+
+        struct msghdr* msg = &msgs[msg_count].msg_hdr;
+        msg->msg_iov = batch->iovs[i];
+        msg->msg_iovlen = 2 * segments;
+        if (dest_addr != NULL) {
+            msg->msg_name = dest_addr;
+            msg->msg_namelen = *dest_addr_len;
+        }
+#if USE_UDP_OFFLOAD
+        if (segments > 1) {
+            msg->msg_control = control[msg_count].buf;
+            msg->msg_controllen = sizeof(control[msg_count].buf);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = segment_size;
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+#endif // USE_UDP_OFFLOAD
+
+        msg_count++;
+        i += segments;
+    }
+
+#if USE_IO_URING
+    if (engine != NULL) {
+        if (uring_send(engine, sockfd, msgs, msg_count)) {
+            if (gso && (errno == EIO || errno == EINVAL)) {
+                // the device or path can't segment, send the frames one by one
+                UDP_GSO = false;
+                return flush_frames(sockfd, dest_addr, dest_addr_len);
+            }
+            if (errno == EFAULT) {
+                // a mapped file shrank under the frames
+                fprintf(stderr, "The file changed while it was sent\n");
+                batch->count = 0;
+                batch->mapped = 0;
+                return true;
+            }
+            handle_error("sendmsg");
+        }
+        batch->count = 0;
+        batch->mapped = 0;
+        return false;
+    }
+#endif
+
+    if (wait_socket(sockfd, POLLOUT, DEFAULT_SEND_TIMEOUT_MS)) {
+        batch->count = 0;
+        batch->mapped = 0;
+        return true;
+    }
+
+    zerocopy_drain(sockfd);
+
+    int sent = 0;
+    while (sent < msg_count) {
+        int n = sendmmsg(sockfd, msgs + sent, BATCH_IO ? msg_count - sent : 1, flags);
+        if (n == -1) {
+            if (gso && (errno == EIO || errno == EINVAL)) {
+                // the device or path can't segment, send the frames one by one
+                UDP_GSO = false;
+                return flush_frames(sockfd, dest_addr, dest_addr_len);
+            }
+            if (flags != 0 && errno == ENOBUFS) {
+                // too many pages are pinned, the rest of the batch is copied
+                flags = 0;
+                continue;
+            }
+            if (flags != 0 && errno == EMSGSIZE) {
+                // the frames span more pages than a datagram takes, copy them from now on
+                ZEROCOPY_STATE.copied = true;
+                flags = 0;
+                continue;
+            }
+            if (errno == EFAULT) {
+                // a mapped file shrank under the frames
+                fprintf(stderr, "The file changed while it was sent\n");
+                batch->count = 0;
+                batch->mapped = 0;
+                return true;
+            }
+            handle_error("sendmmsg");
+        }
+        if (flags != 0) {
+            ZEROCOPY_STATE.sends += n;
+        }
+        sent += n;
+    }
+
+    batch->count = 0;
+    batch->mapped = 0;
+    return false;
+}
+
+/// @brief Point the receive batch at a socket. UDP_GRO is only enabled while batching,
+/// so the kernel coalesces datagrams for us.
+/// @param batch 
+/// @param sockfd 
+static void recv_batch_setup(struct recv_batch_t* batch, int sockfd) {
+    bool gro = BATCH_IO && USE_UDP_OFFLOAD;
+    if (batch->sockfd == sockfd && batch->gro == gro) {
+        return;
+    }
+
+#if USE_UDP_OFFLOAD
+    int enabled = gro;
+    if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &enabled, sizeof(enabled)) == -1) {
+        gro = false;
+    }
+#endif // USE_UDP_OFFLOAD
+
+    batch->sockfd = sockfd;
+    batch->gro = gro;
+    batch->count = 0;
+    batch->next = 0;
+    batch->offset = 0;
+}
+
+/// @brief Get a frame from the socket, reading a burst of datagrams with one recvmmsg
+/// @param buf the frame, valid until the next frame is received
+/// @param recv_len number of bytes in the frame
+/// @param sockfd 
+/// @param timeout_ms how long to wait for a datagram, 0 to only take the ones already there
+/// @param client_addr 
+/// @param client_addr_len 
+/// @return Return true on failure
+static bool recv_batched(const char** buf, int* recv_len, int sockfd, int timeout_ms, sockaddr* client_addr, socklen_t* client_addr_len) {
+#if USE_IO_URING
+    struct uring_engine_t* engine = get_engine();
+    if (engine != NULL) {
+        return uring_recv(engine, buf, recv_len, sockfd, timeout_ms, client_addr, client_addr_len);
+    }
+#endif
+
+    // completions of our sends make the socket look readable until they are read
+    zerocopy_drain(sockfd);
+
+    if (RECV_BATCH == NULL) {
+        RECV_BATCH = (struct recv_batch_t*)malloc(sizeof(struct recv_batch_t));
+        if (RECV_BATCH == NULL) {
+            handle_error("malloc");
+        }
+        RECV_BATCH->sockfd = -1;
+    }
+    struct recv_batch_t* batch = RECV_BATCH;
+    recv_batch_setup(batch, sockfd);
+
+    if (batch->next >= batch->count) {
+        if (wait_socket(sockfd, POLLIN, timeout_ms)) {
+            return true;
+        }
+
+        int vlen = BATCH_IO ? BATCH_SIZE : 1;
+        for (int i = 0; i < vlen; i++) {
+            batch->iovs[i].iov_base = batch->buffers[i];
+            batch->iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+            memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+            batch->msgs[i].msg_hdr.msg_iovlen = 1;
+            batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+            batch->msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            if (batch->gro) {
+                batch->msgs[i].msg_hdr.msg_control = batch->control[i].buf;
+                batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->control[i].buf);
+            }
+        }
+
+        int n = recvmmsg(sockfd, batch->msgs, vlen, MSG_DONTWAIT, NULL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            handle_error("recvmmsg");
+        }
+
+        for (int i = 0; i < n; i++) {
+            batch->segment_size[i] = batch->msgs[i].msg_len;
+#if USE_UDP_OFFLOAD
+            struct msghdr* msg = &batch->msgs[i].msg_hdr;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int segment_size;
+                    memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                    batch->segment_size[i] = MAX(segment_size, 1);
+                }
+            }
+#endif // USE_UDP_OFFLOAD
+        }
+
+        batch->count = n;
+        batch->next = 0;
+        batch->offset = 0;
+    }
+
+    int i = batch->next;
+    int datagram_len = batch->msgs[i].msg_len;
+    *buf = batch->buffers[i] + batch->offset;
+    *recv_len = MIN(batch->segment_size[i], datagram_len - batch->offset);
+    batch->offset += *recv_len;
+    if (batch->offset >= datagram_len) {
+        batch->next++;
+        batch->offset = 0;
+    }
+
+    if (client_addr != NULL) {
+        socklen_t addr_len = batch->msgs[i].msg_hdr.msg_namelen;
+        memcpy(client_addr, &batch->addrs[i], MIN(addr_len, *client_addr_len));
+        *client_addr_len = addr_len;
+    }
+    return false;
+}
+
+/// @brief Get the address the frames to a peer are sent to
+/// @param peer
+/// @return NULL when the socket is connected to the peer
+static sockaddr* get_peer_addr(peer_t* peer) {
+    return peer->addr_len == 0 ? NULL : (sockaddr*)&peer->addr;
+}
+
+/// @brief Acknowledge an END frame of a previous transfer. Its sender missed our ack
+/// and keeps resending it.
+/// @param peer
+/// @param frame
+static void send_stale_ack(peer_t* peer, const frame_t* frame) {
+    frame_t ack;
+    ack.header.type = ACK;
+    ack.header.frame_id = frame->header.frame_id;
+    ack.packet.ack.flags = 0;
+    ack.version = frame->version;
+    ack.timestamp = frame->timestamp;
+    ack.loss = -1;
+    ack.xid = frame->xid;
+    ack.window = -1;
+    if (send_frame(&ack, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fprintf(stderr, "Failed to send ack\n");
+    }
+}
+
+/// @brief Print the progress of large transfers in steps of 10%
+/// @param action
+/// @param deci_position tenths already printed
+/// @param frames frames done
+/// @param frame_count
+static void print_progress(const char* action, int* deci_position, long long frames, long long frame_count) {
+    if (frame_count > 100 && frames >= (frame_count * *deci_position / 10)) {
+        printf("%s %d%% (%lld/%lld)\n", action, *deci_position * 10, frames, frame_count);
+        fflush(stdout);
+        (*deci_position)++;
+    }
+}
+
+/// @brief Get the bytes a datagram takes from a kernel socket buffer: its size rounded up to
+/// a power of two, plus the bookkeeping
+/// @param bytes
+/// @return bytes
+static long long get_datagram_charge(int bytes) {
+    long long charge = 1;
+    while (charge < bytes) {
+        charge <<= 1;
+    }
+    return charge + SKB_OVERHEAD;
+}
+
+/// @brief Grow a kernel buffer of the socket to hold bytes, it never shrinks. Above
+/// net.core.rmem_max or wmem_max the kernel caps it, unless the process may force it.
+/// @param sockfd
+/// @param option SO_RCVBUF or SO_SNDBUF
+/// @param bytes
+static void grow_socket_buffer(int sockfd, int option, long long bytes) {
+    struct socket_buffers_t* buffers = &SOCKET_BUFFERS;
+    if (buffers->sockfd != sockfd) {
+        buffers->sockfd = sockfd;
+        buffers->rcvbuf = 0;
+        buffers->sndbuf = 0;
+    }
+    long long* size = option == SO_RCVBUF ? &buffers->rcvbuf : &buffers->sndbuf;
+    if (bytes <= *size || *size >= MAX_SOCKET_BUFFER) {
+        return;
+    }
+
+    // grow in powers of two so a growing window only takes a few syscalls
+    long long target = 64 * 1024;
+    while (target < bytes && target < MAX_SOCKET_BUFFER) {
+        target <<= 1;
+    }
+    *size = target;
+
+    // the kernel doubles the value for its bookkeeping, which the charges already count
+    int value = (int)(target / 2);
+    int current;
+    socklen_t len = sizeof(current);
+    if (getsockopt(sockfd, SOL_SOCKET, option, &current, &len) == 0 && current >= target) {
+        return;
+    }
+    setsockopt(sockfd, SOL_SOCKET, option, &value, sizeof(value));
+#ifdef SO_RCVBUFFORCE
+    if (getsockopt(sockfd, SOL_SOCKET, option, &current, &len) == 0 && current < target) {
+        setsockopt(sockfd, SOL_SOCKET, option == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE, &value, sizeof(value));
+    }
+#endif
+#if DEBUG
+    getsockopt(sockfd, SOL_SOCKET, option, &current, &len);
+    printf("%s of socket %d is %d bytes\n", option == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF", sockfd, current);
+#endif
+}
+
+/// @brief Get the first frame the receive window of a file transfer holds
+/// @param rs
+/// @param written_frame lowest frame id not written to the file
+/// @return frame id
+static long long get_window_base(const recv_state_t* rs, long long written_frame) {
+    // with FEC the frames of a block that is not complete are kept for its repair frames
+    if (rs->fec_blocks != NULL) {
+        return MIN(written_frame, (rs->next_frame - 1) / FEC_BLOCK_FRAMES * FEC_BLOCK_FRAMES + 1);
+    }
+    return written_frame;
+}
+
+/// @brief Check if a frame was received, the frames before next_frame all were
+/// @param rs 
+/// @param frame_id 
+/// @return true if received
+static bool is_received(const recv_state_t* rs, long long frame_id) {
+    if (frame_id < rs->next_frame) {
+        return true;
+    }
+    return frame_id < rs->next_frame + rs->max_window_frames && bitmap_get(rs->received, frame_id % rs->max_window_frames);
+}
+
+/// @brief Get the frames after the ones received in order that the receiver has room for.
+/// Those received in order can always be written out, so only the window limits file transfers.
+/// @param rs
+/// @return frames
+static long long get_recv_window(const recv_state_t* rs) {
+    if (rs->data != NULL) {
+        return MIN(rs->frame_count + 1 - rs->next_frame, rs->max_window_frames);
+    }
+    return get_window_base(rs, rs->next_frame) + rs->max_window_frames - rs->next_frame;
+}
+
+/// @brief Acknowledge a frame. With selective repeat the ack is cumulative and
+/// carries a bitmap of the received frames around the frame.
+/// @param rs 
+/// @param frame the frame that was received, its timestamp is echoed
+/// @param sockfd 
+/// @param client_addr 
+/// @param client_addr_len 
+/// @return return true on failure
+static bool send_ack(recv_state_t* rs, const frame_t* frame, int sockfd, sockaddr* client_addr, socklen_t* client_addr_len) {
+    long long frame_id = frame->header.frame_id;
+
+    frame_t ack;
+    ack.header.type = ACK;
+    ack.header.frame_id = frame_id;
+    ack.packet.ack.flags = 0;
+    ack.timestamp = frame->timestamp;
+    // the ack of START carries the options, the sender only learns the wire format from it
+    ack.version = frame_id == 0 ? WIRE_V1 : rs->version;
+    ack.loss = rs->flags & XFER_FEC ? (int)(rs->fec_loss * 65535) : -1;
+    ack.xid = rs->xid;
+    ack.window = rs->flags & XFER_WINDOW ? get_recv_window(rs) : -1;
+
+    if (rs->flags != 0) {
+        ack.packet.ack.flags = rs->flags;
+        ack.packet.ack.packet_size = rs->packet_size;
+        ack.packet.ack.version = rs->version;
+        ack.packet.ack.sack_base = 0;
+        memset(ack.packet.ack.sack, 0, sizeof(ack.packet.ack.sack));
+    }
+
+    if (rs->flags & XFER_SELECTIVE_REPEAT) {
+        ack.header.frame_id = rs->next_frame - 1;
+
+        // describe the frames after the hole, or the newest frames if frame_id is far ahead
+        long long sack_base = MAX(rs->next_frame, frame_id - SACK_BITS + 1);
+        ack.packet.ack.sack_base = sack_base;
+        if (rs->received != NULL) {
+            for (int i = 0; i < SACK_BITS && sack_base + i <= rs->frame_count; i++) {
+                if (is_received(rs, sack_base + i)) {
+                    bitmap_set(ack.packet.ack.sack, i);
+                }
+            }
+        }
+    }
+
+    return send_frame(&ack, sockfd, client_addr, client_addr_len);
+}
+
+/// @brief Grow a window of frames so a frame has a slot, doubling it up to max_frames. The
+/// slot of a frame depends on the size of the window, so the frames are moved to their new
+/// slots, and no file I/O may use the window meanwhile.
+/// @param window 
+/// @param window_frames 
+/// @param max_frames 
+/// @param packet_size 
+/// @param first_frame lowest frame id kept in the window
+/// @param frame_id 
+/// @return Return true on failure
+static bool grow_window(char** window, int* window_frames, int max_frames, int packet_size, long long first_frame, long long frame_id) {
+    int frames = *window_frames;
+    while (frame_id >= first_frame + frames && frames < max_frames) {
+        frames = MIN(2 * frames, max_frames);
+    }
+    if (frames == *window_frames) {
+        return false;
+    }
+    char* grown = (char*)malloc((long)frames * packet_size);
+    if (grown == NULL) {
+        perror("malloc");
+        return true;
+    }
+    for (long long id = first_frame; id < first_frame + *window_frames; id++) {
+        memcpy(grown + (long)packet_size * ((id - 1) % frames), *window + (long)packet_size * ((id - 1) % *window_frames), packet_size);
+    }
+#if DEBUG
+    printf("Window grown to %d frames\n", frames);
+#endif
+    free(*window);
+    *window = grown;
+    *window_frames = frames;
+    return false;
+}
+
+/// @brief Read the next part of the window from the file. With io_uring the read is only
+/// started, otherwise the kernel is asked to read the part after it while the frames are sent.
+/// @param ss 
+/// @return Return true on failure
+static bool read_ahead(send_state_t* ss) {
+    int slot = (ss->read_frame - 1) % ss->window_frames;
+    int frames = MAX(1, ss->window_frames / READ_AHEAD_PARTS);
+    frames = MIN(frames, ss->window_frames - slot);
+    frames = MIN(frames, ss->base_frame + ss->window_frames - ss->read_frame);
+    frames = MIN(frames, ss->frame_count + 1 - ss->read_frame);
+
+    off_t offset = (off_t)ss->packet_size * (ss->read_frame - 1);
+    size_t bytes = MIN((off_t)frames * ss->packet_size, ss->len - offset);
+    char* buf = ss->window + (long)ss->packet_size * slot;
+    if (file_io_submit(&ss->io, false, ss->fd, buf, bytes, offset, ss->read_frame + frames)) {
+        return true;
+    }
+    ss->read_frame += frames;
+
+    if (!ss->io.async) {
+        // the next part is read from disk while this one is sent
+        off_t ahead = (off_t)ss->packet_size * ss->window_frames / READ_AHEAD_PARTS;
+        posix_fadvise(ss->fd, ss->file_offset + offset + bytes, ahead, POSIX_FADV_WILLNEED);
+    }
+    return false;
+}
+
+/// @brief Get the payload of a frame
+/// @param ss 
+/// @param frame_id a frame below base_frame + window_frames when reading from fd
+/// @param data_len size of the payload
+/// @return pointer to the payload, NULL on failure
+static const char* get_frame_data(send_state_t* ss, long long frame_id, int* data_len) {
+    long long data_offset = ss->packet_size * (frame_id - 1);
+    *data_len = MIN(ss->len - data_offset, ss->packet_size);
+    if (ss->msg != NULL) {
+        return ss->msg + data_offset;
+    }
+    if (frame_id >= ss->base_frame + ss->window_frames) {
+        fprintf(stderr, "Frame %lld is past the send window\n", frame_id);
+        return NULL;
+    }
+
+    while (frame_id >= ss->read_frame) {
+        if (read_ahead(ss)) {
+            return NULL;
+        }
+    }
+
+    // with io_uring the next part is read while this one is sent
+    int part = MAX(1, ss->window_frames / READ_AHEAD_PARTS);
+    if (ss->io.async && ss->read_frame <= ss->frame_count && ss->read_frame + part <= ss->base_frame + ss->window_frames
+        && read_ahead(ss)) {
+        return NULL;
+    }
+    if (file_io_wait(&ss->io, frame_id + 1)) {
+        return NULL;
+    }
+    return ss->window + (long)ss->packet_size * ((frame_id - 1) % ss->window_frames);
+}
+
+/// @brief Grow the window of a file transfer for the frames the next poll may send. The
+/// queued frames point into the window, so it only grows before any are queued.
+/// @param ss 
+/// @return Return true on failure
+static bool reserve_send_window(send_state_t* ss) {
+    if (ss->msg != NULL) {
+        return false;
+    }
+    long long last_frame_id = MIN(ss->next_frame + cc_get_window(&ss->cc), ss->base_frame + ss->max_window_frames) - 1;
+    if (last_frame_id < ss->base_frame + ss->window_frames) {
+        return false;
+    }
+    // the kernel may still read into the window
+    return file_io_wait(&ss->io, LLONG_MAX)
+        || grow_window(&ss->window, &ss->window_frames, ss->max_window_frames, ss->packet_size, ss->base_frame, last_frame_id);
+}
+
+/// @brief Queue a frame. The queue is sent with flush_frames, or right away when
+/// batched io is disabled.
+/// @param frame a DATA or REPAIR frame, its payload must stay put until the queue is sent
+/// @param sockfd 
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return true on failure
+static bool queue_frame(frame_t* frame, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    if (!BATCH_IO) {
+        for (int i = 0; i < RETRY_COUNT; i++) {
+            if (!send_frame(frame, sockfd, dest_addr, dest_addr_len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct send_batch_t* batch = &SEND_BATCH;
+    if (batch->count == BATCH_SIZE && flush_frames(sockfd, dest_addr, dest_addr_len)) {
+        return true;
+    }
+
+    int i = batch->count++;
+    batch->mapped += frame->mapped;
+    batch->iovs[i][0].iov_base = batch->headers[i];
+    batch->iovs[i][0].iov_len = prepare_frame(frame, batch->headers[i]);
+    batch->iovs[i][1].iov_base = (void*)frame->data;
+    batch->iovs[i][1].iov_len = frame->data_len;
+    return false;
+}
+
+/// @brief Give the next send order to a frame that was queued
+/// @param ss 
+/// @param frame_id 0 for a repair frame
+/// @return Return true on failure
+static bool take_send_seq(send_state_t* ss, long long frame_id) {
+    if (frame_id != 0) {
+        ss->sent_seq[frame_id % ss->max_window_frames] = ss->send_seq;
+    }
+    ss->send_seq++;
+    return id_queue_push(&ss->sent, frame_id);
+}
+
+/// @brief Create a data frame based on the frame id and queue it
+/// @param ss 
+/// @param frame_id 
+/// @param ack_now ask the receiver to ack the frame without holding the ack back
+/// @param sockfd 
+/// @param dest_addr 
+/// @param dest_addr_len 
+/// @return Return true on failure
+static bool queue_frame_by_id(send_state_t* ss, long long frame_id, bool ack_now, int sockfd, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    frame_t frame;
+    frame.header.frame_id = frame_id;
+    frame.header.type = DATA;
+    frame.version = ss->version;
+    frame.xid = ss->xid;
+    frame.ack_now = ack_now && ss->ack_freq;
+    frame.mapped = ss->mapped;
+    frame.data = get_frame_data(ss, frame_id, &frame.data_len);
+    if (frame.data == NULL) {
+        return true;
+    }
+    return queue_frame(&frame, sockfd, dest_addr, dest_addr_len);
+}
+
+/// @brief Start writing back the batches of the file whose writes are done, see set_sync_policy
+/// @param rs 
+static void writeback_received(recv_state_t* rs) {
+#if USE_SYNC_FILE_RANGE
+    if (SYNC_POLICY == SYNC_NONE || rs->fd == -1) {
+        return;
+    }
+    long long written = MIN((off_t)rs->packet_size * (rs->io.done_frame - 1), rs->len);
+    while (written - rs->synced_bytes >= SYNC_BATCH_BYTES) {
+        off_t offset = rs->synced_bytes;
+        rs->synced_bytes += SYNC_BATCH_BYTES;
+        // only a hint, the caller syncs the file once it is complete and sees the errors then
+        if (sync_file_range(rs->fd, rs->file_offset + offset, SYNC_BATCH_BYTES, SYNC_FILE_RANGE_WRITE) == -1) {
+            // not a file, like a pipe, stop trying for this transfer
+            rs->synced_bytes = LLONG_MAX / 2;
+            return;
+        }
+        if (SYNC_POLICY == SYNC_STRICT && offset >= SYNC_BATCH_BYTES) {
+            sync_file_range(rs->fd, rs->file_offset + offset - SYNC_BATCH_BYTES, SYNC_BATCH_BYTES,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+    }
+#else
+    (void)rs;
+#endif
+}
+
+/// @brief Write the frames received in order since the last call to the file. With
+/// io_uring the writes are only started, see file_io_wait.
+/// @param rs 
+/// @return return true on failure
+static bool flush_received(recv_state_t* rs) {
+    if (rs->data != NULL) {
+        return false;
+    }
+
+    long long end_frame = MIN(rs->next_frame, rs->frame_count + 1);
+    while (rs->written_frame < end_frame) {
+        // the run may wrap around the end of the window
+        int slot = (rs->written_frame - 1) % rs->window_frames;
+        int frames = MIN(end_frame - rs->written_frame, rs->window_frames - slot);
+        off_t offset = (off_t)rs->packet_size * (rs->written_frame - 1);
+        size_t bytes = MIN((off_t)frames * rs->packet_size, rs->len - offset);
+        char* buf = rs->window + (long)rs->packet_size * slot;
+        if (file_io_submit(&rs->io, true, rs->fd, buf, bytes, offset, rs->written_frame + frames)) {
+            return true;
+        }
+        rs->written_frame += frames;
+    }
+    writeback_received(rs);
+    return false;
+}
+
+/// @brief Get where the payload of a frame goes
+/// @param rs 
+/// @param frame_id 
+/// @return pointer into the transfer or the receive window, NULL if the frame is past the window
+static char* get_frame_buffer(recv_state_t* rs, long long frame_id) {
+    if (rs->data != NULL) {
+        return rs->data + (long)rs->packet_size * (frame_id - 1);
+    }
+    // the frames received in order are written out lazily, write them now to make room
+    if (frame_id >= get_window_base(rs, rs->written_frame) + rs->window_frames && flush_received(rs)) {
+        return NULL;
+    }
+    long long window_base = get_window_base(rs, rs->written_frame);
+    if (frame_id >= window_base + rs->max_window_frames) {
+        return NULL;
+    }
+    if (frame_id >= window_base + rs->window_frames) {
+        // the kernel may still write from the window
+        if (file_io_wait(&rs->io, LLONG_MAX)
+            || grow_window(&rs->window, &rs->window_frames, rs->max_window_frames, rs->packet_size, window_base, frame_id)) {
+            return NULL;
+        }
+    }
+
+    // the slot is free once the frame that had it is written
+    if (file_io_wait(&rs->io, frame_id - rs->window_frames + 1)) {
+        return NULL;
+    }
+    return rs->window + (long)rs->packet_size * ((frame_id - 1) % rs->window_frames);
+}
+
+/// @brief Flush the received frames once the burst that was read is handled, or
+/// when half of the window waits to be written
+/// @param rs 
+/// @param sockfd 
+/// @return return true on failure
+static bool flush_received_lazy(recv_state_t* rs, int sockfd) {
+    if (recv_pending(sockfd) && rs->next_frame - rs->written_frame < rs->window_frames / 2) {
+        return false;
+    }
+    return flush_received(rs);
+}
+
+/// @brief Free the repair frames kept for a block
+/// @param entry
+static void fec_free_repairs(struct fec_block_t* entry) {
+    for (int i = 0; i < entry->repairs; i++) {
+        free(entry->data[i]);
+    }
+    entry->repairs = 0;
+}
+
+/// @brief Free what the sender keeps while the data frames are sent
+/// @param ss
+static void free_send_state(send_state_t* ss) {
+    // the kernel may still read into the window
+    file_io_wait(&ss->io, LLONG_MAX);
+    if (ss->mapped) {
+        // pages the kernel still sends from stay pinned, and the kernel never writes to them
+        munmap((void*)(ss->msg - ss->map_delta), ss->len + ss->map_delta);
+        ss->msg = NULL;
+        ss->mapped = false;
+    }
+    free(ss->window);
+    free(ss->acked);
+    free(ss->lost);
+    free(ss->fec_buf);
+    free(ss->sent_seq);
+    id_queue_free(&ss->sent);
+    id_queue_free(&ss->lost_ids);
+    ss->window = NULL;
+    ss->acked = NULL;
+    ss->lost = NULL;
+    ss->fec_buf = NULL;
+    ss->sent_seq = NULL;
+}
+
+/// @brief Free what the receiver keeps while the data frames arrive. The received
+/// data is kept until it is taken.
+/// @param rs
+static void free_recv_state(recv_state_t* rs) {
+    // the kernel may still write from the window
+    file_io_wait(&rs->io, LLONG_MAX);
+    free(rs->window);
+    free(rs->received);
+    if (rs->fec_blocks != NULL) {
+        for (int i = 0; i < FEC_BLOCKS; i++) {
+            fec_free_repairs(&rs->fec_blocks[i]);
+        }
+    }
+    free(rs->fec_blocks);
+    rs->window = NULL;
+    rs->received = NULL;
+    rs->fec_blocks = NULL;
+}
+
+/// @brief Free everything the transfer of a peer holds
+/// @param peer
+static void reset_transfer(peer_t* peer) {
+    free_send_state(&peer->ss);
+    free_recv_state(&peer->rs);
+    free(peer->rs.data);
+    peer->rs.data = NULL;
+    peer->phase = PHASE_IDLE;
+}
+
+/// @brief Give up on the transfer
+/// @param peer
+static void fail_transfer(peer_t* peer) {
+    reset_transfer(peer);
+    peer->phase = PHASE_FAILED;
+
+    // what the transfer learned may be why it failed
+    if (peer->sending) {
+        peer->cc_packet_size = 0;
+    }
+}
+
+/// @brief Send the START or END frame of the sender and restart its retransmission timer
+/// @param peer
+static void send_control(peer_t* peer) {
+    peer->tries++;
+    peer->timer_us = get_time_us();
+    if (send_frame(&peer->control, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+#if DEBUG > 1
+        printf("Failed to send frame\n");
+#endif
+    }
+}
+
+/// @brief Measure the round trip of the control frame from its ack
+/// @param peer
+/// @param ack
+static void control_rtt_sample(peer_t* peer, const frame_t* ack) {
+    // without an echoed timestamp the ack of a resent frame is ambiguous (Karn's rule)
+    if (ack->timestamp == 0 && peer->tries == 1) {
+        rtt_sample(&peer->rtt, get_time_us() - peer->timer_us);
+    }
+}
+
+/// @brief Send the END frame once every data frame is acknowledged
+/// @param peer
+static void send_end(peer_t* peer) {
+    free_send_state(&peer->ss);
+    if (peer->ss.frame_count > 0) {
+        peer->cc = peer->ss.cc;
+        peer->cc_packet_size = peer->ss.packet_size;
+        peer->cc_end_us = get_time_us();
+    }
+
+    frame_t* frame = &peer->control;
+    memset(frame, 0, sizeof(*frame)); // zero memory
+    frame->header.type = END;
+    frame->header.frame_id = peer->ss.frame_count + 1;
+    frame->version = peer->ss.version;
+    frame->xid = peer->ss.xid;
+
+    peer->phase = PHASE_END;
+    peer->tries = 0;
+    send_control(peer);
+}
+
+/// @brief Map the file of a transfer into msg, so the frames point into the page cache instead
+/// of being read into the window. The kernel reads the pages as it sends the frames, and
+/// fails the send if the file shrank. The repair frames of FEC read them in user space, where
+/// that would be a SIGBUS, so FEC transfers read the file.
+/// @param ss 
+/// @return Return true if the file is not mapped
+static bool map_file(send_state_t* ss) {
+    if (!USE_MMAP || ss->fec || ss->len == 0) {
+        return true;
+    }
+    long delta = ss->file_offset % sysconf(_SC_PAGESIZE);
+    void* map = mmap(NULL, ss->len + delta, PROT_READ, MAP_SHARED, ss->fd, ss->file_offset - delta);
+    if (map == MAP_FAILED) {
+        return true;
+    }
+    posix_madvise(map, ss->len + delta, POSIX_MADV_SEQUENTIAL);
+    ss->msg = (const char*)map + delta;
+    ss->map_delta = delta;
+    ss->mapped = true;
+    return false;
+}
+
+/// @brief Agree on the options of the transfer from the ack of START, then start the data frames
+/// @param peer
+/// @param ack
+static void start_data(peer_t* peer, const frame_t* ack) {
+    send_state_t* ss = &peer->ss;
+
+    // receivers that don't know the START options send a bare ack
+    ss->packet_size = PACKET_SIZE;
+    ss->version = WIRE_V1;
+    int packet_size = ack->packet.ack.packet_size;
+    if ((ack->packet.ack.flags & XFER_PACKET_SIZE) && packet_size >= 1 && packet_size <= MAX_PACKET_SIZE) {
+        ss->packet_size = packet_size;
+    }
+    if (ack->packet.ack.version >= WIRE_V2) {
+        ss->version = WIRE_V2;
+    }
+    if (ss->version >= WIRE_V2 && (ack->packet.ack.flags & XFER_XID)) {
+        ss->xid = peer->control.packet.info.start_id;
+    }
+    if (ss->len > INT_MAX && !(ack->packet.ack.flags & XFER_LARGE)) {
+        fprintf(stderr, "Receiver does not support transfers larger than %d bytes\n", INT_MAX);
+        fail_transfer(peer);
+        return;
+    }
+
+    // count how many frames we expect
+    ss->frame_count = get_frame_count(ss->len, ss->packet_size);
+    ss->base_frame = 1;
+    ss->read_frame = 1;
+    ss->next_frame = 1;
+    file_io_reset(&ss->io, 1, ss->file_offset);
+
+#if DEBUG
+    printf("Expecting to send %lld frames of %d bytes\n", ss->frame_count, ss->packet_size);
+#endif
+
+    // receivers that advertise their window may get a window of any size in flight. Older
+    // ones drop the frames past a window of LEGACY_WINDOW.
+    ss->window_end = LLONG_MAX; // until an ack advertises the window
+    ss->max_window_frames = get_max_window(ack->packet.ack.flags & XFER_WINDOW ? MAX_WINDOW : LEGACY_WINDOW, ss->packet_size);
+
+    ss->selective = ack->packet.ack.flags & XFER_SELECTIVE_REPEAT;
+    ss->ack_freq = ss->version >= WIRE_V2 && (ack->packet.ack.flags & XFER_ACK_FREQ);
+    if (ss->selective) {
+        ss->acked = bitmap_alloc(ss->max_window_frames);
+        ss->lost = bitmap_alloc(ss->max_window_frames);
+        ss->sent_seq = (long long*)malloc(ss->max_window_frames * sizeof(long long));
+        if (ss->acked == NULL || ss->lost == NULL || ss->sent_seq == NULL) {
+            perror("calloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+
+    // the receiver echoes XFER_FEC if it takes repair frames
+    ss->fec = FEC_RATIO != 0 && ss->selective && ss->version >= WIRE_V2 && (ack->packet.ack.flags & XFER_FEC);
+    if (ss->fec) {
+        ss->fec_buf = (char*)malloc((long)FEC_MAX_BLOCK_REPAIRS * ss->packet_size);
+        if (ss->fec_buf == NULL) {
+            perror("malloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+
+    // frames read from fd live in the window until they are acknowledged, a file that can
+    // be mapped is sent from the page cache instead
+    if (ss->msg == NULL && map_file(ss)) {
+        ss->window_frames = MIN(get_max_window(FILE_WINDOW, ss->packet_size), ss->max_window_frames);
+        ss->window = (char*)malloc((long)ss->window_frames * ss->packet_size);
+        if (ss->window == NULL) {
+            perror("malloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+
+    // without go-back-n the data frames are sent one at a time
+    int max_window = USE_GO_BACK_N || ss->selective ? ss->max_window_frames : 1;
+    if (peer->cc_packet_size == ss->packet_size) {
+        ss->cc = peer->cc;
+        cc_resume(&ss->cc, CC_ALGORITHM, get_window(INITIAL_WINDOW, ss->packet_size), max_window,
+            get_time_us() - peer->cc_end_us, get_rto_ms(&peer->rtt) * 1000LL);
+    }
+    else {
+        cc_init(&ss->cc, CC_ALGORITHM, get_window(INITIAL_WINDOW, ss->packet_size), max_window);
+    }
+    ss->inflight = 0;
+    ss->holes = false;
+    ss->send_seq = 0;
+    ss->acked_seq = -1;
+    ss->recovery_seq = 0;
+    ss->reset_counter = 0;
+    ss->deci_position = 0;
+    ss->next_send_us = 0;
+
+    peer->phase = PHASE_DATA;
+    peer->timer_us = get_time_us();
+    if (ss->frame_count == 0) {
+        send_end(peer);
+    }
+}
+
+/// @brief Take the room the receiver advertises in an ack, and size the send buffer of the
+/// socket for the congestion window, which follows the measured bandwidth-delay product
+/// @param peer
+/// @param ack
+static void update_send_window(peer_t* peer, const frame_t* ack) {
+    send_state_t* ss = &peer->ss;
+    if (ack->window >= 0) {
+        // acks may arrive out of order, only a later end counts once one is known
+        long long window_end = ack->header.frame_id + 1 + ack->window;
+        if (ss->window_end == LLONG_MAX || window_end > ss->window_end) {
+            ss->window_end = window_end;
+        }
+    }
+    grow_socket_buffer(peer->sockfd, SO_SNDBUF, (long long)cc_get_window(&ss->cc) * get_datagram_charge(ss->packet_size + MAX_DATA_HEADER));
+}
+
+/// @brief Handle an ack of the data frames with go-back-n. We allow the ack to be past the
+/// base, since the receiver only acks frames it received in order, so it has every frame
+/// before it. If we get a future ack, we most likely missed an ack.
+/// @param peer
+/// @param ack
+static void gbn_on_ack(peer_t* peer, const frame_t* ack) {
+    send_state_t* ss = &peer->ss;
+    if (ack->header.frame_id < ss->base_frame) {
+        return;
+    }
+
+    ss->reset_counter = 0;
+    long long now = get_time_us();
+    long long ack_frame_id = MIN(ack->header.frame_id, ss->frame_count);
+    int acked = ack_frame_id + 1 - ss->base_frame;
+    ss->base_frame = ack_frame_id + 1;
+    ss->next_frame = MAX(ss->next_frame, ss->base_frame);
+    peer->timer_us = now;
+
+    cc_ack_t cc_ack = { acked, ss->next_frame - ss->base_frame, peer->rtt.latest_us, peer->rtt.srtt_us, now };
+    cc_on_ack(&ss->cc, &cc_ack);
+    update_send_window(peer, ack);
+
+    // for large files, print progress
+    print_progress("Sent", &ss->deci_position, ss->base_frame, ss->frame_count);
+}
+
+/// @brief Send the data frames that are due with go-back-n, and go back to the base when
+/// its ack is late. Used with receivers that don't support selective repeat.
+/// @param peer
+static void gbn_poll(peer_t* peer) {
+    send_state_t* ss = &peer->ss;
+    long long now = get_time_us();
+
+    if (now - peer->timer_us >= get_rto_ms(&peer->rtt) * 1000LL) {
+        // failed to receive ack from base frame id
+        ss->reset_counter++;
+        if (ss->reset_counter > RETRY_COUNT) {
+            fprintf(stderr, "Failed to send frame\n");
+            fprintf(stderr, "Sent %lld frames out of %lld\n", ss->base_frame - 1, ss->frame_count);
+            fail_transfer(peer);
+            return;
+        }
+#if DEBUG
+        printf("Resetting base frame id to %lld\n", ss->base_frame);
+#endif
+        ss->next_frame = ss->base_frame;
+        cc_on_timeout(&ss->cc, now);
+
+        // increase timeout for failed frame
+        rtt_backoff(&peer->rtt);
+        peer->timer_us = now;
+    }
+
+    if (reserve_send_window(ss)) {
+        fail_transfer(peer);
+        return;
+    }
+
+    // send up to base + N frames. Frames go out one pacing quantum at a time instead
+    // of the whole window at once.
+    long long last_frame_id = MIN(MIN(ss->base_frame + cc_get_window(&ss->cc) - 1, ss->frame_count), ss->window_end - 1);
+    ss->next_send_us = MAX(ss->next_send_us, now);
+    while (ss->next_frame <= last_frame_id && ss->next_send_us <= now + PACING_QUANTUM_US) {
+        // the last frame the window allows needs its ack at once
+        if (queue_frame_by_id(ss, ss->next_frame, ss->next_frame == last_frame_id, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+            fail_transfer(peer);
+            return;
+        }
+        ss->next_frame++;
+        ss->next_send_us += cc_get_send_interval_us(&ss->cc);
+    }
+    if (flush_frames(peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fail_transfer(peer);
+    }
+}
+
+/// @brief Check if a frame was acknowledged, the frames before base_frame all were
+/// @param ss 
+/// @param id 
+/// @return true if acked
+static bool is_acked(const send_state_t* ss, long long id) {
+    if (id < ss->base_frame) {
+        return true;
+    }
+    return id < ss->base_frame + ss->max_window_frames && bitmap_get(ss->acked, id % ss->max_window_frames);
+}
+
+/// @brief Check if a frame of the window was found lost and waits to be resent
+/// @param ss 
+/// @param id 
+/// @return true if lost
+static bool is_lost(const send_state_t* ss, long long id) {
+    return id >= ss->base_frame && id < ss->base_frame + ss->max_window_frames && bitmap_get(ss->lost, id % ss->max_window_frames);
+}
+
+/// @brief Handle an ack of the data frames with selective repeat. Any ack tells us
+/// more about the window, even if it doesn't move the base.
+/// @param peer
+/// @param ack
+static void sr_on_ack(peer_t* peer, const frame_t* ack) {
+    send_state_t* ss = &peer->ss;
+    if (ack->header.frame_id < ss->base_frame - 1) {
+        return;
+    }
+
+    ss->reset_counter = 0;
+    long long now = get_time_us();
+    peer->timer_us = now;
+    int newly_acked = 0;
+
+    // cumulative part of the ack
+    long long cumulative = MIN(ack->header.frame_id, ss->next_frame - 1);
+    for (long long id = ss->base_frame; id <= cumulative; id++) {
+        if (!is_acked(ss, id)) {
+            bitmap_set(ss->acked, id % ss->max_window_frames);
+            ss->acked_seq = MAX(ss->acked_seq, ss->sent_seq[id % ss->max_window_frames]);
+            newly_acked++;
+        }
+    }
+
+    // selective part of the ack
+    if (ack->packet.ack.flags & XFER_SELECTIVE_REPEAT) {
+        for (int i = 0; i < SACK_BITS; i++) {
+            long long id = ack->packet.ack.sack_base + i;
+            if (id < ss->base_frame || id >= ss->next_frame) {
+                continue;
+            }
+            if (bitmap_get(ack->packet.ack.sack, i) && !is_acked(ss, id)) {
+                bitmap_set(ss->acked, id % ss->max_window_frames);
+                ss->acked_seq = MAX(ss->acked_seq, ss->sent_seq[id % ss->max_window_frames]);
+                newly_acked++;
+            }
+        }
+    }
+    ss->inflight -= newly_acked;
+
+    while (ss->base_frame < ss->next_frame && is_acked(ss, ss->base_frame)) {
+        // the slot goes to the frame a window ahead
+        bitmap_clear(ss->acked, ss->base_frame % ss->max_window_frames);
+        bitmap_clear(ss->lost, ss->base_frame % ss->max_window_frames);
+        ss->base_frame++;
+    }
+
+    // a frame is lost once enough frames sent after it have been acknowledged. With FEC
+    // the repair frames of its block may still rebuild it, so they count as sent with it.
+    // The sends are checked in the order they went out, each one once, so an ack costs
+    // the same however large the window is.
+    bool loss = false;
+    while (ss->sent.head + SACK_DUP_THRESH <= ss->acked_seq) {
+        long long seq = ss->sent.head;
+        long long id = id_queue_front(&ss->sent);
+        // skip repair frames, and frames that were acked, found lost or sent again since
+        if (id == 0 || is_acked(ss, id) || is_lost(ss, id) || ss->sent_seq[id % ss->max_window_frames] != seq) {
+            ss->sent.head++;
+            continue;
+        }
+        if (ss->fec) {
+            long long block = (id - 1) / FEC_BLOCK_FRAMES;
+            long long last = MIN((block + 1) * FEC_BLOCK_FRAMES, ss->frame_count);
+            if (last >= ss->next_frame) {
+                break;
+            }
+            seq = MAX(seq, ss->sent_seq[last % ss->max_window_frames] + ss->fec_sent[block % FEC_BLOCKS]);
+            if (seq + SACK_DUP_THRESH > ss->acked_seq) {
+                break;
+            }
+        }
+        bitmap_set(ss->lost, id % ss->max_window_frames);
+        if (id_queue_push(&ss->lost_ids, id)) {
+            fail_transfer(peer);
+            return;
+        }
+        ss->holes = true;
+        loss = loss || seq >= ss->recovery_seq;
+        ss->sent.head++;
+    }
+
+    cc_ack_t cc_ack = { newly_acked, ss->inflight, peer->rtt.latest_us, peer->rtt.srtt_us, now };
+    cc_on_ack(&ss->cc, &cc_ack);
+    update_send_window(peer, ack);
+    if (loss) {
+        // reduce the window once per window of lost frames
+        cc_on_loss(&ss->cc, now);
+        ss->recovery_seq = ss->send_seq;
+    }
+
+    // for large files, print progress
+    print_progress("Sent", &ss->deci_position, ss->base_frame, ss->frame_count);
+}
+
+/// @brief Check if selective repeat may send a frame once pacing allows it
+/// @param ss
+/// @return true if a hole or a new frame waits to be sent
+static bool sr_sendable(const send_state_t* ss) {
+    return ss->holes || (ss->next_frame <= ss->frame_count && ss->inflight < cc_get_window(&ss->cc)
+        && ss->next_frame - ss->base_frame < ss->max_window_frames && ss->next_frame < ss->window_end);
+}
+
+/// @brief Get the chance that more than repairs of frames frames are lost
+/// @param frames 
+/// @param repairs 
+/// @param loss chance that a frame is lost
+/// @return chance
+static double get_fec_failure(int frames, int repairs, double loss) {
+    // add up the chances that 0 to repairs frames are lost
+    double term = 1;
+    for (int i = 0; i < frames; i++) {
+        term *= 1 - loss;
+    }
+    double repaired = 0;
+    for (int lost = 0; lost <= repairs && lost <= frames; lost++) {
+        repaired += term;
+        term *= (double)(frames - lost) / (lost + 1) * loss / (1 - loss);
+    }
+    return 1 - repaired;
+}
+
+/// @brief Choose how many repair frames a block gets
+/// @param peer
+/// @param frames data frames in the block
+/// @return repair frames
+static int get_fec_repairs(const peer_t* peer, int frames) {
+    if (FEC_RATIO > 0) {
+        return MIN((int)(frames * FEC_RATIO + 0.999), FEC_MAX_BLOCK_REPAIRS);
+    }
+
+    // the fewest that rebuild the block unless more frames than expected are lost
+    double loss = MIN(peer->fec_loss_sent, 0.5);
+    for (int repairs = 0; repairs < FEC_MAX_BLOCK_REPAIRS; repairs++) {
+        if (get_fec_failure(frames + repairs, repairs, loss) <= FEC_TARGET_FAILURE) {
+            return repairs;
+        }
+    }
+    return FEC_MAX_BLOCK_REPAIRS;
+}
+
+/// @brief Add a data frame sent for the first time to the repair frames of its block, and
+/// queue them after the last frame of the block
+/// @param peer
+/// @param frame_id
+/// @return Return true on failure
+static bool fec_add_frame(peer_t* peer, long long frame_id) {
+    send_state_t* ss = &peer->ss;
+    int frame = (frame_id - 1) % FEC_BLOCK_FRAMES;
+    long long first = frame_id - frame;
+    int frames = MIN(FEC_BLOCK_FRAMES, ss->frame_count + 1 - first);
+    if (frame == 0) {
+        ss->fec_repairs = get_fec_repairs(peer, frames);
+        memset(ss->fec_buf, 0, (long)ss->fec_repairs * ss->packet_size);
+    }
+
+    int data_len;
+    const char* data = get_frame_data(ss, frame_id, &data_len);
+    if (data == NULL) {
+        return true;
+    }
+    for (int i = 0; i < ss->fec_repairs; i++) {
+        fec_encode(ss->fec_buf + (long)i * ss->packet_size, i, frame, data, data_len);
+    }
+    if (frame < frames - 1) {
+        return false;
+    }
+
+    // the repair frames take their share of the pacing like data frames
+    ss->fec_sent[(first - 1) / FEC_BLOCK_FRAMES % FEC_BLOCKS] = ss->fec_repairs;
+    for (int i = 0; i < ss->fec_repairs; i++) {
+        frame_t repair;
+        repair.header.type = REPAIR;
+        repair.header.frame_id = first;
+        repair.version = ss->version;
+        repair.timestamp = 0;
+        repair.xid = ss->xid;
+        repair.mapped = false;
+        repair.packet.repair.index = i;
+        repair.packet.repair.repairs = ss->fec_repairs;
+        repair.data = ss->fec_buf + (long)i * ss->packet_size;
+        repair.data_len = ss->packet_size;
+        if (queue_frame(&repair, peer->sockfd, get_peer_addr(peer), &peer->addr_len) || take_send_seq(ss, 0)) {
+            return true;
+        }
+        ss->next_send_us += cc_get_send_interval_us(&ss->cc);
+    }
+
+    // the next block reuses fec_buf
+    return flush_frames(peer->sockfd, get_peer_addr(peer), &peer->addr_len);
+}
+
+/// @brief Send the data frames that are due with selective repeat. The receiver keeps
+/// frames that arrive out of order, so only the frames it has not acknowledged are resent.
+/// @param peer
+static void sr_poll(peer_t* peer) {
+    send_state_t* ss = &peer->ss;
+    long long now = get_time_us();
+    if (ss->inflight == 0) {
+        peer->timer_us = now;
+    }
+
+    if (now - peer->timer_us >= get_rto_ms(&peer->rtt) * 1000LL) {
+        ss->reset_counter++;
+        if (ss->reset_counter > RETRY_COUNT) {
+            fprintf(stderr, "Failed to send frame\n");
+            fprintf(stderr, "Sent %lld frames out of %lld\n", ss->base_frame - 1, ss->frame_count);
+            fail_transfer(peer);
+            return;
+        }
+#if DEBUG
+        printf("Resending unacknowledged frames from %lld\n", ss->base_frame);
+#endif
+        for (long long id = ss->base_frame; id < ss->next_frame; id++) {
+            if (!is_acked(ss, id) && !is_lost(ss, id)) {
+                bitmap_set(ss->lost, id % ss->max_window_frames);
+                if (id_queue_push(&ss->lost_ids, id)) {
+                    fail_transfer(peer);
+                    return;
+                }
+                ss->holes = true;
+            }
+        }
+        cc_on_timeout(&ss->cc, now);
+        ss->recovery_seq = ss->send_seq;
+
+        // increase timeout for failed frame
+        rtt_backoff(&peer->rtt);
+        peer->timer_us = now;
+    }
+
+    // frames go out one pacing quantum at a time instead of the whole window at once
+    int interval_us = cc_get_send_interval_us(&ss->cc);
+    ss->next_send_us = MAX(ss->next_send_us, now);
+
+    if (reserve_send_window(ss)) {
+        fail_transfer(peer);
+        return;
+    }
+
+    // resend the holes in the order they were found
+    while (ss->lost_ids.head < ss->lost_ids.tail) {
+        long long id = id_queue_front(&ss->lost_ids);
+        if (is_acked(ss, id)) {
+            // frames before base_frame gave their slot away already
+            if (id >= ss->base_frame) {
+                bitmap_clear(ss->lost, id % ss->max_window_frames);
+            }
+            ss->lost_ids.head++;
+            continue;
+        }
+        if (ss->next_send_us > now + PACING_QUANTUM_US) {
+            break;
+        }
+        if (queue_frame_by_id(ss, id, true, peer->sockfd, get_peer_addr(peer), &peer->addr_len) || take_send_seq(ss, id)) {
+            fail_transfer(peer);
+            return;
+        }
+        bitmap_clear(ss->lost, id % ss->max_window_frames);
+        ss->lost_ids.head++;
+        ss->next_send_us += interval_us;
+    }
+    ss->holes = ss->lost_ids.head < ss->lost_ids.tail;
+
+    // send new frames while the window allows
+    while (sr_sendable(ss) && !ss->holes && ss->next_send_us <= now + PACING_QUANTUM_US) {
+        // the last frame the window allows needs its ack at once
+        bool ack_now = ss->next_frame == ss->frame_count || ss->inflight + 1 >= cc_get_window(&ss->cc)
+            || ss->next_frame + 1 - ss->base_frame >= ss->max_window_frames || ss->next_frame + 1 >= ss->window_end;
+        if (queue_frame_by_id(ss, ss->next_frame, ack_now, peer->sockfd, get_peer_addr(peer), &peer->addr_len)
+            || take_send_seq(ss, ss->next_frame)) {
+            fail_transfer(peer);
+            return;
+        }
+        if (ss->fec && fec_add_frame(peer, ss->next_frame)) {
+            fail_transfer(peer);
+            return;
+        }
+        ss->next_frame++;
+        ss->inflight++;
+        ss->next_send_us += interval_us;
+    }
+    if (flush_frames(peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fail_transfer(peer);
+    }
+}
+
+/// @brief Accept the options of the sender from a START frame, so the ack can echo them
+/// @param rs
+/// @param frame
+static void accept_start(recv_state_t* rs, const frame_t* frame) {
+    int flags = frame->packet.info.flags;
+    rs->flags = flags & (XFER_PACKET_SIZE | XFER_LARGE | XFER_INLINE | XFER_XID | XFER_ACK_FREQ | XFER_WINDOW
+        | (USE_SELECTIVE_REPEAT ? XFER_SELECTIVE_REPEAT : 0) | (USE_FEC ? XFER_FEC : 0));
+
+    // use the smaller of the payload sizes both sides want
+    rs->packet_size = PACKET_SIZE;
+    if (flags & XFER_PACKET_SIZE) {
+        rs->packet_size = MAX(1, MIN(frame->packet.info.packet_size, LOCAL_PACKET_SIZE));
+    }
+    rs->version = USE_WIRE_V2 && frame->packet.info.version >= WIRE_V2 ? WIRE_V2 : WIRE_V1;
+    rs->next_frame = 1;
+
+    // repair frames need selective repeat and the v2 header
+    if (!(rs->flags & XFER_SELECTIVE_REPEAT) || rs->version < WIRE_V2) {
+        rs->flags &= ~XFER_FEC;
+    }
+
+    // only the v2 header has room for the transfer id
+    if (rs->version < WIRE_V2 || frame->packet.info.start_id == 0) {
+        rs->flags &= ~XFER_XID;
+    }
+    rs->xid = rs->flags & XFER_XID ? frame->packet.info.start_id : 0;
+
+    // only the v2 header can mark the frames that need their ack at once, or carry the window
+    if (rs->version < WIRE_V2) {
+        rs->flags &= ~(XFER_ACK_FREQ | XFER_WINDOW);
+    }
+    rs->ack_every = rs->flags & XFER_ACK_FREQ ? MAX(1, MIN(frame->packet.info.ack_every, MAX_ACK_FREQUENCY)) : 1;
+
+    // the data is only taken from START if all of it is there, else it comes in DATA frames
+    if ((rs->flags & XFER_INLINE) && frame->data_len != get_start_bytes(frame)) {
+        rs->flags &= ~XFER_INLINE;
+    }
+    if (rs->flags & XFER_INLINE) {
+        rs->next_frame = get_frame_count(get_start_bytes(frame), rs->packet_size) + 1;
+    }
+}
+
+/// @brief Check if a frame is a resent START of the last transfer received inside its START
+/// @param peer
+/// @param frame
+/// @return Return true if it is
+static bool is_inline_resend(const peer_t* peer, const frame_t* frame) {
+    return frame->header.type == START && frame->header.frame_id == 0 && frame->packet.info.start_id != 0
+        && frame->packet.info.start_id == peer->inline_start_id;
+}
+
+/// @brief Check if a frame belongs to an earlier transfer by its start id. Frames without
+/// one, from legacy peers or of transfers in WIRE_V1, are left to the checks of each phase.
+/// @param peer
+/// @param frame
+/// @return Return true if it does
+static bool is_stale_frame(const peer_t* peer, const frame_t* frame) {
+    if (frame->xid == 0 || frame->xid == peer->xid) {
+        return false;
+    }
+    // the receiver takes any new START while it waits for one
+    return frame->header.type != START || peer->xid != 0;
+}
+
+/// @brief Ack a START frame again whose data we already have, our first ack was lost
+/// @param peer
+/// @param frame
+static void send_inline_ack(peer_t* peer, const frame_t* frame) {
+    recv_state_t rs;
+    memset(&rs, 0, sizeof(rs));
+    accept_start(&rs, frame);
+    if (send_ack(&rs, frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fprintf(stderr, "Failed to send ack\n");
+    }
+}
+
+/// @brief Handle a frame that arrived while we send
+/// @param peer
+/// @param frame
+static void sender_handle_frame(peer_t* peer, const frame_t* frame) {
+    // if there is an end frame from a previous transaction, we will ack it, but not use it.
+    if (frame->header.type == END) {
+        send_stale_ack(peer, frame);
+        return;
+    }
+    if (frame->header.type != ACK) {
+        return;
+    }
+
+    // every echoed timestamp measures one transmission, even of a resent frame
+    if (frame->timestamp != 0) {
+        rtt_sample(&peer->rtt, (uint32_t)(get_timestamp() - frame->timestamp));
+    }
+    if (frame->loss >= 0) {
+        peer->fec_loss_sent = frame->loss / 65535.0;
+    }
+
+    send_state_t* ss = &peer->ss;
+    switch (peer->phase) {
+    case PHASE_START:
+        if (frame->header.frame_id >= 0) {
+            control_rtt_sample(peer, frame);
+            // the receiver echoes XFER_INLINE once it has the data from START
+            if ((peer->control.packet.info.flags & XFER_INLINE) && (frame->packet.ack.flags & XFER_INLINE)) {
+                peer->phase = PHASE_DONE;
+#if DEBUG
+                printf("Sent %lld bytes inside START\n", ss->len);
+#endif
+                break;
+            }
+            start_data(peer, frame);
+        }
+        break;
+    case PHASE_DATA:
+        if (ss->selective) {
+            sr_on_ack(peer, frame);
+        }
+        else {
+            gbn_on_ack(peer, frame);
+        }
+        if (ss->base_frame > ss->frame_count) {
+            send_end(peer);
+        }
+        break;
+    case PHASE_END:
+        if (frame->header.frame_id >= peer->control.header.frame_id) {
+            control_rtt_sample(peer, frame);
+            peer->phase = PHASE_DONE;
+#if DEBUG
+            printf("Sent %lld bytes\n", ss->len);
+            printf("SRTT %lld us, RTTVAR %lld us, RTO %d ms\n", peer->rtt.srtt_us, peer->rtt.rttvar_us, get_rto_ms(&peer->rtt));
+#endif
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/// @brief Finish a transfer once its END frame arrived, or its data inside START
+/// @param peer
+static void recv_on_end(peer_t* peer) {
+    recv_state_t* rs = &peer->rs;
+
+    // drop what is left of a longer file
+    struct stat st;
+    if (rs->to_fd && rs->fd != -1 && fstat(rs->fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(rs->fd, rs->file_offset + rs->len) == -1) {
+        perror("ftruncate");
+        fail_transfer(peer);
+        return;
+    }
+
+    peer->fec_loss_received = rs->fec_loss;
+    free_recv_state(rs);
+    peer->phase = PHASE_DONE;
+#if DEBUG
+    printf("Received %lld bytes\n", rs->len);
+#endif
+}
+
+/// @brief Take the data of a transfer from its START frame, the transfer ends with the ack
+/// @param peer
+/// @param frame
+static void recv_inline(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    rs->len = get_start_bytes(frame);
+    rs->frame_count = get_frame_count(rs->len, rs->packet_size);
+
+    if (rs->to_fd) {
+        file_io_reset(&rs->io, 1, rs->file_offset);
+        if (rs->fd != -1 && rs->len > 0 && (file_io_submit(&rs->io, true, rs->fd, (char*)frame->data, rs->len, 0, 1)
+            || file_io_wait(&rs->io, LLONG_MAX))) {
+            fail_transfer(peer);
+            return;
+        }
+    }
+    else {
+        rs->data = (char*)malloc(MAX(rs->len, 1));
+        if (rs->data == NULL) {
+            perror("malloc");
+            fail_transfer(peer);
+            return;
+        }
+        memcpy(rs->data, frame->data, rs->len);
+    }
+
+    peer->inline_start_id = frame->packet.info.start_id;
+    if (send_ack(rs, frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fprintf(stderr, "Failed to send ack\n");
+    }
+    recv_on_end(peer);
+}
+
+/// @brief Accept the options and the size of the transfer from its START frame
+/// @param peer
+/// @param frame
+static void recv_on_start(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    accept_start(rs, frame);
+    peer->xid = frame->packet.info.start_id;
+    rs->fec_loss = peer->fec_loss_received;
+    rs->fec_repairs = 0;
+    if (rs->flags & XFER_INLINE) {
+        recv_inline(peer, frame);
+        return;
+    }
+
+    if (send_ack(rs, frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fprintf(stderr, "Failed to send ack\n");
+    }
+
+    rs->len = get_start_bytes(frame);
+    rs->frame_count = get_frame_count(rs->len, rs->packet_size);
+    rs->written_frame = 1;
+    rs->synced_bytes = 0;
+    file_io_reset(&rs->io, 1, rs->file_offset);
+#if DEBUG
+    printf("Expecting to receive %lld frames of %d bytes\n", rs->frame_count, rs->packet_size);
+#endif
+
+    // frames from next_frame on that may arrive. With FEC the received frames of the
+    // block of next_frame are kept as well.
+    int fec_frames = rs->flags & XFER_FEC ? FEC_BLOCK_FRAMES : 0;
+    rs->max_window_frames = get_max_window(MAX_WINDOW, rs->packet_size) + fec_frames;
+    if (rs->to_fd) {
+        // frames are written in order, only the ones that may arrive early are kept. With
+        // FEC the received frames of the block of next_frame are kept as well.
+        rs->window_frames = get_max_window(FILE_WINDOW, rs->packet_size) + fec_frames;
+        rs->window = (char*)malloc((long)rs->window_frames * rs->packet_size);
+        if (rs->window == NULL) {
+            perror("malloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+    else {
+        // allocate memory for data
+        rs->data = (char*)malloc(MAX(rs->len, 1));
+        if (rs->data == NULL) {
+            perror("malloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+
+    if (rs->flags & XFER_SELECTIVE_REPEAT) {
+        rs->received = bitmap_alloc(rs->max_window_frames);
+        if (rs->received == NULL) {
+            perror("calloc");
+            fail_transfer(peer);
+            return;
+        }
+    }
+
+    if (rs->flags & XFER_FEC) {
+        rs->fec_blocks = (struct fec_block_t*)calloc(FEC_BLOCKS, sizeof(struct fec_block_t));
+        if (rs->fec_blocks == NULL) {
+            perror("calloc");
+            fail_transfer(peer);
+            return;
+        }
+        for (int i = 0; i < FEC_BLOCKS; i++) {
+            rs->fec_blocks[i].block = -1;
+        }
+    }
+
+    peer->phase = rs->frame_count > 0 ? PHASE_DATA : PHASE_END;
+}
+
+/// @brief Move to the END frame once every data frame is received, and write out the rest of the data
+/// @param peer
+static void recv_on_data_done(peer_t* peer) {
+    if (flush_received(&peer->rs) || file_io_wait(&peer->rs.io, peer->rs.written_frame)) {
+        fail_transfer(peer);
+        return;
+    }
+    peer->phase = PHASE_END;
+}
+
+/// @brief Get the number of data frames in a block
+/// @param rs
+/// @param block
+/// @return frames
+static int fec_block_frames(const recv_state_t* rs, long long block) {
+    return (int)MIN(FEC_BLOCK_FRAMES, rs->frame_count - block * FEC_BLOCK_FRAMES);
+}
+
+/// @brief Add the frames a block lost before repair to the loss reported to the sender
+/// @param rs
+/// @param entry
+static void fec_count_block(recv_state_t* rs, struct fec_block_t* entry) {
+    if (entry->counted) {
+        return;
+    }
+    entry->counted = true;
+
+    int repairs = entry->sent_repairs >= 0 ? entry->sent_repairs : rs->fec_repairs;
+    int sent = fec_block_frames(rs, entry->block) + repairs;
+    double loss = (double)MAX(0, sent - entry->arrived) / sent;
+    rs->fec_loss += (loss - rs->fec_loss) / FEC_LOSS_GAIN;
+}
+
+/// @brief Get the entry of a block, it takes over the entry of an older block
+/// @param rs
+/// @param block
+/// @return NULL if a newer block has the entry
+static struct fec_block_t* fec_get_block(recv_state_t* rs, long long block) {
+    struct fec_block_t* entry = &rs->fec_blocks[block % FEC_BLOCKS];
+    if (entry->block == block) {
+        return entry;
+    }
+    if (entry->block > block) {
+        return NULL;
+    }
+
+    if (entry->block >= 0) {
+        fec_count_block(rs, entry);
+    }
+    fec_free_repairs(entry);
+    entry->block = block;
+    entry->received = 0;
+    entry->arrived = 0;
+    entry->sent_repairs = -1;
+    entry->counted = false;
+    return entry;
+}
+
+/// @brief Rebuild the lost frames of a block once it has as many repair frames as lost frames
+/// @param rs
+/// @param entry
+/// @return Return true if frames were rebuilt
+static bool fec_try_decode(recv_state_t* rs, struct fec_block_t* entry) {
+    int frames = fec_block_frames(rs, entry->block);
+    int lost = frames - entry->received;
+    if (lost == 0 || lost > entry->repairs) {
+        return false;
+    }
+    long long first = entry->block * FEC_BLOCK_FRAMES + 1;
+    if (first + frames - 1 >= rs->next_frame + rs->max_window_frames || get_frame_buffer(rs, first + frames - 1) == NULL) {
+        // the end of the block is past the window
+        return false;
+    }
+
+    char* out = (char*)malloc((long)lost * rs->packet_size);
+    if (out == NULL) {
+        return false;
+    }
+    const char* data[FEC_BLOCK_FRAMES];
+    int lens[FEC_BLOCK_FRAMES];
+    char* rebuilt[FEC_BLOCK_FRAMES];
+    int n = 0;
+    for (int i = 0; i < frames; i++) {
+        long long frame_id = first + i;
+        lens[i] = MIN(rs->len - (long long)rs->packet_size * (frame_id - 1), rs->packet_size);
+        data[i] = NULL;
+        if (is_received(rs, frame_id)) {
+            data[i] = get_frame_buffer(rs, frame_id);
+        }
+        else {
+            rebuilt[n] = out + (long)n * rs->packet_size;
+            n++;
+        }
+    }
+
+    bool failed = fec_decode(data, lens, frames, entry->data, entry->indices, entry->repairs, rebuilt, rs->packet_size);
+    if (!failed) {
+        n = 0;
+        for (int i = 0; i < frames; i++) {
+            if (data[i] == NULL) {
+                memcpy(get_frame_buffer(rs, first + i), rebuilt[n++], lens[i]);
+                bitmap_set(rs->received, (first + i) % rs->max_window_frames);
+            }
+        }
+        entry->received = frames;
+        fec_free_repairs(entry);
+    }
+    free(out);
+    return !failed;
+}
+
+/// @brief Count a data frame received for the first time in its block, and try to rebuild the rest of it
+/// @param rs
+/// @param frame_id
+static void fec_on_data(recv_state_t* rs, long long frame_id) {
+    long long block = (frame_id - 1) / FEC_BLOCK_FRAMES;
+    struct fec_block_t* entry = fec_get_block(rs, block);
+    if (entry != NULL) {
+        entry->received++;
+        if (!entry->counted) {
+            entry->arrived++;
+        }
+        fec_try_decode(rs, entry);
+    }
+
+    // the repair frames of a block go out right after it, whatever arrived of them
+    // is there once frames of two blocks later arrive
+    if (block >= 2) {
+        struct fec_block_t* old = &rs->fec_blocks[(block - 2) % FEC_BLOCKS];
+        if (old->block == block - 2) {
+            fec_count_block(rs, old);
+        }
+    }
+}
+
+/// @brief Keep a repair frame until its block is complete
+/// @param rs
+/// @param frame
+/// @return Return true if it rebuilt the lost frames of its block
+static bool fec_on_repair(recv_state_t* rs, const frame_t* frame) {
+    long long frame_id = frame->header.frame_id;
+    int index = frame->packet.repair.index;
+    if (frame_id < 1 || frame_id > rs->frame_count || (frame_id - 1) % FEC_BLOCK_FRAMES != 0
+        || index >= FEC_MAX_BLOCK_REPAIRS || frame->data_len < rs->packet_size) {
+        return false;
+    }
+    struct fec_block_t* entry = fec_get_block(rs, (frame_id - 1) / FEC_BLOCK_FRAMES);
+    if (entry == NULL) {
+        return false;
+    }
+    if (!entry->counted) {
+        entry->arrived++;
+    }
+    entry->sent_repairs = frame->packet.repair.repairs;
+    rs->fec_repairs = entry->sent_repairs;
+    if (entry->received == fec_block_frames(rs, entry->block)) {
+        return false;
+    }
+    for (int i = 0; i < entry->repairs; i++) {
+        if (entry->indices[i] == index) {
+            return false;
+        }
+    }
+
+    char* data = (char*)malloc(rs->packet_size);
+    if (data == NULL) {
+        return false;
+    }
+    memcpy(data, frame->data, rs->packet_size);
+    entry->indices[entry->repairs] = index;
+    entry->data[entry->repairs] = data;
+    entry->repairs++;
+    return fec_try_decode(rs, entry);
+}
+
+/// @brief Send the ack that is held back
+/// @param peer
+/// @param echo echo the timestamp of the frame. An ack held back by the timer would add its
+/// delay to the round trip of the sender, so it doesn't echo one.
+/// @param timestamp
+static void send_held_ack(peer_t* peer, bool echo, uint32_t timestamp) {
+    recv_state_t* rs = &peer->rs;
+    frame_t frame;
+    frame.header.frame_id = rs->ack_frame_id;
+    frame.timestamp = echo ? timestamp : 0;
+    rs->unacked = 0;
+    rs->ack_due_us = 0;
+    if (send_ack(rs, &frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+        fprintf(stderr, "Failed to send ack\n");
+    }
+}
+
+/// @brief Acknowledge a received frame, at once or once ack_every frames arrived
+/// @param peer
+/// @param frame
+/// @param now don't hold the ack back, on gaps, duplicates and frames the sender marked
+static void ack_frame(peer_t* peer, const frame_t* frame, bool now) {
+    recv_state_t* rs = &peer->rs;
+    rs->ack_frame_id = frame->header.frame_id;
+    if (now || frame->ack_now || ++rs->unacked >= rs->ack_every) {
+        send_held_ack(peer, true, frame->timestamp);
+    }
+    else if (rs->ack_due_us == 0) {
+        rs->ack_due_us = get_time_us() + ACK_DELAY_MS * 1000LL;
+    }
+}
+
+/// @brief Handle a data frame using selective repeat. Frames that arrive out
+/// of order are kept, and every ack reports which frames are still missing.
+/// @param peer
+/// @param frame
+static void sr_recv_frame(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    long long frame_id = frame->header.frame_id;
+    long long next_frame = rs->next_frame;
+    bool now = true; // duplicates, our ack was lost or is late
+    switch (frame->header.type) {
+    case DATA:
+        if (frame_id >= rs->next_frame && frame_id <= rs->frame_count && frame_id < rs->next_frame + rs->max_window_frames
+            && !is_received(rs, frame_id)) {
+            now = frame_id != next_frame; // a gap
+            long long data_offset = rs->packet_size * (frame_id - 1);
+            int data_size = MIN(rs->len - data_offset, rs->packet_size);
+            char* buf = get_frame_buffer(rs, frame_id);
+            if (frame->data_len < data_size || buf == NULL) {
+                // truncated frame or no room in the window, wait for the sender to resend it
+                return;
+            }
+
+            // copy data into buffer
+            memcpy(buf, frame->data, data_size);
+            bitmap_set(rs->received, frame_id % rs->max_window_frames);
+            if (rs->fec_blocks != NULL) {
+                fec_on_data(rs, frame_id);
+            }
+        }
+        break;
+    case START:
+        // our ack of the start frame was lost
+        break;
+    case END:
+        // end frame left over from a previous transaction
+        if (frame_id < rs->next_frame) {
+            send_stale_ack(peer, frame);
+        }
+        return;
+    case ACK:
+        return;
+    case REPAIR:
+        // only acked when it rebuilt frames
+        if (rs->fec_blocks == NULL || !fec_on_repair(rs, frame)) {
+            return;
+        }
+        break;
+    }
+
+    while (rs->next_frame <= rs->frame_count && is_received(rs, rs->next_frame)) {
+        // the slot goes to the frame a window ahead
+        bitmap_clear(rs->received, rs->next_frame % rs->max_window_frames);
+        rs->next_frame++;
+    }
+
+    // a gap was filled or the last frame arrived
+    now = now || rs->next_frame > next_frame + 1 || rs->next_frame > rs->frame_count;
+    ack_frame(peer, frame, now);
+
+    if (flush_received_lazy(rs, peer->sockfd)) {
+        fail_transfer(peer);
+        return;
+    }
+
+    print_progress("Received", &rs->deci_position, rs->next_frame - 1, rs->frame_count);
+    if (rs->next_frame > rs->frame_count) {
+        recv_on_data_done(peer);
+    }
+}
+
+/// @brief Handle a data frame in order. Used with senders that don't support selective repeat.
+/// @param peer
+/// @param frame
+static void gbn_recv_frame(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    if (frame->header.frame_id != rs->next_frame || frame->header.type != DATA) {
+        return;
+    }
+    rs->next_frame++;
+    ack_frame(peer, frame, rs->next_frame > rs->frame_count);
+
+    // copy data into buffer, frames arrive in order so the window always has room
+    long long data_offset = rs->packet_size * (frame->header.frame_id - 1);
+    char* buf = get_frame_buffer(rs, frame->header.frame_id);
+    if (buf == NULL) {
+        // the slot could not be written out
+        fail_transfer(peer);
+        return;
+    }
+    memcpy(buf, frame->data, MIN(rs->len - data_offset, frame->data_len));
+    if (flush_received_lazy(rs, peer->sockfd)) {
+        fail_transfer(peer);
+        return;
+    }
+
+    print_progress("Received", &rs->deci_position, rs->next_frame - 1, rs->frame_count);
+    if (rs->next_frame > rs->frame_count) {
+        recv_on_data_done(peer);
+    }
+}
+
+/// @brief Measure the rate of the data frames once per round trip, and grow the receive
+/// buffer of the socket to twice the frames that arrive in a round trip and a pacing quantum,
+/// up to the window. Bursts then fit in the buffer instead of being dropped as if lost.
+/// @param peer
+/// @param frame
+static void tune_recv_buffer(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    if (frame->header.type != DATA) {
+        return;
+    }
+    long long now = get_time_us();
+    if (rs->rate_start_us == 0) {
+        rs->rate_start_us = now;
+        rs->rate_frames = 0;
+    }
+    rs->rate_frames++;
+
+    long long interval_us = peer->rtt.srtt_us + PACING_QUANTUM_US;
+    long long elapsed_us = now - rs->rate_start_us;
+    if (elapsed_us < interval_us) {
+        return;
+    }
+    long long frames = MIN(2 * rs->rate_frames * interval_us / elapsed_us, get_recv_window(rs) + rs->next_frame - rs->written_frame);
+    grow_socket_buffer(peer->sockfd, SO_RCVBUF, frames * get_datagram_charge(rs->packet_size + MAX_DATA_HEADER));
+    rs->rate_start_us = now;
+    rs->rate_frames = 0;
+}
+
+/// @brief Handle a frame that arrived while we receive
+/// @param peer
+/// @param frame
+static void receiver_handle_frame(peer_t* peer, const frame_t* frame) {
+    recv_state_t* rs = &peer->rs;
+    if (frame->header.type == ACK) {
+        return;
+    }
+    rs->failures = 0;
+
+    if (peer->phase == PHASE_START) {
+        // we also ack the end frame that may be left over from a previous transaction
+        if (frame->header.type == END) {
+            send_stale_ack(peer, frame);
+        }
+        else if (frame->header.type == START && frame->header.frame_id == 0) {
+            recv_on_start(peer, frame);
+        }
+        return;
+    }
+    if (frame->header.type == REPAIR && peer->phase != PHASE_DATA) {
+        return;
+    }
+
+    // send again ack in case of failed ack, only ack if we have already passed this frame
+    if (frame->header.frame_id < rs->next_frame && (peer->phase == PHASE_END || !(rs->flags & XFER_SELECTIVE_REPEAT))) {
+        if (frame->header.type == END) {
+            send_stale_ack(peer, frame);
+        }
+        else if (send_ack(rs, frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+            fprintf(stderr, "Failed to send ack\n");
+        }
+        return;
+    }
+
+    if (peer->phase == PHASE_END) {
+        if (frame->header.frame_id == rs->next_frame && frame->header.type == END) {
+            rs->next_frame++;
+            if (send_ack(rs, frame, peer->sockfd, get_peer_addr(peer), &peer->addr_len)) {
+                fprintf(stderr, "Failed to send ack\n");
+            }
+            recv_on_end(peer);
+        }
+    }
+    else if (rs->flags & XFER_SELECTIVE_REPEAT) {
+        tune_recv_buffer(peer, frame);
+        sr_recv_frame(peer, frame);
+    }
+    else {
+        tune_recv_buffer(peer, frame);
+        gbn_recv_frame(peer, frame);
+    }
+}
+
+/// @brief Get the frame id the truncated frame ids of the peer are expanded around
+/// @param peer
+/// @return frame id
+static long long get_expected_frame(const peer_t* peer) {
+    if (!peer->sending) {
+        return peer->rs.next_frame;
+    }
+    switch (peer->phase) {
+    case PHASE_DATA:
+        return peer->ss.base_frame;
+    case PHASE_END:
+        return peer->control.header.frame_id;
+    default:
+        return 0;
+    }
+}
+
+/// @brief Get when the peer needs to be polled
+/// @param peer
+/// @return time in us, 0 if there is no timer
+static long long get_deadline_us(const peer_t* peer) {
+    if (peer->phase != PHASE_START && peer->phase != PHASE_DATA && peer->phase != PHASE_END) {
+        return 0;
+    }
+    if (!peer->sending) {
+        long long wake_us = peer->timer_us + peer->rs.wait_ms * 1000LL;
+        if (peer->rs.ack_due_us != 0) {
+            wake_us = MIN(wake_us, peer->rs.ack_due_us);
+        }
+        return wake_us;
+    }
+
+    long long wake_us = peer->timer_us + get_rto_ms(&peer->rtt) * 1000LL;
+    if (peer->phase == PHASE_DATA) {
+        // wake up when the next paced frames are due
+        const send_state_t* ss = &peer->ss;
+        bool sendable = ss->selective
+            ? sr_sendable(ss)
+            : ss->next_frame <= MIN(MIN(ss->base_frame + cc_get_window(&ss->cc) - 1, ss->frame_count), ss->window_end - 1);
+        if (sendable) {
+            wake_us = MIN(wake_us, ss->next_send_us - PACING_QUANTUM_US);
+        }
+    }
+    return wake_us;
+}
+
+peer_t* peer_create(int sockfd, const sockaddr* addr, socklen_t addr_len) {
+    peer_t* peer = (peer_t*)calloc(1, sizeof(peer_t));
+    if (peer == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    peer->sockfd = sockfd;
+    peer->addr_len = MIN(addr_len, sizeof(peer->addr));
+    if (addr != NULL) {
+        memcpy(&peer->addr, addr, peer->addr_len);
+    }
+    peer->rtt.rto_ms = DEFAULT_TIMEOUT_MS;
+    peer->phase = PHASE_IDLE;
+    return peer;
+}
+
+void peer_free(peer_t* peer) {
+    if (peer == NULL) {
+        return;
+    }
+    reset_transfer(peer);
+    free(peer);
+}
+
+/// @brief Start sending data from memory or from a file
+/// @param peer
+/// @param msg NULL to read the data from fd
+/// @param fd
+/// @param offset where the data starts in fd
+/// @param len
+static void start_send(peer_t* peer, const char* msg, int fd, off_t offset, long long len) {
+    reset_transfer(peer);
+    send_state_t* ss = &peer->ss;
+    memset(ss, 0, sizeof(*ss));
+    ss->msg = msg;
+    ss->fd = fd;
+    ss->file_offset = offset;
+    ss->len = len;
+    if (msg == NULL) {
+        posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+    }
+    peer->sending = true;
+
+    // we send the total size first so client can allocate space.
+    frame_t* frame = &peer->control;
+    memset(frame, 0, sizeof(*frame)); // zero memory
+    frame->header.type = START;
+    frame->header.frame_id = 0;
+    frame->packet.info.bytes = (uint32_t)len;
+    frame->packet.info.bytes_high = (uint32_t)(len >> 32);
+    frame->packet.info.flags = XFER_PACKET_SIZE | XFER_LARGE | (USE_SELECTIVE_REPEAT ? XFER_SELECTIVE_REPEAT : 0)
+        | (FEC_RATIO != 0 ? XFER_FEC : 0) | (USE_WIRE_V2 ? XFER_XID : 0) | (USE_WIRE_V2 && ACK_EVERY > 1 ? XFER_ACK_FREQ : 0)
+        | (USE_WIRE_V2 ? XFER_WINDOW : 0);
+    frame->packet.info.packet_size = LOCAL_PACKET_SIZE;
+    frame->packet.info.version = USE_WIRE_V2 ? WIRE_V2 : WIRE_V1;
+    frame->packet.info.start_id = get_start_id();
+    frame->packet.info.ack_every = ACK_EVERY;
+    peer->last_xid = peer->xid;
+    peer->xid = frame->packet.info.start_id;
+    frame->version = WIRE_V1;
+    frame->timestamp = 0;
+
+    // data that fits in one frame goes inside START
+    if (msg != NULL && len <= LOCAL_PACKET_SIZE) {
+        frame->packet.info.flags |= XFER_INLINE;
+        frame->data = msg;
+        frame->data_len = (int)len;
+    }
+
+    peer->phase = PHASE_START;
+    peer->tries = 0;
+    send_control(peer);
+}
+
+void peer_send_data(peer_t* peer, const char* msg, long long len) {
+    start_send(peer, msg, -1, 0, len);
+}
+
+void peer_send_data_from_fd(peer_t* peer, int fd, long long len) {
+    start_send(peer, NULL, fd, 0, len);
+}
+
+void peer_send_data_from_fd_at(peer_t* peer, int fd, long long offset, long long len) {
+    start_send(peer, NULL, fd, offset, len);
+}
+
+/// @brief Start waiting for the START frame of a transfer
+/// @param peer
+/// @param to_fd write the data to fd instead of keeping it in memory
+/// @param fd
+/// @param offset where the data goes in fd
+static void start_recv(peer_t* peer, bool to_fd, int fd, off_t offset) {
+    reset_transfer(peer);
+    recv_state_t* rs = &peer->rs;
+    memset(rs, 0, sizeof(*rs));
+    rs->to_fd = to_fd;
+    rs->fd = fd;
+    rs->file_offset = offset;
+    peer->last_xid = peer->xid;
+    peer->xid = 0;
+
+    // the sender may back off before resending, wait at least as long as it would
+    rs->wait_ms = MAX(DEFAULT_TIMEOUT_MS, 2 * get_rto_ms(&peer->rtt));
+    peer->sending = false;
+    peer->phase = PHASE_START;
+    peer->timer_us = get_time_us();
+}
+
+void peer_recv_data(peer_t* peer) {
+    start_recv(peer, false, -1, 0);
+}
+
+void peer_recv_data_to_fd(peer_t* peer, int fd) {
+    start_recv(peer, true, fd, 0);
+}
+
+void peer_recv_data_to_fd_at(peer_t* peer, int fd, long long offset) {
+    start_recv(peer, true, fd, offset);
+}
+
+void peer_handle_datagram(peer_t* peer, const char* buf, int len) {
+    if (peer->phase != PHASE_START && peer->phase != PHASE_DATA && peer->phase != PHASE_END) {
+        return;
+    }
+
+    frame_t frame;
+    if (decode_frame(&frame, buf, len, get_expected_frame(peer))) {
+        return;
+    }
+
+#if DEBUG > 1
+    printf("RECV ");
+    print_frame(&frame);
+#endif
+
+    if (is_inline_resend(peer, &frame)) {
+        send_inline_ack(peer, &frame);
+        return;
+    }
+    if (is_stale_frame(peer, &frame)) {
+        // the sender of the previous transfer keeps resending END until it gets our ack
+        if (frame.header.type == END && frame.xid == peer->last_xid) {
+            send_stale_ack(peer, &frame);
+        }
+        return;
+    }
+
+    if (peer->sending) {
+        sender_handle_frame(peer, &frame);
+    }
+    else {
+        // any frame restarts the wait of the receiver
+        peer->timer_us = get_time_us();
+        receiver_handle_frame(peer, &frame);
+    }
+}
+
+void peer_poll(peer_t* peer) {
+    if (peer->phase != PHASE_START && peer->phase != PHASE_DATA && peer->phase != PHASE_END) {
+        return;
+    }
+
+    long long now = get_time_us();
+    if (!peer->sending) {
+        recv_state_t* rs = &peer->rs;
+        if (rs->ack_due_us != 0 && now >= rs->ack_due_us) {
+            send_held_ack(peer, false, 0);
+        }
+        if (now - peer->timer_us < rs->wait_ms * 1000LL) {
+            return;
+        }
+        peer->timer_us = now;
+        if (++rs->failures >= RETRY_COUNT) {
+            if (peer->phase == PHASE_DATA) {
+                fprintf(stderr, "Failed to receive frame %lld\n", rs->next_frame);
+            }
+            else if (peer->phase == PHASE_END) {
+                fprintf(stderr, "Failed to receive end frame\n");
+            }
+            fail_transfer(peer);
+        }
+        return;
+    }
+
+    if (peer->phase == PHASE_DATA) {
+        if (peer->ss.selective) {
+            sr_poll(peer);
+        }
+        else {
+            gbn_poll(peer);
+        }
+        return;
+    }
+
+    // resend START or END until it is acknowledged
+    if (now - peer->timer_us < get_rto_ms(&peer->rtt) * 1000LL) {
+        return;
+    }
+    rtt_backoff(&peer->rtt);
+    if (peer->tries >= RETRY_COUNT) {
+        printf("Failed to send frame:\n");
+        print_frame(&peer->control);
+        printf("Transaction dropped\n");
+        fprintf(stderr, "Failed to send %s frame\n", peer->phase == PHASE_START ? "start" : "end");
+        fail_transfer(peer);
+        return;
+    }
+    send_control(peer);
+}
+
+int peer_get_timeout_ms(const peer_t* peer) {
+    long long deadline_us = get_deadline_us(peer);
+    if (deadline_us == 0) {
+        return -1;
+    }
+    return MAX(0, (deadline_us - get_time_us() + 999) / 1000);
+}
+
+transfer_status peer_get_status(const peer_t* peer) {
+    switch (peer->phase) {
+    case PHASE_DONE:
+        return TRANSFER_DONE;
+    case PHASE_FAILED:
+        return TRANSFER_FAILED;
+    default:
+        return TRANSFER_RUNNING;
+    }
+}
+
+long long peer_get_length(const peer_t* peer) {
+    return peer->sending ? peer->ss.len : peer->rs.len;
+}
+
+long long peer_get_written(const peer_t* peer) {
+    const recv_state_t* rs = &peer->rs;
+    if (peer->sending || !rs->to_fd || rs->io.failed) {
+        return 0;
+    }
+    if (peer->phase == PHASE_DONE) {
+        return rs->len;
+    }
+    // the writes in flight are done once the transfer stopped, see free_recv_state
+    return MAX(0, MIN((long long)rs->packet_size * (rs->io.done_frame - 1), rs->len));
+}
+
+void* peer_take_data(peer_t* peer, long long* len) {
+    if (peer->sending || peer->phase != PHASE_DONE || peer->rs.data == NULL) {
+        return NULL;
+    }
+    char* data = peer->rs.data;
+    peer->rs.data = NULL;
+    if (len != NULL) {
+        *len = peer->rs.len;
+    }
+    return data;
+}
+
+bool recv_datagram(int sockfd, const char** buf, int* len, sockaddr* addr, socklen_t* addr_len) {
+    return recv_batched(buf, len, sockfd, 0, addr, addr_len);
+}
+
+bool recv_datagram_pending(int sockfd) {
+    return recv_pending(sockfd);
+}
+
+int get_recv_fd(int sockfd) {
+#if USE_IO_URING
+    struct uring_engine_t* engine = get_engine();
+    if (engine != NULL) {
+        uring_setup_socket(engine, sockfd);
+        if (!engine->armed && uring_arm(engine, sockfd)) {
+            handle_error("io_uring_enter");
+        }
+        return engine->ring.fd;
+    }
+#endif
+    return sockfd;
+}
+
+// peer of the blocking calls, the round trip estimate is kept across them
+static thread_local peer_t BLOCKING_PEER = { .rtt = { .rto_ms = DEFAULT_TIMEOUT_MS } };
+
+void peer_get_rtt_info(const peer_t* peer, rtt_info_t* info) {
+    info->srtt_us = peer->rtt.srtt_us;
+    info->rttvar_us = peer->rtt.rttvar_us;
+    info->rto_ms = get_rto_ms(&peer->rtt);
+}
+
+void get_rtt_info(rtt_info_t* info) {
+    peer_get_rtt_info(&BLOCKING_PEER, info);
+}
+
+/// @brief Point the peer of the blocking calls at the socket and address of a call
+/// @param sockfd
+/// @param addr NULL if the socket is connected
+/// @param addr_len
+/// @return the peer
+static peer_t* get_blocking_peer(int sockfd, sockaddr* addr, socklen_t* addr_len) {
+    peer_t* peer = &BLOCKING_PEER;
+    if (peer->sockfd != sockfd) {
+        // the congestion state belongs to the path of another socket
+        peer->cc_packet_size = 0;
+    }
+    peer->sockfd = sockfd;
+    peer->addr_len = 0;
+    if (addr != NULL) {
+        peer->addr_len = MIN(*addr_len, sizeof(peer->addr));
+        memcpy(&peer->addr, addr, peer->addr_len);
+    }
+    return peer;
+}
+
+/// @brief Run the transfer of a peer until it is done, waiting for its frames
+/// @param peer
+/// @param addr if not NULL, the peer is wherever its frames come from, like recvfrom
+/// @param addr_len
+/// @param timeout_ms return once this passed even if the transfer runs, -1 to wait until it is done
+/// @return Return true on failure
+static bool run_transfer(peer_t* peer, sockaddr* addr, socklen_t* addr_len, int timeout_ms) {
+    long long deadline_us = timeout_ms == -1 ? LLONG_MAX : get_time_us() + timeout_ms * 1000LL;
+    while (true) {
+        // handle the frames that already arrived before sending more
+        if (!recv_pending(peer->sockfd)) {
+            peer_poll(peer);
+        }
+        if (peer_get_status(peer) != TRANSFER_RUNNING) {
+            break;
+        }
+
+        int wait_ms = peer_get_timeout_ms(peer);
+        if (deadline_us != LLONG_MAX) {
+            long long left_us = deadline_us - get_time_us();
+            if (left_us <= 0) {
+                break;
+            }
+            wait_ms = wait_ms == -1 ? (int)((left_us + 999) / 1000) : (int)MIN(wait_ms, (left_us + 999) / 1000);
+        }
+
+        const char* buf;
+        int len;
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        if (recv_batched(&buf, &len, peer->sockfd, wait_ms, addr == NULL ? NULL : (sockaddr*)&from, &from_len)) {
+            continue;
+        }
+        if (addr != NULL) {
+            memcpy(&peer->addr, &from, from_len);
+            peer->addr_len = from_len;
+        }
+        peer_handle_datagram(peer, buf, len);
+    }
+
+    if (addr != NULL && peer->addr_len > 0) {
+        memcpy(addr, &peer->addr, MIN(*addr_len, peer->addr_len));
+        *addr_len = peer->addr_len;
+    }
+    return peer_get_status(peer) == TRANSFER_FAILED;
+}
+
+bool peer_wait(peer_t* peer) {
+    return run_transfer(peer, NULL, NULL, -1);
+}
+
+transfer_status peer_run(peer_t* peer, int timeout_ms) {
+    run_transfer(peer, NULL, NULL, timeout_ms);
+    return peer_get_status(peer);
+}
+
+/// @brief Send some data structure
+/// @param sockfd socket file descriptor
+/// @param msg pointer to data
+/// @param len length of data
+/// @param dest_addr
+/// @param dest_addr_len
+/// @return Return bytes sent. -1 on failure
+long long send_data(int sockfd, const char* msg, long long len, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    peer_t* peer = get_blocking_peer(sockfd, dest_addr, dest_addr_len);
+    peer_send_data(peer, msg, len);
+    if (run_transfer(peer, dest_addr, dest_addr_len, -1)) {
+        return -1;
+    }
+    return len;
+}
+
+long long send_data_from_fd(int sockfd, int fd, long long len, sockaddr* dest_addr, socklen_t* dest_addr_len) {
+    peer_t* peer = get_blocking_peer(sockfd, dest_addr, dest_addr_len);
+    peer_send_data_from_fd(peer, fd, len);
+    if (run_transfer(peer, dest_addr, dest_addr_len, -1)) {
+        return -1;
+    }
+    return len;
+}
+
+/// @brief Receive data from socket
+/// @param sockfd
+/// @param len
+/// @param client_addr
+/// @param client_addr_len
+/// @return pointer to data on success, NULL on failure
+void* recv_data(int sockfd, long long* len, sockaddr* client_addr, socklen_t* client_addr_len) {
+    // give a dummy length to avoid null error
+    long long dummy_len = 0;
+    if (len == NULL) {
+        len = &dummy_len;
+    }
+    *len = 0;
+
+    peer_t* peer = get_blocking_peer(sockfd, client_addr, client_addr_len);
+    peer_recv_data(peer);
+    if (run_transfer(peer, client_addr, client_addr_len, -1)) {
+        return NULL;
+    }
+    return peer_take_data(peer, len);
+}
+
+long long recv_data_to_fd(int sockfd, int fd, sockaddr* client_addr, socklen_t* client_addr_len) {
+    peer_t* peer = get_blocking_peer(sockfd, client_addr, client_addr_len);
+    peer_recv_data_to_fd(peer, fd);
+    if (run_transfer(peer, client_addr, client_addr_len, -1)) {
+        return -1;
+    }
+    return peer_get_length(peer);
 }
@@ -0,0 +1,219 @@
+/**
+ * @file my_uring.c
+ * @author Kai Dewey
+ */
+
+#define _GNU_SOURCE // syscall, MAP_POPULATE
+
+#include "my_uring.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(uring_t* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return true;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        // too old to wait for completions with a timeout
+        close(ring->fd);
+        errno = ENOSYS;
+        return true;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return true;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+        ring->cq_ring_size = 0; // unmapped with the submission queue
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return true;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring_size > 0) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return true;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char* cq = (char*)ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // the sqes are always submitted in order, so slot i of the array always holds sqe i
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    return false;
+}
+
+void uring_free(uring_t* ring) {
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size > 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_enter(ring, 0, 0)) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool uring_enter(uring_t* ring, unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return false;
+    }
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000LL };
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = io_uring_enter(ring->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    else {
+        ret = io_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+    return ret == -1;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool uring_setup_buffers(uring_t* ring, unsigned short group, unsigned count, unsigned size) {
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return true;
+    }
+    ring->buffers = (char*)malloc((size_t)count * size);
+    if (ring->buffers == NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+        return true;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        free(ring->buffers);
+        ring->buf_ring = NULL;
+        ring->buffers = NULL;
+        return true;
+    }
+
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    for (unsigned bid = 0; bid < count; bid++) {
+        uring_recycle_buffer(ring, bid);
+    }
+    return false;
+}
+
+char* uring_get_buffer(uring_t* ring, unsigned bid) {
+    return ring->buffers + (size_t)bid * ring->buf_size;
+}
+
+void uring_recycle_buffer(uring_t* ring, unsigned bid) {
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_get_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+#endif // __linux__
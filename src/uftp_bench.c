@@ -0,0 +1,170 @@
+/* Author: Kai Dewey
+ * uftp_bench.c - Loopback throughput of send_data and recv_data
+ * usage: uftp_bench [megabytes]
+ */
+#include "my_udp.h"
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+
+#define DEFAULT_BENCH_MB 32
+#define BENCH_ROUNDS 3
+#define BENCH_LARGE_PACKET_SIZE 60000
+
+typedef struct {
+    const char* name;
+    bool batch_io;
+    int packet_size;
+    bool io_uring;
+} bench_mode_t;
+
+static const bench_mode_t MODES[] = {
+    { "per-frame sendto/recvfrom", false, PACKET_SIZE, false },
+    { "batched sendmmsg/recvmmsg", true, PACKET_SIZE, false },
+    { "batched, 60000 byte frames", true, BENCH_LARGE_PACKET_SIZE, false },
+    { "io_uring", true, PACKET_SIZE, true },
+    { "io_uring, 60000 byte frames", true, BENCH_LARGE_PACKET_SIZE, true },
+};
+#define MODE_COUNT ((int)(sizeof(MODES) / sizeof(MODES[0])))
+
+static long long get_time_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int get_loopback_socket(sockaddr_in* addr) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s == -1) {
+        handle_error("socket");
+    }
+
+    int buf_size = 4 * 1024 * 1024;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (sockaddr*)addr, sizeof(*addr)) == -1) {
+        handle_error("bind");
+    }
+
+    socklen_t addr_len = sizeof(*addr);
+    if (getsockname(s, (sockaddr*)addr, &addr_len) == -1) {
+        handle_error("getsockname");
+    }
+    return s;
+}
+
+/// @brief Receive every transfer of the benchmark
+static void run_receiver(int s) {
+    // keep the progress output of recv_data out of the results
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        set_batch_io(MODES[mode].batch_io);
+        set_packet_size(MODES[mode].packet_size);
+        set_io_uring(MODES[mode].io_uring);
+        for (int i = 0; i < BENCH_ROUNDS; i++) {
+            sockaddr_storage client_addr;
+            socklen_t client_addr_len = sizeof(client_addr);
+            long long len;
+            char* data = recv_data(s, &len, (sockaddr*)&client_addr, &client_addr_len);
+            if (data == NULL) {
+                fprintf(stderr, "receiver: transfer failed\n");
+                exit(EXIT_FAILURE);
+            }
+            free(data);
+        }
+    }
+}
+
+/// @brief Send the benchmark transfers and report the frame rate of each mode
+static void run_sender(int s, int len) {
+    char* data = malloc(len);
+    if (data == NULL) {
+        handle_error("malloc");
+    }
+    for (int i = 0; i < len; i++) {
+        data[i] = (char)i;
+    }
+
+    // keep the progress output of send_data out of the results
+    fflush(stdout);
+    int stdout_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        set_batch_io(MODES[mode].batch_io);
+        set_packet_size(MODES[mode].packet_size);
+        set_io_uring(MODES[mode].io_uring);
+
+        long long elapsed_us = 0;
+        for (int i = 0; i < BENCH_ROUNDS; i++) {
+            dup2(null_fd, STDOUT_FILENO);
+            long long start = get_time_us();
+            long long sent = send_data(s, data, len, NULL, NULL);
+            elapsed_us += get_time_us() - start;
+            fflush(stdout);
+            dup2(stdout_fd, STDOUT_FILENO);
+
+            if (sent == -1) {
+                fprintf(stderr, "sender: transfer failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        int packet_size = MODES[mode].packet_size;
+        double frames = (double)BENCH_ROUNDS * ((len + packet_size - 1) / packet_size);
+        double seconds = elapsed_us / 1e6;
+        rtt_info_t rtt;
+        get_rtt_info(&rtt);
+        printf("%-28s %10.0f frames/s %8.1f MB/s  srtt %6d us  rto %4d ms\n", MODES[mode].name, frames / seconds,
+            (double)BENCH_ROUNDS * len / (1024 * 1024) / seconds, rtt.srtt_us, rtt.rto_ms);
+        fflush(stdout);
+    }
+
+    close(null_fd);
+    close(stdout_fd);
+    free(data);
+}
+
+int main(int argc, char** argv) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : DEFAULT_BENCH_MB;
+    if (argc > 2 || megabytes <= 0) {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        return 1;
+    }
+
+    sockaddr_in receiver_addr;
+    int receiver = get_loopback_socket(&receiver_addr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        handle_error("fork");
+    }
+    if (pid == 0) {
+        run_receiver(receiver);
+        close(receiver);
+        return 0;
+    }
+    close(receiver);
+
+    sockaddr_in sender_addr;
+    int sender = get_loopback_socket(&sender_addr);
+    if (connect(sender, (sockaddr*)&receiver_addr, sizeof(receiver_addr)) == -1) {
+        handle_error("connect");
+    }
+
+    printf("Sending %d MB over loopback, %d rounds per mode\n", megabytes, BENCH_ROUNDS);
+    run_sender(sender, megabytes * 1024 * 1024);
+    close(sender);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
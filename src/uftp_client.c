@@ -1,8 +1,11 @@
 /* Author: Kai Dewey
  * udpclient.c - A simple UDP client
- * usage: udpclient <host> <port>
+ * usage: udpclient [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-u] [-z] <host> <port>
  */
 #include "my_repl.h"
+#include "my_udp.h"
+
+#include <getopt.h>
 
 int get_socket(char* hostname, char* port) {
     struct addrinfo hints, * res;
@@ -44,12 +47,52 @@ int get_socket(char* hostname, char* port) {
 }
 
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <hostname> <port>\n", argv[0]);
+    int opt;
+    cc_algorithm algorithm;
+    double ratio;
+    while ((opt = getopt(argc, argv, "s:c:a:f:uz")) != -1) {
+        switch (opt) {
+        case 's':
+            set_packet_size(atoi(optarg));
+            break;
+        case 'c':
+            if (cc_parse(optarg, &algorithm)) {
+                fprintf(stderr, "unknown congestion control: %s\n", optarg);
+                return 1;
+            }
+            set_congestion_control(algorithm);
+            break;
+        case 'a':
+            if (atoi(optarg) < 1) {
+                fprintf(stderr, "invalid ack frequency: %s\n", optarg);
+                return 1;
+            }
+            set_ack_frequency(atoi(optarg));
+            break;
+        case 'f':
+            if (fec_parse(optarg, &ratio)) {
+                fprintf(stderr, "invalid repair ratio: %s\n", optarg);
+                return 1;
+            }
+            set_fec(ratio);
+            break;
+        case 'u':
+            set_io_uring(true);
+            break;
+        case 'z':
+            set_zerocopy(true);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-u] [-z] <hostname> <port>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-u] [-z] <hostname> <port>\n", argv[0]);
         return 1;
     }
 
-    int s = get_socket(argv[1], argv[2]);
+    int s = get_socket(argv[optind], argv[optind + 1]);
     my_repl(s);
 
     // char* msg = "what is up!";
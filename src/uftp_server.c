@@ -1,13 +1,25 @@
 /* Author: Kai Dewey
  * udpserver.c - A simple UDP echo server
- * usage: udpserver <port>
+ * usage: udpserver [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-t threads] [-u] [-z] [-m megabytes] [-d none|batched|strict] <port>
  */
+#define _GNU_SOURCE // SO_REUSEPORT
+
 #include "my_udp.h"
 #include "my_ftp.h"
+#include "my_cache.h"
+#include "my_listing.h"
+
+#include <getopt.h>
+#include <pthread.h>
 
 #define BACKLOG 5
 
-int get_socket(char* port) {
+/// @brief Bind a socket to the port
+/// @param port 
+/// @param reuseport let the sockets of the other threads bind the same port. The kernel
+/// hashes the addresses of each datagram to pick a socket, so a client always reaches the same one.
+/// @return socket
+int get_socket(char* port, bool reuseport) {
     struct addrinfo hints, * res;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -20,9 +32,6 @@ int get_socket(char* port) {
         return 2;
     }
 
-    printf("Staring server on port %s\n", port);
-    fflush(stdout);
-
     int s = -1;
     // loop through all the results and bind to the first we can
     for (struct addrinfo* p = res; p != NULL; p = p->ai_next) {
@@ -32,8 +41,17 @@ int get_socket(char* port) {
             continue;
         }
 
+        int enabled = 1;
+        if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1) {
+            close(s);
+            s = -1;
+            perror("listener: setsockopt");
+            continue;
+        }
+
         if (bind(s, p->ai_addr, p->ai_addrlen) == -1) {
             close(s);
+            s = -1;
             perror("listener: bind");
             continue;
         }
@@ -51,18 +69,120 @@ int get_socket(char* port) {
     return s;
 }
 
+static void* run_worker(void* arg) {
+    run_server((int)(intptr_t)arg);
+    return NULL;
+}
+
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "io-uring", no_argument, NULL, 'u' },
+        { "zerocopy", no_argument, NULL, 'z' },
+        { "cache", required_argument, NULL, 'm' },
+        { "durability", required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    int threads = 1;
+    cc_algorithm algorithm;
+    double ratio;
+    sync_policy policy;
+    set_sync_policy(SYNC_BATCHED);
+    while ((opt = getopt_long(argc, argv, "s:c:a:f:t:uzm:d:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            set_packet_size(atoi(optarg));
+            break;
+        case 'c':
+            if (cc_parse(optarg, &algorithm)) {
+                fprintf(stderr, "unknown congestion control: %s\n", optarg);
+                return 1;
+            }
+            set_congestion_control(algorithm);
+            break;
+        case 'a':
+            if (atoi(optarg) < 1) {
+                fprintf(stderr, "invalid ack frequency: %s\n", optarg);
+                return 1;
+            }
+            set_ack_frequency(atoi(optarg));
+            break;
+        case 'f':
+            if (fec_parse(optarg, &ratio)) {
+                fprintf(stderr, "invalid repair ratio: %s\n", optarg);
+                return 1;
+            }
+            set_fec(ratio);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads < 1) {
+                fprintf(stderr, "invalid number of threads: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            set_io_uring(true);
+            break;
+        case 'z':
+            set_zerocopy(true);
+            break;
+        case 'm':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "invalid cache size: %s\n", optarg);
+                return 1;
+            }
+            set_file_cache(atoi(optarg) * 1024LL * 1024);
+            break;
+        case 'd':
+            if (sync_policy_parse(optarg, &policy)) {
+                fprintf(stderr, "unknown durability: %s\n", optarg);
+                return 1;
+            }
+            set_sync_policy(policy);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-t|--threads threads] [-u|--io-uring] [-z|--zerocopy] [-m|--cache megabytes] [-d|--durability none|batched|strict] <port>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-s packet_size] [-c cubic|bbr] [-a ack_frequency] [-f ratio|auto] [-t|--threads threads] [-u|--io-uring] [-z|--zerocopy] [-m|--cache megabytes] [-d|--durability none|batched|strict] <port>\n", argv[0]);
         return 1;
     }
 
-    int s = get_socket(argv[1]);
+    printf("Staring server on port %s\n", argv[optind]);
+    fflush(stdout);
+    listing_open();
+
+    if (threads == 1) {
+        run_server(get_socket(argv[optind], false));
+        return 0;
+    }
 
-    while (1) {
-        handle_session(s);
-        printf("end of client session\n");
+    // one socket and one event loop per thread, all sockets are bound before any client is served
+    pthread_t* workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    int* sockets = (int*)malloc(threads * sizeof(int));
+    if (workers == NULL || sockets == NULL) {
+        handle_error("malloc");
+    }
+    for (int i = 0; i < threads; i++) {
+        sockets[i] = get_socket(argv[optind], true);
+    }
+    for (int i = 0; i < threads; i++) {
+        int err = pthread_create(&workers[i], NULL, run_worker, (void*)(intptr_t)sockets[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
     }
 
+    free(workers);
+    free(sockets);
     return 0;
 }
@@ -0,0 +1,56 @@
+/**
+ * @file rtt_test.c
+ * @author Kai Dewey
+ * @brief Checks of the round trip estimator of my_udp.c, see rtt_sample
+ */
+
+// the estimator is static, test it from inside the file
+#include "../src/my_udp.c"
+
+static int FAILURES;
+
+static void check(bool ok, const char* what, long long value, long long expected) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: %lld, expected %lld\n", what, value, expected);
+        FAILURES++;
+    }
+}
+
+/// @brief A sample above SRTT moves RTTVAR by the distance to it (RFC 6298)
+static void test_sample_above_srtt() {
+    struct rtt_state_t rtt = { .valid = true, .srtt_us = 1000, .rttvar_us = 500 };
+    rtt_sample(&rtt, 2000);
+    check(rtt.rttvar_us == 625, "rttvar after a sample above srtt", rtt.rttvar_us, 625);
+    check(rtt.srtt_us == 1125, "srtt after a sample above srtt", rtt.srtt_us, 1125);
+}
+
+/// @brief A sample below SRTT moves RTTVAR the same way
+static void test_sample_below_srtt() {
+    struct rtt_state_t rtt = { .valid = true, .srtt_us = 2000, .rttvar_us = 500 };
+    rtt_sample(&rtt, 1000);
+    check(rtt.rttvar_us == 625, "rttvar after a sample below srtt", rtt.rttvar_us, 625);
+    check(rtt.srtt_us == 1875, "srtt after a sample below srtt", rtt.srtt_us, 1875);
+}
+
+/// @brief On a 200 ms link with jitter the timeout stays above the round trip
+static void test_jittery_link() {
+    struct rtt_state_t rtt = { 0 };
+    long long samples[] = { 200000, 230000, 210000, 260000, 205000, 240000, 250000 };
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        rtt_sample(&rtt, samples[i]);
+        check(rtt.rttvar_us > 0, "rttvar on a jittery link", rtt.rttvar_us, 1);
+        check(rtt.rto_ms * 1000LL > rtt.srtt_us + 4 * RTT_GRANULARITY_US, "rto on a jittery link",
+            rtt.rto_ms * 1000LL, rtt.srtt_us + 4 * RTT_GRANULARITY_US);
+    }
+}
+
+int main() {
+    test_sample_above_srtt();
+    test_sample_below_srtt();
+    test_jittery_link();
+    if (FAILURES > 0) {
+        return 1;
+    }
+    printf("rtt_test: ok\n");
+    return 0;
+}